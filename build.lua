@@ -63,7 +63,7 @@ end
 
 ----- C -----
 local cc = os.getenv("CC") or "cc"
-local csrc = "src/background_renderer.c src/entity_renderer.c src/main.c src/renderer_defs.c src/shaderutil.c"
+local csrc = "src/apng_writer.c src/background_renderer.c src/canvas_kernels.c src/disk_cache.c src/entity_renderer.c src/frame_queue.c src/frame_stream.c src/gif_recorder.c src/gpu_resources.c src/image_formats.c src/image_loader.c src/layer.c src/main.c src/png_writer.c src/poster.c src/renderer_defs.c src/readback.c src/render_graph.c src/render_thread.c src/render_view.c src/replay_buffer.c src/shaderutil.c src/startup_timeline.c src/stream_canvas.c src/tiled_canvas.c src/upload_context.c src/video_sink.c src/worker_pool.c"
 
 if not Execute("pkg-config --exists", pkgs) then
     Error("pkg-config could not find one of: %s", pkgs)
@@ -49,10 +49,29 @@ end
 
 math.sign = function(v) return v < 0 and -1 or v > 0 and 1 or 0 end
 
+-- Cursor position is sampled once per frame so that every MousePosition()
+-- call in a frame agrees, and re-sampled by LatchInput() right before flushing.
+local latched_mouse
 MousePosition = function ()
+    if latched_mouse then return Vector2(latched_mouse) end
     return C.get_mouse_position(window)
 end
 
+LatchInput = function ()
+    latched_mouse = C.latch_mouse_position(window)
+end
+
+--- Input event to swap latency since the last call, in milliseconds
+InputLatency = function ()
+    local stats = C.get_input_latency()
+    return {
+        samples = stats.samples,
+        last = stats.last_ms,
+        mean = stats.mean_ms,
+        max = stats.max_ms,
+    }
+end
+
 ArrayFind = function (array, item)
     for i,v in ipairs(array) do
         if v == item then return i end
@@ -290,33 +309,380 @@ end
 ------ Background ----------
 ----------------------------
 
+local async_uploads = true
+--- Whether new textures and shader programs are built on the upload thread,
+--- or compiled by the driver in the background where it can.
+--- When enabled, a canvas, shader or entity type isn't drawn until it's ready.
+---@param enabled boolean
+SetAsyncUploads = function(enabled)
+    async_uploads = enabled
+    C.renderers_wait_for_programs(not enabled)
+end
+
+local function uploads_async()
+    return async_uploads and C.upload_context_available()
+end
+
+-- Put a GL object in the GPU registry (see gpu_resources.h),
+-- it's deleted once the returned handle is collected
+local function track_gpu(type, name, bytes, label, owner, cached)
+    return ffi.gc(C.gpu_register(type, name, bytes, owner, label, cached or false), C.gpu_release)
+end
+
+-- Delete it now rather than when collected
+local function free_gpu(handle)
+    ffi.gc(handle, nil)
+    C.gpu_release(handle)
+end
+
+-- What's changed since the texture was last updated, as a bounding
+-- rectangle from dirty_x0, dirty_y0 up to (excluding) dirty_x1, dirty_y1
+local function mark_dirty(canvas, x, y, width, height)
+    canvas.dirty_x0 = math.max(0, math.min(canvas.dirty_x0, x))
+    canvas.dirty_y0 = math.max(0, math.min(canvas.dirty_y0, y))
+    canvas.dirty_x1 = math.min(canvas.width, math.max(canvas.dirty_x1, x + width))
+    canvas.dirty_y1 = math.min(canvas.height, math.max(canvas.dirty_y1, y + height))
+end
+
+local function mark_clean(canvas)
+    canvas.dirty_x0, canvas.dirty_y0 = canvas.width, canvas.height
+    canvas.dirty_x1, canvas.dirty_y1 = 0, 0
+end
+
+-- Returns true once the canvas has a texture
+-- The canvas is marked clean whenever its pixels are taken, changes made
+-- while an upload is pending are uploaded by the draw after it's ready
+local function create_texture(canvas)
+    if not uploads_async() then
+        mark_clean(canvas)
+        canvas.texture = C.bg_create_texture(canvas.data, canvas.width, canvas.height, canvas.format)
+        return true
+    end
+    if not canvas.upload_job then
+        local job = C.upload_texture_async(canvas.data, canvas.width, canvas.height, canvas.format)
+        if job < 0 then
+            mark_clean(canvas)
+            canvas.texture = C.bg_create_texture(canvas.data, canvas.width, canvas.height, canvas.format)
+            return true
+        end
+        -- The pixels were copied when it was queued
+        mark_clean(canvas)
+        canvas.upload_job = job
+    end
+    local status = C.upload_status(canvas.upload_job)
+    if status == C.UPLOAD_PENDING then return false end
+    local texture = C.upload_take_texture(canvas.upload_job)
+    canvas.upload_job = nil
+    if status == C.UPLOAD_FAILED then
+        Warning("async texture upload failed, creating it synchronously")
+        -- Changes since the upload was queued are in this one
+        mark_clean(canvas)
+        texture = C.bg_create_texture(canvas.data, canvas.width, canvas.height, canvas.format)
+    end
+    canvas.texture = texture
+    return true
+end
+
+local function track_texture(canvas)
+    -- Cached, it can always be uploaded again from canvas.data
+    canvas.gpu = track_gpu(C.GPU_TEXTURE, canvas.texture, canvas.width * canvas.height * canvas.pixel_bytes,
+                           "canvas", nil, true)
+end
+
+-- Indexed canvases look their colors up in a palette texture, uploaded
+-- again whenever canvas.palette has changed
+local function update_palette(canvas)
+    if canvas.palette_texture ~= 0 and not C.gpu_touch(canvas.palette_gpu) then
+        canvas.palette_texture = 0
+    end
+    if canvas.palette_texture == 0 then
+        canvas.palette_texture = C.bg_create_palette(canvas.palette)
+        canvas.palette_gpu = track_gpu(C.GPU_TEXTURE, canvas.palette_texture, ffi.sizeof(canvas.palette),
+                                       "palette", nil, true)
+    elseif canvas.palette_dirty then
+        C.bg_set_palette(canvas.palette_texture, canvas.palette)
+    end
+    canvas.palette_dirty = false
+end
+
+local blends = {
+    copy = C.CANVAS_COPY,
+    over = C.CANVAS_OVER,
+}
+
+--- A lookup table of colors for canvas gradients
+---@param pixels ffi.cdata* Pixel[?]
+---@param size number
+local Ramp = function(pixels, size)
+    return { pixels = pixels, size = size }
+end
+
+--- Evenly spaced color stops blended into a ramp for canvas gradients
+---@param colors table two or more Colors
+---@param size number|nil entries (default 256)
+ColorRamp = function(colors, size)
+    assert(#colors >= 2, "ColorRamp needs at least two colors")
+    size = size or 256
+    local pixels = ffi.new("Pixel[?]", size)
+    for i = 0, size - 1 do
+        local t = i / (size - 1) * (#colors - 1)
+        local stop = math.min(math.floor(t), #colors - 2)
+        pixels[i] = Lerp(colors[stop + 1], colors[stop + 2], t - stop):Pixel()
+    end
+    return Ramp(pixels, size)
+end
+
+--- Every hue from 0 to 360 degrees, for angular gradients
+---@param saturation number|nil (default 1)
+---@param lightness number|nil (default 0.5)
+---@param alpha number|nil (default 1)
+---@param size number|nil entries (default 1024)
+HueRamp = function(saturation, lightness, alpha, size)
+    size = size or 1024
+    local hsla = ffi.new("Hsla[?]", size)
+    for i = 0, size - 1 do
+        hsla[i].h = i / size * 360
+        hsla[i].s = saturation or 1
+        hsla[i].l = lightness or 0.5
+        hsla[i].a = alpha or 1
+    end
+    local pixels = ffi.new("Pixel[?]", size)
+    C.canvas_hsl_to_rgb(pixels, hsla, size)
+    return Ramp(pixels, size)
+end
+
 local canvas_mt = {
     set = function(canvas, x, y, color)
         assert(y < canvas.height, "canvas:set y argument out of range")
         assert(x < canvas.width, "canvas:set x argument out of range")
         canvas.data[y * canvas.width + x] = color:Pixel()
+        mark_dirty(canvas, x, y, 1, 1)
+    end,
+    --- Fill a rectangle, or the whole canvas
+    ---@param color Color
+    fill = function(canvas, color, x, y, width, height)
+        x, y = x or 0, y or 0
+        width, height = width or canvas.width, height or canvas.height
+        C.canvas_fill_rect(canvas.data, canvas.width, canvas.height, x, y, width, height, color:Pixel())
+        mark_dirty(canvas, x, y, width, height)
+    end,
+    ---@param from Vector2 where the ramp starts, in canvas pixels
+    ---@param to Vector2 where it ends
+    linear_gradient = function(canvas, from, to, ramp)
+        C.canvas_linear_gradient(canvas.data, canvas.width, canvas.height, from, to, ramp.pixels, ramp.size)
+        canvas:mark_dirty()
+    end,
+    radial_gradient = function(canvas, center, radius, ramp)
+        C.canvas_radial_gradient(canvas.data, canvas.width, canvas.height, center, radius, ramp.pixels, ramp.size)
+        canvas:mark_dirty()
+    end,
+    --- The ramp goes once around the center, clockwise from `start` radians (default 0, pointing right)
+    angular_gradient = function(canvas, center, ramp, start)
+        C.canvas_angular_gradient(canvas.data, canvas.width, canvas.height, center, start or 0,
+                                  ramp.pixels, ramp.size)
+        canvas:mark_dirty()
+    end,
+    --- Convert a whole canvas of HSL colors, e.g. from NewHslBuffer
+    ---@param hsla ffi.cdata* Hsla[width * height]
+    from_hsl = function(canvas, hsla)
+        C.canvas_hsl_to_rgb(canvas.data, hsla, canvas.width * canvas.height)
+        canvas:mark_dirty()
+    end,
+    --- Draw another canvas onto this one with its top left at x, y
+    ---@param blend string|nil "over" (default) or "copy"
+    blit = function(canvas, src, x, y, blend)
+        local mode = assert(blends[blend or "over"], "unknown canvas blend")
+        x, y = x or 0, y or 0
+        C.canvas_blit(canvas.data, canvas.width, canvas.height, src.data, src.width, src.height, x, y, mode)
+        mark_dirty(canvas, x, y, src.width, src.height)
+    end,
+    --- Set each pixel to `fn(x, y, pixel)`, which returns a Color or nil to leave it.
+    --- Slower than the kernels above but still compiled by the JIT.
+    map = function(canvas, fn)
+        local data, width = canvas.data, canvas.width
+        for y = 0, canvas.height - 1 do
+            for x = 0, width - 1 do
+                local i = y * width + x
+                local color = fn(x, y, data[i])
+                if color then data[i] = color:Pixel() end
+            end
+        end
+        canvas:mark_dirty()
+    end,
+    --- Call after writing to `canvas.data` directly, so the change is uploaded.
+    --- Without arguments the whole canvas is marked.
+    mark_dirty = function(canvas, x, y, width, height)
+        mark_dirty(canvas, x or 0, y or 0, width or canvas.width, height or canvas.height)
+    end,
+    --- Bytes uploaded by the last draw, and since the canvas was made
+    upload_stats = function(canvas)
+        local stats = canvas.uploads
+        return {
+            last_bytes = stats.last_bytes,
+            total_bytes = stats.total_bytes,
+            uploads = stats.uploads,
+            skipped = stats.skipped,
+        }
     end,
     draw = function(canvas)
+        -- Evicted when over the GPU budget, or its module was unloaded
+        if canvas.texture ~= 0 and not C.gpu_touch(canvas.gpu) then
+            canvas.texture = 0
+        end
         if canvas.texture == 0 then
-            canvas.texture = C.bg_create_texture(canvas.data, canvas.width, canvas.height)
+            if not create_texture(canvas) then return end
+            track_texture(canvas)
+        end
+        -- Only what changed is uploaded, nothing if the canvas is clean
+        local x, y = canvas.dirty_x0, canvas.dirty_y0
+        local width, height = canvas.dirty_x1 - x, canvas.dirty_y1 - y
+        local stats = canvas.uploads
+        if width > 0 and height > 0 then
+            stats.last_bytes = width * height * canvas.pixel_bytes
+            stats.total_bytes = stats.total_bytes + stats.last_bytes
+            stats.uploads = stats.uploads + 1
+            mark_clean(canvas)
+        else
+            width, height = 0, 0
+            stats.last_bytes = 0
+            stats.skipped = stats.skipped + 1
         end
-        C.bg_draw(canvas.texture, canvas.data, canvas.width, canvas.height)
+        if canvas.palette then update_palette(canvas) end
+        C.bg_draw(canvas.texture, canvas.data, canvas.width, canvas.height, canvas.format,
+                  canvas.palette_texture or 0, x, y, width, height)
     end
 }
 canvas_mt.__index = canvas_mt
 
+local PALETTE_SIZE = 256 -- CANVAS_PALETTE_SIZE
+
+-- R8, RG8 and indexed canvases hold bytes rather than Pixels, only
+-- some of the canvas methods make sense for them
+local byte_canvas_mt = {
+    draw = canvas_mt.draw,
+    mark_dirty = canvas_mt.mark_dirty,
+    upload_stats = canvas_mt.upload_stats,
+    --- Set a rectangle of pixels, or the whole canvas, to `value` and the
+    --- second channel of RG8 canvases to `value2` (default 255)
+    fill = function(canvas, value, x, y, width, height, value2)
+        x, y = x or 0, y or 0
+        width, height = width or canvas.width, height or canvas.height
+        local x0, y0 = math.max(x, 0), math.max(y, 0)
+        local x1, y1 = math.min(x + width, canvas.width), math.min(y + height, canvas.height)
+        if x1 <= x0 or y1 <= y0 then return end
+        local data, bytes = canvas.data, canvas.pixel_bytes
+        for row = y0, y1 - 1 do
+            local i = (row * canvas.width + x0) * bytes
+            if bytes == 1 then
+                ffi.fill(data + i, x1 - x0, value)
+            else
+                for j = i, i + (x1 - x0) * bytes - 1, bytes do
+                    data[j], data[j + 1] = value, value2 or 255
+                end
+            end
+        end
+        mark_dirty(canvas, x0, y0, x1 - x0, y1 - y0)
+    end,
+    --- Replace palette entries from `first` (0 by default) with Colors.
+    --- Only the palette is uploaded, so cycling colors costs nothing per pixel.
+    set_palette = function(canvas, colors, first)
+        assert(canvas.palette, "only indexed canvases have a palette")
+        first = first or 0
+        for i, color in ipairs(colors) do
+            assert(first + i - 1 < PALETTE_SIZE, "palette has "..PALETTE_SIZE.." colors")
+            canvas.palette[first + i - 1] = color:Pixel()
+        end
+        canvas.palette_dirty = true
+    end,
+}
+byte_canvas_mt.__index = byte_canvas_mt
+
+local canvas_formats = {
+    rgba8 = C.CANVAS_RGBA8,
+    r8 = C.CANVAS_R8,
+    rg8 = C.CANVAS_RG8,
+    indexed = C.CANVAS_INDEXED,
+}
+
+--- Scratch HSL colors for canvas:from_hsl
+---@param count number
+NewHslBuffer = function(count)
+    return ffi.new("Hsla[?]", count)
+end
+
+-- Streaming canvases write into mapped pixel buffers, see stream_canvas.h
+local stream_canvas_methods = setmetatable({
+    draw = function(canvas)
+        C.stream_canvas_draw(canvas.stream)
+        -- Fetched again on first use, by then it's normally mapped
+        canvas.data = nil
+    end,
+    -- Everything is uploaded on every draw
+    mark_dirty = function() end,
+    upload_stats = function(canvas)
+        local stats = C.stream_canvas_stats(canvas.stream)
+        return {
+            last_bytes = stats.draws > 0 and canvas.width * canvas.height * ffi.sizeof("Pixel") or 0,
+            total_bytes = tonumber(stats.bytes),
+            uploads = stats.draws,
+            skipped = 0,
+            waits = stats.waits,
+        }
+    end,
+}, { __index = canvas_mt })
+
+local stream_canvas_mt = {
+    __index = function(canvas, k)
+        if k == "data" then
+            local data = C.stream_canvas_data(canvas.stream)
+            rawset(canvas, "data", data)
+            return data
+        end
+        return stream_canvas_methods[k]
+    end,
+}
+
+-- The fields every canvas has, without its pixels or metatable. There's
+-- no texture yet, creating it uploads everything so it starts out clean.
+local new_canvas = function(width, height, format)
+    local canvas = {
+        width = width,
+        height = height,
+        format = format,
+        pixel_bytes = C.bg_format_bytes(format),
+        texture = 0,
+        uploads = { last_bytes = 0, total_bytes = 0, uploads = 0, skipped = 0 },
+    }
+    mark_clean(canvas)
+    return canvas
+end
+
 ---@param width number
 ---@param height number
-local GenCanvas = function(width, height)
+---@param settings table|nil { streaming = false, buffers = 3, format = "rgba8", palette = {} }
+local GenCanvas = function(width, height, settings)
     assert(type(width) == "number")
     assert(type(height) == "number")
-    local canvas = setmetatable({
-        width = width,
-        height = height,
-        data = ffi.new("Pixel[?]", width*height),
-        texture = 0
-    }, canvas_mt)
-    return canvas
+    settings = settings or {}
+    local format = canvas_formats[settings.format or "rgba8"]
+    assert(format, "unknown canvas format "..tostring(settings.format))
+    local canvas = new_canvas(width, height, format)
+    if format ~= C.CANVAS_RGBA8 then
+        assert(not settings.streaming, "streaming canvases are always RGBA8")
+        canvas.data = ffi.new("uint8_t[?]", width * height * canvas.pixel_bytes)
+        if format == C.CANVAS_INDEXED then
+            canvas.palette = ffi.new("Pixel[?]", PALETTE_SIZE)
+            canvas.palette_texture = 0
+            setmetatable(canvas, byte_canvas_mt):set_palette(settings.palette or {})
+        end
+        return setmetatable(canvas, byte_canvas_mt)
+    end
+    if settings.streaming then
+        canvas.stream = ffi.gc(C.stream_canvas_new(width, height, settings.buffers or 3), C.stream_canvas_free)
+        return setmetatable(canvas, stream_canvas_mt)
+    end
+    canvas.data = ffi.new("Pixel[?]", width*height)
+    return setmetatable(canvas, canvas_mt)
 end
 
 local CanvasFromTable = function(field)
@@ -324,14 +690,23 @@ local CanvasFromTable = function(field)
     assert(height > 0, "canvas must have height > 0")
     local width = #field[1]
     local canvas = CreateCanvas(width, height)
+    local data = canvas.data
     for y = 1, height do
+        local row = field[y]
         for x = 1, width do
-            canvas:set(x-1, y-1, field[y][x])
+            data[(y-1) * width + x-1] = row[x]:Pixel()
         end
     end
     return canvas
 end
 
+--- CreateCanvas(width, height, settings) or CreateCanvas(rows of Colors).
+--- `format` "r8" (grey), "rg8" (grey and alpha) and "indexed" (an index
+--- into 256 `palette` colors, see canvas:set_palette) canvases hold bytes
+--- in `data` and take a quarter or half the memory and upload bandwidth.
+--- A streaming canvas is for pixels that all change every frame: `data`
+--- points into a mapped GPU buffer whose contents are undefined after each
+--- draw, so every pixel must be written again before the next one.
 CreateCanvas = function(...)
     if type(...) == "table" then
         return CanvasFromTable(...)
@@ -340,13 +715,369 @@ CreateCanvas = function(...)
     end
 end
 
+-- Images load into canvases, see image_loader.h
+local image_loader = {
+    threads = 2,
+    cache = "cache/images",
+    started = false,
+    pending = {}, -- job handle -> callback
+}
+
+--- Set up the image loader, before the first image is loaded.
+--- Decoded images are cached as raw pixels in `cache`, false to not cache.
+---@param settings table { threads = 2, cache = "cache/images" }
+ConfigureImageLoader = function(settings)
+    assert(not image_loader.started, "image loader is already running")
+    for k, v in pairs(settings) do
+        assert(image_loader[k] ~= nil and k ~= "pending" and k ~= "started", "unknown image loader setting "..k)
+        image_loader[k] = v
+    end
+end
+
+local start_image_loader = function()
+    if image_loader.started then return end
+    assert(C.image_loader_init(image_loader.cache or nil, image_loader.threads), "unable to start image loader")
+    image_loader.started = true
+end
+
+-- The canvas's data are the image's pixels, freed with the canvas
+local canvas_from_image = function(image)
+    local canvas = new_canvas(image.width, image.height, C.CANVAS_RGBA8)
+    canvas.image = ffi.gc(image, C.image_free)
+    canvas.data = image.pixels
+    canvas.cached = image.cached
+    canvas.load_ms = image.load_ms
+    return setmetatable(canvas, canvas_mt)
+end
+
+--- Load a PNG or QOI file into a canvas, nil if it couldn't be read.
+--- Blocks while decoding, see LoadImageAsync.
+LoadImage = function(path)
+    start_image_loader()
+    local image = C.image_load(path)
+    if image == nil then return nil end
+    return canvas_from_image(image)
+end
+
+--- Load a PNG or QOI file into a canvas on a worker thread
+---@param on_done function called as a scheduled task with the canvas, or nil if it couldn't be read
+LoadImageAsync = function(path, on_done)
+    start_image_loader()
+    local job = C.image_load_async(path)
+    if job < 0 then
+        ScheduleFn(function() on_done(nil) end, 0)
+        return false
+    end
+    image_loader.pending[job] = on_done
+    return true
+end
+
+--- Hand finished image loads to their callbacks
+PollImageLoads = function()
+    for job, on_done in pairs(image_loader.pending) do
+        if C.image_load_status(job) ~= C.IMAGE_LOAD_PENDING then
+            image_loader.pending[job] = nil
+            local image = C.image_take(job)
+            local canvas = image ~= nil and canvas_from_image(image) or nil
+            ScheduleFn(function() on_done(canvas) end, 0)
+        end
+    end
+end
+
+-- Tiled canvases are sparse and can be any size, see tiled_canvas.h
+local tiled_canvas_mt = {
+    set = function(canvas, x, y, color)
+        C.tiled_canvas_set(canvas.tiles, x, y, color:Pixel())
+    end,
+    --- The Pixel at x, y, transparent where nothing was written
+    get = function(canvas, x, y)
+        return C.tiled_canvas_get(canvas.tiles, x, y)
+    end,
+    --- Fill a rectangle, which is required as there's no whole canvas to default to
+    ---@param color Color
+    fill = function(canvas, color, x, y, width, height)
+        C.tiled_canvas_fill(canvas.tiles, x, y, width, height, color:Pixel())
+    end,
+    --- Pixels of tile tx, ty (tile_size rows of tile_size, bottom row
+    --- first) to write straight into before the next draw. Allocates it.
+    tile = function(canvas, tx, ty)
+        return C.tiled_canvas_tile(canvas.tiles, tx, ty)
+    end,
+    --- Draw it panned so that canvas pixel x, y is at the bottom left of
+    --- the window, `scale` window pixels per canvas pixel (default 1)
+    draw = function(canvas, x, y, scale)
+        C.tiled_canvas_draw(canvas.tiles, x or 0, y or 0, scale or 1, resolution.x, resolution.y)
+    end,
+    stats = function(canvas)
+        local stats = C.tiled_canvas_stats(canvas.tiles)
+        return {
+            tiles = stats.tiles,
+            resident = stats.resident,
+            capacity = stats.capacity,
+            visible = stats.visible,
+            drawn = stats.drawn,
+            evictions = stats.evictions,
+            uploads = tonumber(stats.uploads),
+            bytes = tonumber(stats.bytes),
+        }
+    end,
+}
+tiled_canvas_mt.__index = tiled_canvas_mt
+
+--- A canvas of `tile` x `tile` tiles that are only allocated once written
+--- to, and only on the GPU while in view. Up to `resident` tiles are kept
+--- on the GPU, enough to cover the window at the scale it's drawn at.
+---@param width number
+---@param height number
+---@param settings table|nil { tile = 256, resident = 64 }
+CreateTiledCanvas = function(width, height, settings)
+    settings = settings or {}
+    local tiles = C.tiled_canvas_new(width, height, settings.tile or 0, settings.resident or 0)
+    assert(tiles ~= nil, "unable to create tiled canvas")
+    return setmetatable({
+        width = width,
+        height = height,
+        tile_size = C.tiled_canvas_tile_size(tiles),
+        tiles = ffi.gc(tiles, C.tiled_canvas_free),
+    }, tiled_canvas_mt)
+end
+
+-- Layers cache static parts of the scene in a texture, see layer.h
+
+local function layer_size(settings)
+    local scale = settings.scale or 1
+    local width = settings.width or math.floor(resolution.x * scale + 0.5)
+    local height = settings.height or math.floor(resolution.y * scale + 0.5)
+    return math.max(width, 1), math.max(height, 1)
+end
+
+-- Made again at the new size when the window is resized
+local function update_layer(layer)
+    local width, height = layer_size(layer.settings)
+    if layer.layer ~= nil and width == layer.width and height == layer.height
+        and resolution.x == layer.scene_width and resolution.y == layer.scene_height then
+        return true
+    end
+    if layer.layer ~= nil then
+        C.layer_free(ffi.gc(layer.layer, nil))
+    end
+    layer.width, layer.height = width, height
+    layer.scene_width, layer.scene_height = resolution.x, resolution.y
+    local handle = C.layer_new(width, height, resolution.x, resolution.y)
+    layer.layer = handle ~= nil and ffi.gc(handle, C.layer_free) or nil
+    return layer.layer ~= nil
+end
+
+local layer_mt = {
+    --- Draw into the layer with `fn`, replacing what it held. Entities and
+    --- background shaders drawn by `fn` go to the layer instead of the frame.
+    render = function(layer, fn)
+        if not update_layer(layer) or not C.layer_begin(layer.layer, layer.clear) then return end
+        local ok, err = pcall(fn)
+        C.layer_end(layer.layer)
+        if not ok then
+            C.layer_invalidate(layer.layer)
+            error(err, 0)
+        end
+    end,
+    --- Composite the layer over the frame. With `fn` it's drawn first if it
+    --- isn't valid, so `layer:draw(fn)` is all a static part of a scene needs.
+    draw = function(layer, fn)
+        if fn and not layer:valid() then layer:render(fn) end
+        if layer.layer ~= nil then C.layer_draw(layer.layer) end
+    end,
+    --- Whether it holds what it was last drawn with. It doesn't after being
+    --- invalidated, resized or having its texture evicted.
+    valid = function(layer)
+        return update_layer(layer) and C.layer_valid(layer.layer)
+    end,
+    --- Draw it again the next time it's drawn with a function
+    invalidate = function(layer)
+        if layer.layer ~= nil then C.layer_invalidate(layer.layer) end
+    end,
+    stats = function(layer)
+        if layer.layer == nil then return { renders = 0, draws = 0, recreated = 0 } end
+        local stats = C.layer_stats(layer.layer)
+        return { renders = stats.renders, draws = stats.draws, recreated = stats.recreated }
+    end,
+}
+layer_mt.__index = layer_mt
+
+--- An offscreen layer showing the whole scene, at `scale` of the window's
+--- resolution or `width` x `height` pixels. Less than the window is cheaper
+--- to draw into and is stretched when composited.
+---@param settings table|nil { scale = 1, width = nil, height = nil, clear = Color(0, 0, 0, 0) }
+CreateLayer = function(settings)
+    settings = settings or {}
+    local layer = setmetatable({
+        settings = settings,
+        clear = settings.clear or Color(0, 0, 0, 0),
+    }, layer_mt)
+    update_layer(layer)
+    return layer
+end
+
+local gpu_types = { [0] = "texture", "buffer", "program", "vertex_array", "framebuffer" }
+
+--- Evict cached textures, least recently used first, above this many bytes.
+--- They're uploaded again when next drawn.
+---@param bytes number 0 for no limit
+SetGpuBudget = function(bytes)
+    C.gpu_set_budget(bytes)
+end
+
+--- Live GL objects made for Lua, and their estimated sizes
+GpuResources = function()
+    local totals = C.gpu_resources_totals()
+    local max = totals.count
+    local list = ffi.new("GpuResourceInfo[?]", math.max(max, 1))
+    local n = C.gpu_resources_list(list, max)
+    local resources = {}
+    for i = 0, n - 1 do
+        local r = list[i]
+        table.insert(resources, {
+            type = gpu_types[tonumber(r.type)],
+            name = r.name,
+            bytes = tonumber(r.bytes),
+            refs = r.refs,
+            cached = r.cached,
+            last_used = tonumber(r.last_used),
+            owner = ffi.string(r.owner),
+            label = ffi.string(r.label),
+        })
+    end
+    local bytes_by_type = {}
+    for i = 0, #gpu_types do
+        bytes_by_type[gpu_types[i]] = tonumber(totals.type_bytes[i])
+    end
+    return {
+        count = totals.count,
+        bytes = tonumber(totals.bytes),
+        bytes_by_type = bytes_by_type,
+        budget = tonumber(totals.budget),
+        evicted = totals.evicted,
+        released = totals.released,
+        over_budget = totals.over_budget,
+    }, resources
+end
 
 local bg_vertex_shader_source = ReadEntireFile("shaders/bg.vert")
 local shaders = {}
+-- Programs from before the last reload, used until their replacement is ready
+local stale_shaders = {}
+
+-- Programs are shared between reloads of a module rather than owned by it
+local function track_shader(shader, id)
+    shader.gpu = {
+        track_gpu(C.GPU_PROGRAM, shader.program.program, 0, id, "shaders"),
+        track_gpu(C.GPU_VERTEX_ARRAY, shader.program.vao, 0, id, "shaders"),
+    }
+end
+
+local function free_shader(shader)
+    for _, handle in ipairs(shader.gpu or {}) do free_gpu(handle) end
+    shader.gpu = nil
+end
+
+-- Once the replacement for a stale program is ready the old one is deleted
+local function replace_stale(id)
+    local stale = stale_shaders[id]
+    if stale then free_shader(stale) end
+    stale_shaders[id] = nil
+end
+
 ClearShaderCache = function()
-    -- TODO: free shit?
+    for id, shader in pairs(shaders) do
+        if shader.program then
+            replace_stale(id)
+            stale_shaders[id] = shader
+        end
+    end
     shaders = {}
 end
+
+-- Returns the cached program and uniforms for id,
+-- or nil while it's still being built
+local function get_shader(id, frag_shader)
+    local shader = shaders[id]
+    if not shader then
+        local frag_source
+        if type(frag_shader) == "string" then
+            frag_source = ReadEntireFile(frag_shader)
+        elseif type(frag_shader) == "function" then
+            frag_source = frag_shader()
+            assert(type(frag_source) == "string", "RunBgShader shader loader callback must return string")
+        else
+            error("expected string file name or function for frag_shader", 3)
+        end
+        assert(type(id) == "string")
+        local job = uploads_async() and C.upload_program_async(id, bg_vertex_shader_source, frag_source) or -1
+        if job < 0 and async_uploads and C.shader_parallel_compile() then
+            -- No upload thread, but the driver compiles in the background
+            shader = { pending = C.shader_submit_source(id, bg_vertex_shader_source, frag_source) }
+        elseif job < 0 then
+            local program = ffi.new("Shader")
+            C.shader_program_from_source(program, id, bg_vertex_shader_source, frag_source)
+            shader = { program = program, uniforms = {} }
+            track_shader(shader, id)
+            replace_stale(id)
+        else
+            shader = { job = job }
+        end
+        shaders[id] = shader
+    end
+    if shader.pending then
+        local program = ffi.new("Shader")
+        if not C.shader_poll_program(shader.pending, program) then
+            local stale = stale_shaders[id]
+            if stale then return stale.program, stale.uniforms end
+            return nil
+        end
+        shader.pending = nil
+        if program.program ~= 0 then
+            shader.program, shader.uniforms = program, {}
+            track_shader(shader, id)
+            replace_stale(id)
+        else
+            shader.failed = true
+        end
+    end
+    if shader.job then
+        local status = C.upload_status(shader.job)
+        if status == C.UPLOAD_READY then
+            local program = ffi.new("Shader")
+            C.upload_take_program(shader.job, program)
+            shader.job = nil
+            shader.program, shader.uniforms = program, {}
+            track_shader(shader, id)
+            replace_stale(id)
+        elseif status == C.UPLOAD_FAILED then
+            -- The error was already printed by the upload thread
+            C.upload_take_program(shader.job, ffi.new("Shader"))
+            shader.job = nil
+            shader.failed = true
+        else
+            local stale = stale_shaders[id]
+            if stale then return stale.program, stale.uniforms end
+            return nil
+        end
+    end
+    if shader.failed then
+        local stale = stale_shaders[id]
+        if stale then return stale.program, stale.uniforms end
+        return nil
+    end
+    return shader.program, shader.uniforms
+end
+
+--- How many programs were loaded from the disk cache of linked binaries
+--- instead of compiled since startup. Set BUBBL_NO_SHADER_CACHE to compile
+--- every time.
+ShaderCacheStats = function()
+    local stats = C.shader_cache_stats()
+    return { hits = stats.hits, misses = stats.misses, rejected = stats.rejected }
+end
+
 --- Run a simple fragment shader over the entire screen.
 --- No need to declare or initialize anything,
 --- the program is automatically created and cached.
@@ -356,46 +1087,44 @@ end
 --- not the source itself. Instead pass in a function that generates
 --- and returns the string.
 --- 
+--- If `pass` is given, the shader instead becomes a post-processing pass
+--- which runs when the frame is presented (see PostProcess).
+---
 ---@param id string used to cache program/uniforms and error messages
 ---@param frag_shader string|function either file path or function that returns string
 ---@param data table<string, number|Vector2|Color|table> uniform variables
-RunBgShader = function(id, frag_shader, data)
-    if not shaders[id] then
-        local program = ffi.new("Shader")
-        local frag_source
-        if type(frag_shader) == "string" then
-            frag_source = ReadEntireFile(frag_shader)
-        elseif type(frag_shader) == "function" then
-            frag_source = frag_shader()
-            assert(type(frag_source) == "string", "RunBgShader shader loader callback must return string")
-        else
-            error("expected string file name or function for frag_shader", 2)
-        end
-        assert(type(id) == "string")
-        C.shader_program_from_source(program, id, bg_vertex_shader_source, frag_source)
-        shaders[id] = { program, {} }
+---@param pass table|nil { inputs = {"scene"}, output = "screen", scale = 1 }
+RunBgShader = function(id, frag_shader, data, pass)
+    local program, uniforms = get_shader(id, frag_shader)
+    if not program then return end
+    if pass then
+        local inputs = pass.inputs or { "scene" }
+        local index = C.render_graph_begin_pass(id, program,
+            ffi.new("const char*[?]", #inputs, inputs), #inputs,
+            pass.output or "screen", pass.scale or 1)
+        if index < 0 then return end
+    else
+        C.use_shader_program(program)
     end
-    local program, uniforms = unpack(shaders[id])
-    C.use_shader_program(program)
     for name, arg in pairs(data) do
         if not uniforms[name] then
-            uniforms[name] = C.glGetUniformLocation(program.program, name)
+            uniforms[name] = C.shader_uniform_location(program.program, name)
         end
         if ffi.istype(Color, arg) then
-            C.glUniform4f(uniforms[name], arg:Unpack())
+            C.shader_uniform4f(uniforms[name], arg:Unpack())
 
         elseif ffi.istype(Vector2, arg) then
-            C.glUniform2f(uniforms[name], arg:Unpack())
+            C.shader_uniform2f(uniforms[name], arg:Unpack())
 
         elseif type(arg) == "number" then
-            C.glUniform1f(uniforms[name], arg)
+            C.shader_uniform1f(uniforms[name], arg)
 
         elseif type(arg) == "table" then
             assert(arg[1], "array uniform must contain at least one value")
             if ffi.istype(Color, arg[1]) then
-                C.glUniform4fv(uniforms[name], #arg, ffi.new("Color[?]", #arg, arg))
+                C.shader_uniform4fv(uniforms[name], #arg, ffi.new("Color[?]", #arg, arg))
             elseif ffi.istype(Vector2, arg[1]) then
-                C.glUniform2fv(uniforms[name], #arg, ffi.new("Vector2[?]", #arg, arg))
+                C.shader_uniform2fv(uniforms[name], #arg, ffi.new("Vector2[?]", #arg, arg))
             else
                 assert(false, "unknown uniform type")
             end
@@ -404,66 +1133,677 @@ RunBgShader = function(id, frag_shader, data)
             assert(false, "unknown uniform type")
         end
     end
-    C.run_shader_program(program)
+    if pass then
+        C.render_graph_end_pass()
+    else
+        C.run_shader_program(program)
+    end
+end
+
+--- Add a post-processing pass to this frame's render graph.
+--- Passes sample their inputs as `input0`..`input3` using `uv_coord`,
+--- and `resolution` is set to the size of their output.
+--- Targets other than "scene" and "screen" are transient and only live
+--- for the frame. Passes whose output nothing reads are skipped.
+---@param id string
+---@param frag_shader string|function same as RunBgShader
+---@param data table uniform variables
+---@param pass table|nil { inputs = {"scene"}, output = "screen", scale = 1 }
+PostProcess = function(id, frag_shader, data, pass)
+    RunBgShader(id, frag_shader, data or {}, pass or {})
+end
+
+--- GPU milliseconds spent in each post-processing pass, a few frames ago
+PostProcessTimings = function()
+    local max = 32
+    local timings = ffi.new("PassTiming[?]", max)
+    local result = {}
+    for i = 0, C.render_graph_timings(timings, max) - 1 do
+        result[ffi.string(timings[i].id)] = timings[i].gpu_ms
+    end
+    return result
 end
 
 ----------------------------
 ------- Recording ----------
 ----------------------------
 
-Screenshot = function(name)
+-- Pending readbacks in the order they were requested, { handle, on_ready }
+local readbacks = {}
+-- Captures dropped because the ring was full, only the first is warned about
+local dropped_readbacks = 0
+
+local readback_filters = {
+    linear = C.READBACK_LINEAR,
+    box = C.READBACK_BOX,
+    lanczos = C.READBACK_LANCZOS,
+}
+
+-- Output size for a capture from { width, height, scale }, 0 for the window size.
+-- With only one of width or height the other keeps the window's aspect ratio.
+local capture_size = function(size)
+    if not size then return 0, 0 end
+    local w, h = size.width or 0, size.height or 0
+    if w > 0 and h <= 0 then
+        h = w * resolution.y / resolution.x
+    elseif h > 0 and w <= 0 then
+        w = h * resolution.x / resolution.y
+    elseif w <= 0 and h <= 0 and size.scale then
+        w, h = resolution.x * size.scale, resolution.y * size.scale
+    end
+    if w <= 0 or h <= 0 then return 0, 0 end
+    return math.max(1, math.floor(w + 0.5)), math.max(1, math.floor(h + 0.5))
+end
+
+--- Read back the frame as drawn so far without stalling the GPU.
+--- `on_ready(pixels, width, height, detach)` is called a frame or two later
+--- with RGBA pixels, top row first. They're only valid during the call,
+--- unless `detach()` is called which hands them over (see SavePngAsync).
+--- With `size` the frame is filtered down on the GPU first, so only the
+--- smaller image is read back.
+--- Returns false if the capture was dropped, because every readback is
+--- still in flight or the pixels couldn't be allocated. Waiting for a slot
+--- would stall on the GPU, so `on_ready` is then never called.
+---@param on_ready function
+---@param size table|nil { width, height, scale, filter = "box"|"lanczos"|"linear" }
+ReadFrameAsync = function(on_ready, size)
+    local w, h = capture_size(size)
+    local filter = assert(readback_filters[size and size.filter or "box"], "unknown readback filter")
+    local handle = C.request_frame_readback(window, w, h, filter)
+    if handle < 0 then
+        dropped_readbacks = dropped_readbacks + 1
+        if dropped_readbacks == 1 then
+            Warning("dropping frame captures, too many pending readbacks")
+        end
+        return false
+    end
+    table.insert(readbacks, { handle, on_ready })
+    return true
+end
+
+--- Run callbacks for readbacks that have completed, in the order they were requested.
+---@param wait boolean|nil block until all captured frames are read back
+PollReadbacks = function(wait)
+    if #readbacks == 0 then return end
+    if wait then C.finish_readbacks() end
+    local result = ffi.new("ReadbackResult")
+    while readbacks[1] do
+        local handle, on_ready = unpack(readbacks[1])
+        if not C.readback_get(handle, result) then break end
+        table.remove(readbacks, 1)
+        -- Without pixels it ran out of memory, dropped as if the ring had been full
+        if result.pixels ~= nil then
+            local detached = false
+            local detach = function()
+                detached = true
+                return C.readback_detach(handle)
+            end
+            local ok, err = pcall(on_ready, result.pixels, result.width, result.height, detach)
+            if not detached then C.readback_release(handle) end
+            if not ok then Warning("Error in readback callback: ", err) end
+        else
+            C.readback_release(handle)
+        end
+    end
+end
+
+local png_writer = {
+    threads = 2,
+    queue = 8,
+    backpressure = "block",
+    started = false,
+    pending = {}, -- job id -> callback
+}
+
+--- Set up the PNG writer pool, before the first PNG is saved.
+--- Backpressure is what happens once `queue` PNGs are waiting:
+--- "block" the frame, "drop" the new PNG, or "grow" the queue.
+---@param settings table { threads = 2, queue = 8, backpressure = "block" }
+ConfigurePngWriter = function(settings)
+    assert(not png_writer.started, "PNG writer is already running")
+    for k, v in pairs(settings) do
+        assert(png_writer[k] ~= nil and k ~= "pending" and k ~= "started", "unknown PNG writer setting "..k)
+        png_writer[k] = v
+    end
+end
+
+local backpressures = {
+    block = C.BACKPRESSURE_BLOCK,
+    drop = C.BACKPRESSURE_DROP,
+    grow = C.BACKPRESSURE_GROW,
+}
+
+local start_png_writer = function()
+    if png_writer.started then return end
+    local backpressure = assert(backpressures[png_writer.backpressure], "unknown PNG writer backpressure")
+    assert(C.png_writer_init(png_writer.threads, png_writer.queue, backpressure), "unable to start PNG writer")
+    png_writer.started = true
+end
+
+local track_png_write = function(id, on_done)
+    if id < 0 then
+        if on_done then ScheduleFn(function() on_done(false) end, 0) end
+        return false
+    end
+    png_writer.pending[id] = on_done or false
+    return true
+end
+
+--- Encode and write a PNG on a worker thread.
+--- A name ending in .qoi, .ppm or .pam is written in that format instead:
+--- QOI is lossless and several times quicker to encode, PPM (no alpha) and
+--- PAM are uncompressed. Use them for frame sequences and convert later.
+--- `pixels` must be malloc'd and are freed once written, e.g. from a readback's detach().
+---@param on_done function|nil called as a scheduled task with whether the file was written
+SavePngAsync = function(name, pixels, width, height, on_done)
+    start_png_writer()
+    return track_png_write(C.png_write_async(name, pixels, width, height), on_done)
+end
+
+--- Convert QOI captures to PNGs next to them on the PNG writer pool,
+--- e.g. frame_001.qoi to frame_001.png. Also run as `bubbl --convert *.qoi`.
+---@param files table paths of .qoi files
+---@param on_done function|nil called per file with the PNG path and whether it was written
+ConvertQoiToPng = function(files, on_done)
+    start_png_writer()
+    local outputs = {}
+    for _, file in ipairs(files) do
+        local output = file:gsub("%.[qQ][oO][iI]$", "")..".png"
+        local done = on_done and function(ok) on_done(output, ok) end
+        track_png_write(C.png_convert_async(file, output), done)
+        table.insert(outputs, output)
+    end
+    return outputs
+end
+
+--- Hand finished PNG writes to their callbacks
+PollPngWrites = function()
+    if next(png_writer.pending) == nil then return end
+    local max = 16
+    local results = ffi.new("WorkResult[?]", max)
+    repeat
+        local n = C.png_writer_poll(results, max)
+        for i = 0, n - 1 do
+            local id, ok = results[i].id, results[i].ok
+            local on_done = png_writer.pending[id]
+            png_writer.pending[id] = nil
+            if on_done then ScheduleFn(function() on_done(ok) end, 0) end
+        end
+    until n < max
+end
+
+--- How long PNGs wait for a worker and take to write, to size the pool
+PngWriterStats = function()
+    local stats = C.png_writer_stats()
+    return {
+        threads = stats.threads,
+        queued = stats.queued,
+        running = stats.running,
+        peak_queued = stats.peak_queued,
+        completed = stats.completed,
+        dropped = stats.dropped,
+        mean_wait_ms = stats.mean_wait_ms,
+        max_wait_ms = stats.max_wait_ms,
+        mean_run_ms = stats.mean_run_ms,
+        max_run_ms = stats.max_run_ms,
+    }
+end
+
+--- Save the frame as a PNG once it's been read back.
+--- It's encoded and written on the PNG writer pool, the extension
+--- picks another format (see SavePngAsync).
+---@param name string file name
+---@param on_done function|nil called with whether the file was written
+---@param size table|nil capture size, see ReadFrameAsync
+Screenshot = function(name, on_done, size)
     assert(type(name) == "string", "expected string file name for Screenshot")
-    return C.screenshot(window, name);
+    local ok = ReadFrameAsync(function(_, width, height, detach)
+        SavePngAsync(name, detach(), width, height, on_done)
+    end, size)
+    if not ok and on_done then ScheduleFn(function() on_done(false) end, 0) end
+    return ok
+end
+
+local posters = {}
+
+--- Render the scene as a PNG bigger than the window, e.g. for printing.
+--- It's drawn tile by tile after the current frame with time frozen and
+--- streamed to the file, so the size isn't limited by the GPU or memory.
+--- Full screen shaders and post-processing see each tile as the window.
+--- The module's Draw and LateDraw run once per tile, Draw as
+--- `Draw(0, { poster = true })`, so anything they do besides drawing
+--- (advancing state, taking screenshots) should be skipped for posters.
+---@param path string
+---@param settings table|nil { width, height or scale (default 4) relative to the window, tile = 2048 }
+RenderPoster = function(path, settings)
+    assert(type(path) == "string", "expected path for RenderPoster")
+    table.insert(posters, { path, settings or {} })
 end
 
-local gifskis = {}
+--- Draw the posters asked for since the last frame, called between frames
+---@param module table the active module, its Draw and LateDraw draw each tile
+DrawPendingPosters = function(module)
+    if #posters == 0 then return end
+    -- Tiles are read back through the same ring, empty it first
+    PollReadbacks(true)
+    for _, request in ipairs(posters) do
+        local path, settings = unpack(request)
+        local scale = settings.scale
+            or (settings.width and settings.width / resolution.x)
+            or (settings.height and settings.height / resolution.y)
+            or 4
+        local width = settings.width or math.floor(resolution.x * scale + 0.5)
+        local height = settings.height or math.floor(resolution.y * scale + 0.5)
+        local poster = C.poster_open(path, width, height, resolution.x, resolution.y, settings.tile or 2048)
+        if poster ~= nil then
+            local start = Seconds()
+            C.freeze_time(true)
+            while C.poster_begin_tile(poster) do
+                local ok, err = pcall(module.Draw, 0, { poster = true })
+                if not ok then Warning("Error drawing poster tile: ", err) end
+                if module.LateDraw then
+                    ok, err = pcall(module.LateDraw, MousePosition())
+                    if not ok then Warning("Error in LateDraw for poster tile: ", err) end
+                end
+                C.poster_end_tile(poster)
+            end
+            C.freeze_time(false)
+            local stats = C.poster_close(poster)
+            if stats.failed then
+                Warning("poster ", path, " is incomplete")
+            else
+                Info(string.format("%s: %dx%d in %d tiles of %d, %.1fs", path, stats.width, stats.height,
+                                   stats.tiles_x * stats.tiles_y, stats.tile_size, Seconds() - start))
+            end
+        end
+    end
+    posters = {}
+end
+
+local gifs = {}
+-- Recorder settings, the rest of GifNew's settings are gifski's.
+-- The output size is taken over from gifski so frames are scaled on the GPU.
+local recorder_defaults = { pool = 8, decimate = 1, scale = 1, width = 0, height = 0, filter = "box", backpressure = "drop" }
+
+--- Start recording a GIF. Frames are captured asynchronously and fed to
+--- gifski on a background thread through a fixed pool of frame buffers.
+---@param file_name string
+---@param settings table|nil gifski settings ({ quality = 90 }) plus
+--- `pool` frame buffers, keep every `decimate`th frame, output `width` and/or
+--- `height` or `scale` relative to the window, downscaled with `filter`
+--- (see ReadFrameAsync), and `backpressure` "drop" or "block" when gifski
+--- falls behind
 GifNew = function (file_name, settings)
     RequireGifski()
     assert(type(file_name) == "string", "expected string file name for GifNew")
-    local p = ffi.new("GifskiSettings[1]", { settings or {quality=90 } })
+    local gifski_settings, recorder_settings = { quality = 90 }, table.copy(recorder_defaults)
+    for k, v in pairs(settings or {}) do
+        if recorder_defaults[k] ~= nil then
+            recorder_settings[k] = v
+        else
+            gifski_settings[k] = v
+        end
+    end
+    assert(recorder_settings.backpressure == "drop" or recorder_settings.backpressure == "block",
+           "GIF backpressure must be \"drop\" or \"block\"")
+
+    local p = ffi.new("GifskiSettings[1]", { gifski_settings })
     local gif = gifski.gifski_new(p);
     if gif == nil then
         print("ERROR: invalid settings for GIF")
         return
     end
     gifski.gifski_set_file_output(gif, file_name)
-    gifskis[file_name] = gif
+    local recorder = C.gif_recorder_start(gif,
+        ffi.cast("GifskiAddFrameFn", gifski.gifski_add_frame_rgba),
+        ffi.cast("GifskiFinishFn", gifski.gifski_finish),
+        ffi.new("GifRecorderSettings", {
+            pool_frames = recorder_settings.pool,
+            decimate = recorder_settings.decimate,
+            block_when_full = recorder_settings.backpressure == "block",
+        }))
+    if recorder == nil then
+        gifski.gifski_finish(gif)
+        return
+    end
+    gifs[file_name] = { recorder = recorder, size = recorder_settings }
+    -- Frames are read back while recording, keep rendering offscreen
+    C.hold_intermediary_framebuffer(true)
 end
 
-GifAddFrame = function (file_name, frame_number, timestamp)
-    RequireGifski()
+--- Capture this frame into the GIF, starting it if needed
+---@param file_name string
+---@param timestamp number presentation time in seconds
+GifAddFrame = function (file_name, timestamp)
     assert(type(file_name) == "string", "expected string file name")
-    assert(type(frame_number) == "number", "expected gif frame number")
-    if not gifskis[file_name] then GifNew(file_name) end
-    local pixels = ffi.new("uint8_t[?]", 4 * resolution.x * resolution.y)
-    C.get_screen_pixels(window, pixels)
-    if pixels == nil then
-        print("ERROR: Unable to read screen content")
-        return
-    end
-    local err = gifski.gifski_add_frame_rgba(gifskis[file_name], frame_number, resolution.x, resolution.y, pixels, timestamp)
-    if err ~= "GIFSKI_OK" then print("ERROR: (Code "..err..") Unable to add GIF frame to "..file_name) end
-    print(file_name.." adding frame "..frame_number)
+    assert(type(timestamp) == "number", "expected gif frame timestamp")
+    if not gifs[file_name] then GifNew(file_name) end
+    local gif = gifs[file_name]
+    if not gif or not C.gif_recorder_want_frame(gif.recorder) then return end
+    ReadFrameAsync(function(pixels, width, height)
+        -- Finished before the frame made it back
+        if gifs[file_name] ~= gif then return end
+        C.gif_recorder_add_frame(gif.recorder, pixels, width, height, timestamp)
+    end, gif.size)
+end
+
+--- Wait until every frame captured so far has been handed to gifski
+GifFlush = function (file_name)
+    local gif = assert(gifs[file_name], "invalid file name passed to GifFlush")
+    PollReadbacks(true)
+    C.gif_recorder_flush(gif.recorder)
+end
+
+---@return table|nil { offered, added, written, dropped, queued, errors }
+GifStats = function (file_name)
+    local gif = gifs[file_name]
+    if not gif then return end
+    local stats = C.gif_recorder_stats(gif.recorder)
+    return {
+        offered = stats.offered, added = stats.added, written = stats.written,
+        dropped = stats.dropped, queued = stats.queued, errors = stats.errors,
+    }
 end
 
 GifFinish = function (file_name)
-    RequireGifski()
     -- If no file name provided, complete all GIFs
     if not file_name then
-        for k in pairs(gifskis) do
+        for k in pairs(gifs) do
             GifFinish(k)
         end
         return
     end
-    assert(type(file_name) == "string" and gifskis[file_name],
+    assert(type(file_name) == "string" and gifs[file_name],
            "invalid file name passed to GifFinish")
-    local err = gifski.gifski_finish(gifskis[file_name])
-    if err ~= "GIFSKI_OK" then
+    -- Frames still being read back belong in the GIF
+    PollReadbacks(true)
+    C.gif_recorder_flush(gifs[file_name].recorder)
+    local stats = GifStats(file_name)
+    local err = C.gif_recorder_stop(gifs[file_name].recorder)
+    gifs[file_name] = nil
+    C.hold_intermediary_framebuffer(false)
+    if err ~= 0 then
         print("ERROR: Unable to create GIF "..file_name)
         print("Error code: "..tostring(err))
+        return
+    end
+    print(string.format("%s is completed!! (%d frames, %d dropped)", file_name, stats.written, stats.dropped))
+end
+
+local apngs = {}
+
+--- Start recording an animated PNG. Only the part of each frame that
+--- changed is stored, so mostly still animations stay small and cheap.
+---@param path string
+---@param settings table|nil { loop = true, compression = 6, queue = 4, backpressure = "block"|"drop"|"grow" }
+--- plus the capture `width`, `height`, `scale` and `filter` (see ReadFrameAsync)
+ApngStart = function (path, settings)
+    assert(type(path) == "string", "expected path for ApngStart")
+    assert(not apngs[path], "already recording to "..path)
+    settings = settings or {}
+    local writer = C.apng_open(path, ffi.new("ApngSettings", {
+        plays = settings.loop == false and 1 or 0,
+        compression = settings.compression or 6,
+        queue_size = settings.queue or 4,
+        backpressure = assert(backpressures[settings.backpressure or "block"], "unknown APNG backpressure"),
+    }))
+    if writer == nil then return false end
+    apngs[path] = { writer = writer, size = settings }
+    return true
+end
+
+--- Capture this frame into the APNG
+---@param path string
+---@param timestamp number|nil seconds, defaults to now
+ApngAddFrame = function (path, timestamp)
+    local apng = assert(apngs[path], "not recording to "..tostring(path))
+    timestamp = timestamp or Seconds()
+    ReadFrameAsync(function (_, width, height, detach)
+        -- Stopped before the frame made it back
+        if apngs[path] ~= apng then return end
+        C.apng_add_frame(apng.writer, detach(), width, height, timestamp)
+    end, apng.size)
+end
+
+local apng_stats_table = function (stats)
+    return {
+        frames = stats.frames, unchanged = stats.unchanged, mismatched = stats.mismatched,
+        dropped = stats.dropped, full_bytes = tonumber(stats.full_bytes),
+        delta_bytes = tonumber(stats.delta_bytes), file_bytes = tonumber(stats.file_bytes),
+        mean_encode_ms = stats.mean_encode_ms, max_encode_ms = stats.max_encode_ms,
+    }
+end
+
+---@return table|nil { frames, unchanged, mismatched, dropped, full_bytes, delta_bytes, file_bytes, mean_encode_ms, max_encode_ms }
+ApngStats = function (path)
+    local apng = apngs[path]
+    if not apng then return end
+    return apng_stats_table(C.apng_stats(apng.writer))
+end
+
+--- Finish the APNG, or all of them
+---@param path string|nil
+---@return table|nil final stats
+ApngStop = function (path)
+    if not path then
+        for k in pairs(apngs) do ApngStop(k) end
+        return
+    end
+    local apng = assert(apngs[path], "not recording to "..tostring(path))
+    PollReadbacks(true)
+    apngs[path] = nil
+    local stats = apng_stats_table(C.apng_close(apng.writer))
+    Info(string.format("%s: %d frames (%d unchanged), %.0f%% of pixels stored, %d bytes, %.1fms per frame",
+                       path, stats.frames, stats.unchanged,
+                       100 * stats.delta_bytes / math.max(stats.full_bytes, 1),
+                       stats.file_bytes, stats.mean_encode_ms))
+    return stats
+end
+
+local videos = {}
+local video_formats = { y4m = C.VIDEO_Y4M, rgba = C.VIDEO_RGBA }
+-- print from before stdout carried a video, put back when it stops
+local stdout_print = nil
+
+--- Start streaming frames to a file, FIFO or stdout ("-") for an external
+--- encoder, e.g. `ffmpeg -i recording.y4m out.mp4`. Raw RGBA has no header,
+--- use `-f rawvideo -pixel_format rgba -video_size WxH -framerate FPS`.
+--- The video is constant frame rate, gaps repeat the previous frame.
+---@param path string
+---@param settings table|nil { format = "y4m"|"rgba", fps = 60, pool = 8, backpressure = "drop"|"block" }
+--- plus the capture `width`, `height`, `scale` and `filter` (see ReadFrameAsync)
+VideoStart = function (path, settings)
+    assert(type(path) == "string", "expected path for VideoStart")
+    assert(not videos[path], "already recording to "..path)
+    settings = settings or {}
+    local format = assert(video_formats[settings.format or "y4m"], "video format must be \"y4m\" or \"rgba\"")
+    local sink = C.video_sink_open(path, ffi.new("VideoSinkSettings", {
+        format = format,
+        fps = settings.fps or 60,
+        pool_frames = settings.pool or 8,
+        block_when_full = settings.backpressure == "block",
+    }))
+    if sink == nil then return false end
+    if path == "-" then
+        -- stdout carries the video now, keep everything else out of it
+        stdout_print = print
+        print = function (...)
+            local args = { ... }
+            for i = 1, select("#", ...) do args[i] = tostring(args[i]) end
+            io.stderr:write(table.concat(args, "\t"), "\n")
+        end
+    end
+    videos[path] = { sink = sink, size = settings }
+    return true
+end
+
+--- Capture this frame into the video
+---@param path string
+---@param timestamp number|nil seconds, defaults to now
+VideoAddFrame = function (path, timestamp)
+    local video = assert(videos[path], "not recording to "..tostring(path))
+    timestamp = timestamp or Seconds()
+    ReadFrameAsync(function (pixels, width, height)
+        -- Stopped before the frame made it back
+        if videos[path] ~= video then return end
+        C.video_sink_add_frame(video.sink, pixels, width, height, timestamp)
+    end, video.size)
+end
+
+---@return table|nil { captured, written, repeated, skipped, dropped, mismatched, queued, bytes, mean_write_ms, max_write_ms, failed }
+VideoStats = function (path)
+    local video = videos[path]
+    if not video then return end
+    local stats = C.video_sink_stats(video.sink)
+    return {
+        captured = stats.captured, written = stats.written, repeated = stats.repeated,
+        skipped = stats.skipped, dropped = stats.dropped, mismatched = stats.mismatched,
+        queued = stats.queued, bytes = tonumber(stats.bytes),
+        mean_write_ms = stats.mean_write_ms, max_write_ms = stats.max_write_ms,
+        failed = stats.failed,
+    }
+end
+
+--- Write out what's left and close the video, or all of them
+---@param path string|nil
+VideoStop = function (path)
+    if not path then
+        for k in pairs(videos) do VideoStop(k) end
+        return
+    end
+    assert(videos[path], "not recording to "..tostring(path))
+    PollReadbacks(true)
+    local sink = videos[path].sink
+    videos[path] = nil
+    local stats = C.video_sink_close(sink)
+    if path == "-" then
+        print = stdout_print
+        stdout_print = nil
+    end
+    Info(string.format("%s: %d frames written (%d repeated), %d skipped, %d dropped, %.1fms per frame",
+                       path, stats.written, stats.repeated, stats.skipped, stats.dropped, stats.mean_write_ms))
+end
+
+
+local replay = nil
+
+--- Keep the last few seconds in memory, small and compressed, so they can
+--- be saved after something interesting happened. Frames are captured at
+--- most `fps` times a second and encoded on a worker thread; memory never
+--- goes over `memory_mb`.
+---@param settings table|nil { seconds = 20, memory_mb = 64, fps = 30, keyframe = 2 * fps,
+--- plus the capture `width` (default 480), `height`, `scale` and `filter` (see ReadFrameAsync) }
+ReplayStart = function (settings)
+    if replay then ReplayStop() end
+    settings = settings or {}
+    local fps = settings.fps or 30
+    local buffer = C.replay_new(ffi.new("ReplaySettings", {
+        max_bytes = (settings.memory_mb or 64) * 1024 * 1024,
+        max_seconds = settings.seconds or 20,
+        keyframe_interval = settings.keyframe or 2 * fps,
+    }))
+    if buffer == nil then return false end
+    local size = { width = settings.width, height = settings.height, scale = settings.scale, filter = settings.filter }
+    if not size.width and not size.height and not size.scale then size.width = 480 end
+    replay = { buffer = buffer, size = size, fps = fps, next_capture = 0, saves = {} }
+    return true
+end
+
+--- Capture this frame into the replay buffer if it's time for one
+---@param timestamp number|nil seconds, defaults to now
+ReplayAddFrame = function (timestamp)
+    if not replay then return end
+    timestamp = timestamp or Seconds()
+    if timestamp < replay.next_capture then return end
+    -- Keeps the cadence, but after a gap the next one is a whole frame away
+    replay.next_capture = math.max(replay.next_capture, timestamp - 1 / replay.fps) + 1 / replay.fps
+    local current = replay
+    ReadFrameAsync(function (_, width, height, detach)
+        -- Stopped before the frame made it back
+        if replay ~= current then return end
+        C.replay_add_frame(current.buffer, detach(), width, height, timestamp)
+    end, replay.size)
+end
+
+--- Save the replay buffer as it is now, recording carries on meanwhile.
+--- The extension picks the format: .gif, .y4m or .rgba video, anything else is an APNG.
+---@param path string
+---@param on_done function|nil called as a scheduled task with whether it was saved
+---@param settings table|nil { quality = 90 } for GIFs, { compression = 6 } for APNGs
+ReplaySave = function (path, on_done, settings)
+    assert(replay, "replay buffer isn't running, see ReplayStart")
+    assert(type(path) == "string", "expected path for ReplaySave")
+    settings = settings or {}
+    local extension = path:match("%.(%w+)$")
+    local id
+    if extension == "gif" then
+        RequireGifski()
+        local gif = gifski.gifski_new(ffi.new("GifskiSettings[1]", { { quality = settings.quality or 90 } }))
+        if gif == nil then
+            Warning("invalid settings for GIF")
+            return false
+        end
+        gifski.gifski_set_file_output(gif, path)
+        id = C.replay_save_gif(replay.buffer, gif,
+            ffi.cast("GifskiAddFrameFn", gifski.gifski_add_frame_rgba),
+            ffi.cast("GifskiFinishFn", gifski.gifski_finish))
+        if id < 0 then gifski.gifski_finish(gif) end
+    elseif video_formats[extension] then
+        id = C.replay_save_video(replay.buffer, path, ffi.new("VideoSinkSettings", {
+            format = video_formats[extension],
+            fps = replay.fps,
+        }))
+    else
+        id = C.replay_save_apng(replay.buffer, path, ffi.new("ApngSettings", {
+            plays = 0,
+            compression = settings.compression or 6,
+        }))
+    end
+    if id < 0 then
+        if on_done then ScheduleFn(function() on_done(false) end, 0) end
+        return false
+    end
+    replay.saves[id] = on_done or false
+    return true
+end
+
+--- Hand finished replay saves to their callbacks
+PollReplaySaves = function ()
+    if not replay or next(replay.saves) == nil then return end
+    local results = ffi.new("WorkResult[4]")
+    local n = C.replay_poll_saves(replay.buffer, results, 4)
+    for i = 0, n - 1 do
+        local id, ok = results[i].id, results[i].ok
+        local on_done = replay.saves[id]
+        replay.saves[id] = nil
+        if on_done then ScheduleFn(function() on_done(ok) end, 0) end
+    end
+end
+
+---@return table|nil { frames, seconds, bytes, raw_bytes, captured, dropped, evicted, saving, mean_encode_ms, max_encode_ms }
+ReplayStats = function ()
+    if not replay then return end
+    local stats = C.replay_stats(replay.buffer)
+    return {
+        frames = stats.frames, seconds = stats.seconds,
+        bytes = tonumber(stats.bytes), raw_bytes = tonumber(stats.raw_bytes),
+        captured = stats.captured, dropped = stats.dropped, evicted = stats.evicted,
+        saving = stats.saving, mean_encode_ms = stats.mean_encode_ms, max_encode_ms = stats.max_encode_ms,
+    }
+end
+
+--- Stop recording and free the buffer, after any saves in progress.
+--- Their callbacks are still scheduled.
+ReplayStop = function ()
+    if not replay then return end
+    while next(replay.saves) ~= nil do
+        PollReplaySaves()
+        if next(replay.saves) ~= nil then C.SDL_Delay(1) end
     end
-    gifskis[file_name] = nil
-    print(file_name.." is completed!!")
+    -- Let pending frames see the buffer is gone
+    local buffer = replay.buffer
+    replay = nil
+    C.replay_free(buffer)
 end
 
 
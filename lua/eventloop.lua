@@ -15,13 +15,76 @@ local OnKey = function(key, is_down)
         loader.HotReload()
     elseif key == 'S' and is_down then
         Screenshot(loader.active_module.source..".png")
+    elseif key == 'I' and is_down and ReplayStats() then
+        -- Instant replay of the last BUBBL_REPLAY seconds
+        ReplaySave(loader.active_module.source..os.date("_replay_%Y%m%d-%H%M%S.png"))
+    elseif key == 'P' and is_down then
+        -- BUBBL_POSTER_SCALE times the window size
+        RenderPoster(loader.active_module.source.."_poster.png",
+                     { scale = tonumber(os.getenv("BUBBL_POSTER_SCALE")) })
     end
     loader.Callback("OnKey", key, is_down)
 end
 
+local ProcessEvents = function ()
+    for event in PendingEvents() do
+        if event.type == "EVENT_KEY" then
+            OnKey(ffi.string(event.key.name), event.key.is_down)
+
+        elseif event.type == "EVENT_MOUSEBUTTON" then
+            if event.mousebutton.is_down then
+                loader.Callback("OnMouseDown", event.mousebutton.position:Unpack())
+            else
+                loader.Callback("OnMouseUp", event.mousebutton.position:Unpack())
+            end
+
+        elseif event.type == "EVENT_MOUSEMOTION" then
+            loader.Callback("OnMouseMove", event.mousemotion.position:Unpack())
+
+        elseif event.type == "EVENT_MOUSEWHEEL" then
+            loader.Callback("OnMouseWheel", event.mousewheel.scroll:Unpack())
+
+        elseif event.type == "EVENT_RESIZE" then
+            resolution.x = event.resize.width
+            resolution.y = event.resize.height
+            loader.Callback("OnWindowResize", resolution.x, resolution.y)
+        end
+    end
+end
+
+-- Set BUBBL_LATENCY to periodically print input-to-swap latency
+local REPORT_LATENCY_INTERVAL = os.getenv("BUBBL_LATENCY") and 5
+local last_latency_report = Seconds()
+local ReportLatency = function (now)
+    if not REPORT_LATENCY_INTERVAL or now - last_latency_report < REPORT_LATENCY_INTERVAL then
+        return
+    end
+    last_latency_report = now
+    local latency = InputLatency()
+    if latency.samples > 0 then
+        Info(string.format("input latency: mean %.1fms, max %.1fms (%d frames)",
+                           latency.mean, latency.max, latency.samples))
+    end
+end
+
+-- Set BUBBL_RECORD to a path, or - for stdout, to stream every frame as video
+-- (BUBBL_RECORD_FORMAT=rgba for raw frames instead of Y4M)
+local RECORD_PATH = os.getenv("BUBBL_RECORD")
+if RECORD_PATH then
+    VideoStart(RECORD_PATH, { format = os.getenv("BUBBL_RECORD_FORMAT") })
+end
+
+-- Set BUBBL_REPLAY to a number of seconds to keep for instant replays (I saves them)
+local REPLAY_SECONDS = tonumber(os.getenv("BUBBL_REPLAY"))
+if REPLAY_SECONDS then
+    ReplayStart({ seconds = REPLAY_SECONDS })
+end
+
 local draw
+local first_frame = true
 
 loader.Start(arg[1] or DEFAULT_MODULE)
+C.startup_mark("module started")
 
 while not ShouldQuit() do
     local now = Seconds()
@@ -29,8 +92,17 @@ while not ShouldQuit() do
     UpdateCurrentTick()
     last_time = now
 
+    -- Input goes first so it shows up in the frame we're about to draw
+    ProcessEvents()
+    LatchInput()
+
     StartDrawing()
 
+    -- Screenshots and GIF frames from earlier frames
+    PollReadbacks()
+    PollPngWrites()
+    PollImageLoads()
+    PollReplaySaves()
     RunScheduler()
     TheServer:Update()
 
@@ -51,32 +123,20 @@ while not ShouldQuit() do
     -- restart Draw function next frame, unless this one is unfinished
     if coroutine.status(draw) == "dead" then draw = nil end
 
-    FlushRenderers()
-    UpdateScreen(window)
-
-    for event in PendingEvents() do
-        if event.type == "EVENT_KEY" then
-            OnKey(ffi.string(event.key.name), event.key.is_down)
-
-        elseif event.type == "EVENT_MOUSEBUTTON" then
-            if event.mousebutton.is_down then
-                loader.Callback("OnMouseDown", event.mousebutton.position:Unpack())
-            else
-                loader.Callback("OnMouseUp", event.mousebutton.position:Unpack())
-            end
-
-        elseif event.type == "EVENT_MOUSEMOTION" then
-            loader.Callback("OnMouseMove", event.mousemotion.position:Unpack())
-
-        elseif event.type == "EVENT_MOUSEWHEEL" then
-            loader.Callback("OnMouseWheel", event.mousewheel.scroll:Unpack())
+    -- Re-sample the cursor as late as possible for anything following it
+    LatchInput()
+    loader.Callback("LateDraw", MousePosition())
 
-        elseif event.type == "EVENT_RESIZE" then
-            resolution.x = event.resize.width
-            resolution.y = event.resize.height
-            loader.Callback("OnWindowResize", resolution.x, resolution.y)
-        end
+    FlushRenderers()
+    if first_frame then
+        C.startup_mark("first frame drawn")
+        first_frame = false
     end
+    if RECORD_PATH then VideoAddFrame(RECORD_PATH, now) end
+    ReplayAddFrame(now)
+    UpdateScreen(window)
+    DrawPendingPosters(loader.active_module)
+    ReportLatency(now)
 end
 
 OnQuit()
@@ -26,12 +26,16 @@ package.cpath = "./deps/lua_modules/lib64/lua/5.1/?.so;" .. package.cpath
 require "api"
 require "scheduler"
 require "http.server"
+ffi.C.startup_mark("Lua libraries")
 
 resolution = Vector2(600, 300)
 
 OnQuit = function ()
     -- Finish any remaining GIFs
     GifFinish()
+    VideoStop()
+    ApngStop()
+    ReplayStop()
 end
 
 -- Strict global table
@@ -55,6 +59,35 @@ do
 
 end
 
+-- bubbl --convert frame_*.qoi
+if arg[1] == "--convert" then
+    local outputs = ConvertQoiToPng({ unpack(arg, 2) })
+    -- Count what the writes report rather than which files exist, an old
+    -- or partly written PNG could be there
+    local C = ffi.C
+    local results = ffi.new("WorkResult[16]")
+    local written = 0
+    local drain = function()
+        repeat
+            local n = C.png_writer_poll(results, 16)
+            for i = 0, n - 1 do
+                if results[i].ok then written = written + 1 end
+            end
+        until n < 16
+    end
+    repeat
+        drain()
+        local stats = C.png_writer_stats()
+        local busy = stats.queued + stats.running > 0
+        if busy then C.SDL_Delay(1) end
+    until not busy
+    -- Results are in before a job stops counting as running
+    drain()
+    C.png_writer_shutdown()
+    print(string.format("Converted %d of %d files", written, #outputs))
+    os.exit(written == #outputs and 0 or 1)
+end
+
 Global "TheServer"
 Global "window"
 window = CreateWindow("bubbl", resolution:Unpack())
@@ -1,3 +1,4 @@
+local C = require("ffi").C
 local loader = {}
 
 local FileExists = function (name)
@@ -7,18 +8,31 @@ local FileExists = function (name)
 end
 
 
+-- Each load owns the GPU resources made while it's active,
+-- and frees them when the next module loads
+local load_count = 0
+
 loader.LoadModule = function (module_name)
     TheServer = require "server"
     local module
 
+    local previous_owner = loader.active_module and loader.active_module.gpu_owner
+    load_count = load_count + 1
+    local owner = module_name.."#"..load_count
+    C.gpu_set_owner(owner)
+
     local require_path = "modules."..module_name
     package.loaded[require_path] = nil
     local ok, result = xpcall(require, debug.traceback, require_path)
     if not ok then
         Warning("Error loading module: ", module_name, "\n", result)
+        C.gpu_release_owner(owner)
+        C.gpu_set_owner(previous_owner or "engine")
         return;
     end
     module = result
+    module.gpu_owner = owner
+    if previous_owner then C.gpu_release_owner(previous_owner) end
         --[[
         --TODO: support C modules again
     elseif FileExists(module_name_c) then
@@ -282,7 +282,8 @@ return {
         local all_bubbles = CollectAllBubbles()
 
         --- Render bubbles ---
-        for i, bubble in ipairs(all_bubbles) do bubble:Render() end
+        -- The cursor bubble is drawn in LateDraw
+        for i, bubble in ipairs(bubbles) do bubble:Render() end
 
         --- Update pop effect particles ---
         for _, pop in ipairs(pop_effects) do
@@ -319,4 +320,13 @@ return {
             })
         end
     end,
+
+    -- Called right before flushing with the freshest cursor position
+    LateDraw = function(mouse)
+        if cursor_bubble then
+            cursor_bubble.position = mouse
+            EnsureBubbleInBounds(cursor_bubble)
+            cursor_bubble:Render()
+        end
+    end,
 }
@@ -38,6 +38,7 @@ local NextGeneration = function (current_field)
 end
 
 local field = {}
+local background = CreateLayer()
 
 return {
     title = "Game of Life",
@@ -59,12 +60,19 @@ return {
         local spacing_x = resolution.x / COLS
         local spacing_y = resolution.y / ROWS
         local size = math.min(spacing_x, spacing_y) / 2
+        -- Every cell drawn dead once, the living are drawn over it
+        background:draw(function()
+            for row=1, ROWS do
+                for col=1, COLS do
+                    RenderBubble(Vector2(col * spacing_x - size, row * spacing_y - size), COLOR_DEAD, size)
+                end
+            end
+        end)
         for row=1, ROWS do
             for col=1, COLS do
-                local x = col * spacing_x - size
-                local y = row * spacing_y - size
-                local color = field[row][col] == "alive" and COLOR_ALIVE or COLOR_DEAD
-                RenderBubble(Vector2(x, y), color, size)
+                if field[row][col] == "alive" then
+                    RenderBubble(Vector2(col * spacing_x - size, row * spacing_y - size), COLOR_ALIVE, size)
+                end
             end
         end
     end,
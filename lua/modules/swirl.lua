@@ -1,6 +1,6 @@
 local GENERATE_FRAMES = false
 
-local sin, cos, deg, atan2 = math.sin, math.cos, math.deg, math.atan2
+local sin, cos = math.sin, math.cos
 
 local SIZE = 13
 local PERIOD = 2
@@ -19,12 +19,8 @@ local bg_width, bg_height = 512, 512
 local background = CreateCanvas(bg_width, bg_height)
 
 local BuildBackground = function()
-    for y=0, bg_height-1 do
-        for x=0, bg_width-1 do
-            local theta = atan2(y - bg_height/2, x - bg_width/2)
-            background:set(x, y, Color.Hsl(deg(theta), 1, 0.5, BG_ALPHA))
-        end
-    end
+    -- Hue follows the angle around the center
+    background:angular_gradient(Vector2(bg_width/2, bg_height/2), HueRamp(1, 0.5, BG_ALPHA))
 end
 
 local Render = function(theta)
@@ -57,10 +53,13 @@ if GENERATE_FRAMES then
     local FPS = 45
     local frames_count = FPS * PERIOD
     local i = 0
-    Draw = function()
+    Draw = function(_, frame)
         Render(i/frames_count * 2*PI)
+        -- Posters draw this frame again, it's only saved once
+        if frame and frame.poster then return end
         if i < frames_count then
-            Screenshot(string.format("frame_%003d.png", i))
+            -- QOI keeps up with the frame rate, `bubbl --convert frame_*.qoi` makes PNGs
+            Screenshot(string.format("frame_%003d.qoi", i))
             i = i + 1
         end
     end
@@ -1,7 +1,14 @@
+local ffi = require "ffi"
+
 local tests = {}
 
 local overwrite = arg[2] == "overwrite"
 
+-- Screenshots are taken on the first frame, nothing can wait on the upload thread
+SetAsyncUploads(false)
+-- A cached image would skip the decoder under test
+ConfigureImageLoader { cache = false }
+
 local TestScreenshot = function (name, path, func)
     table.insert(tests, {
         name = name,
@@ -32,6 +39,18 @@ TestScreenshot("canvas solid red", "solidbg", function()
     canvas:draw()
 end)
 
+-- Looked up in the palette, it should match the RGBA canvas exactly
+TestScreenshot("indexed canvas solid red", "solidbg", function()
+    local canvas = CreateCanvas(1, 1, { format = "indexed", palette = { Color.Hex "#000000", Color.Hex "#550000" } })
+    canvas:fill(1, 0, 0, 1, 1)
+    canvas:draw()
+end)
+
+-- Decoded from the reference itself, so it should draw back the same pixels
+TestScreenshot("image canvas", "solidbg", function()
+    LoadImage("tests/solidbg.png"):draw()
+end)
+
 TestScreenshot("simple shader", "simpleshader", function()
     local SourceLoader = function()
         return [[
@@ -60,6 +79,70 @@ TestScreenshot("simple pop", "simplepop", function()
     RenderPop(pos, Color.Hex("#0000FF"), 100)
 end)
 
+-- Six passes at the same scale, so the pooled targets are reused along the
+-- chain. Four shift the pop a quarter of the way across and back to where
+-- it was; a pass sampling its own output would smear it instead.
+TestScreenshot("post-processing chain", "simplepop", function()
+    RenderPop(resolution / 2, Color.Hex("#0000FF"), 100)
+    local Shift = function()
+        return [[
+        #version 330
+        in vec2 uv_coord;
+        uniform sampler2D input0;
+        uniform float shift;
+        out vec4 outcolor;
+        void main() {
+            outcolor = texture(input0, fract(uv_coord + vec2(shift, 0)));
+        }
+        ]]
+    end
+    local chain = { "scene", "a", "b", "c", "d", "e", "screen" }
+    for i = 1, #chain - 1 do
+        PostProcess("chain"..i, Shift, { shift = i <= 4 and 0.25 or 0 },
+                    { inputs = { chain[i] }, output = chain[i + 1] })
+    end
+end)
+
+-- Every kernel over widths that aren't a multiple of 4, so both the SSE2
+-- path and the scalar one write pixels. The reference was made with the
+-- scalar path alone. The canvas then goes through a QOI file and back,
+-- which must not change a pixel.
+local kernels_image
+TestScreenshot("canvas kernels", "canvaskernels", function()
+    if not kernels_image then
+        local canvas = CreateCanvas(256, 256)
+        canvas:fill(Color.Hex "#203040")
+        canvas:fill(Color.Hex "#C08020", 3, 5, 125, 61)
+
+        local strip = CreateCanvas(253, 90)
+        local ramp = ColorRamp { Color.Hex "#FF0000", Color.Hex "#00FF00", Color.Hex "#0000FF" }
+        strip:linear_gradient(Vector2(-7, 3), Vector2(260, 85), ramp)
+        canvas:blit(strip, 1, 70, "copy")
+
+        local wheel = CreateCanvas(125, 95)
+        wheel:angular_gradient(Vector2(61.5, 40.25), HueRamp(), 0.5)
+        canvas:blit(wheel, 2, 165, "copy")
+
+        local glass = CreateCanvas(131, 77)
+        glass:fill(Color.Hex("#FFFFFF", 0.5))
+        glass:fill(Color.Hex("#00FFFF", 0.25), 10, 10, 61, 30)
+        canvas:blit(glass, 121, 170)
+
+        -- Files have the top row first, canvases the bottom one
+        local width, height = canvas.width, canvas.height
+        local rows = ffi.new("Pixel[?]", width * height)
+        for y = 0, height - 1 do
+            ffi.copy(rows + (height - 1 - y) * width, canvas.data + y * width, width * ffi.sizeof("Pixel"))
+        end
+        local tmpname = os.tmpname()
+        assert(ffi.C.write_image(tmpname..".qoi", ffi.cast("uint8_t *", rows), width, height))
+        kernels_image = assert(LoadImage(tmpname..".qoi"))
+        os.remove(tmpname..".qoi")
+        os.remove(tmpname)
+    end
+    kernels_image:draw()
+end)
+
 ------------------------------------------------------
 
 print("overwrite="..tostring(overwrite))
@@ -79,7 +162,10 @@ return {
             local contents = SlurpFile(path)
             print("TEST "..active.name)
             local tmpname = os.tmpname()
-            if not Screenshot(tmpname) then
+            local written
+            Screenshot(tmpname, function(ok) written = ok end)
+            while written == nil do Suspend() end
+            if not written then
                 print("\tFailed to take screenshot!")
                 return
             end
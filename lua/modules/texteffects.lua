@@ -244,7 +244,7 @@ return {
             -- TODO: GIFs
             local time = Seconds()
             if time < GIF_LENGTH then
-                GifAddFrame(GIF_FILENAME, frame, time)
+                GifAddFrame(GIF_FILENAME, time)
             end
             frame = frame + 1
         end
@@ -295,7 +295,7 @@ local Draw = function ()
 
     if GENERATING_FRAMES then
         local time = Seconds()
-        GifAddFrame(VAR.GIF_FILENAME, frame, time)
+        GifAddFrame(VAR.GIF_FILENAME, time)
         frame = frame + 1
     end
 
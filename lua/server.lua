@@ -13,6 +13,9 @@ local port = 3636
 
 local http_server = require "http.server"
 local http_headers = require "http.headers"
+local condition = require "cqueues.condition"
+local ffi = require "ffi"
+local C = ffi.C
 
 local Result = function (v, ...)
     if type(v) == "function" then return v(...) end
@@ -151,6 +154,59 @@ local ValueToJson = function (v)
     end
 end
 
+-- Live preview for /api/stream, as a multipart stream of PNGs.
+-- BUBBL_STREAM_FPS and BUBBL_STREAM_WIDTH set the rate and size.
+local preview = {
+    fps = tonumber(os.getenv("BUBBL_STREAM_FPS")) or 10,
+    width = tonumber(os.getenv("BUBBL_STREAM_WIDTH")) or 640,
+    clients = 0,
+    next_capture = 0,
+    frame = nil, -- Newest PNG
+    serial = 0,
+    updated = condition.new(),
+}
+local PREVIEW_BOUNDARY = "bubblframe"
+
+-- Capture and collect preview frames while anyone's watching
+local UpdatePreview = function ()
+    if preview.clients == 0 then return end
+    local now = Seconds()
+    if now >= preview.next_capture then
+        -- Keeps the cadence, but after a gap the next one is a whole frame away
+        preview.next_capture = math.max(preview.next_capture, now - 1 / preview.fps) + 1 / preview.fps
+        ReadFrameAsync(function (_, width, height, detach)
+            C.frame_stream_encode(detach(), width, height)
+        end, { width = preview.width })
+    end
+    local frame = ffi.new("StreamFrame")
+    if C.frame_stream_take(frame) then
+        preview.frame = ffi.string(frame.data, frame.size)
+        preview.serial = frame.serial
+        C.free(frame.data)
+        preview.updated:signal()
+    end
+end
+
+-- Runs in the client's own coroutine. A slow client blocks only itself,
+-- and skips to the newest frame once it's ready for another.
+local StreamPreview = function (stream)
+    BuildHeaders(stream, 200, "multipart/x-mixed-replace; boundary="..PREVIEW_BOUNDARY)
+    preview.clients = preview.clients + 1
+    local sent = 0
+    while true do
+        if preview.serial == sent then preview.updated:wait(1) end
+        if preview.serial ~= sent then
+            sent = preview.serial
+            local part = string.format("--%s\r\ncontent-type: image/png\r\ncontent-length: %d\r\n\r\n",
+                                       PREVIEW_BOUNDARY, #preview.frame)
+            if not stream:write_chunk(part..preview.frame.."\r\n", false) then break end
+        elseif stream.state == "closed" or stream.state == "half closed (local)" then
+            break
+        end
+    end
+    preview.clients = preview.clients - 1
+end
+
 local function Reply(server, stream) -- luacheck: ignore 212
     -- Read in headers
     local req_headers = assert(stream:get_headers())
@@ -219,6 +275,66 @@ local function Reply(server, stream) -- luacheck: ignore 212
         s = s .. "}"
         assert(stream:write_chunk(s, true))
 
+    elseif path == "/api/timings" and req_method == "GET" then
+        BuildHeaders(stream, 200, "application/json")
+        local items = {}
+        for id, ms in pairs(PostProcessTimings()) do
+            table.insert(items, string.format("\"%s\": %.3f", id, ms))
+        end
+        assert(stream:write_chunk("{"..table.concat(items, ", ").."}", true))
+
+    elseif path == "/api/pngstats" and req_method == "GET" then
+        BuildHeaders(stream, 200, "application/json")
+        local items = {}
+        for k, v in pairs(PngWriterStats()) do
+            table.insert(items, string.format("\"%s\": %g", k, v))
+        end
+        assert(stream:write_chunk("{"..table.concat(items, ", ").."}", true))
+
+    elseif path == "/api/gpu" and req_method == "GET" then
+        BuildHeaders(stream, 200, "application/json")
+        local totals, resources = GpuResources()
+        local items = {}
+        for _, r in ipairs(resources) do
+            table.insert(items, string.format(
+                "{\"type\": \"%s\", \"name\": %d, \"bytes\": %d, \"refs\": %d, \"cached\": %s, "..
+                "\"last_used\": %d, \"owner\": \"%s\", \"label\": \"%s\"}",
+                r.type, r.name, r.bytes, r.refs, tostring(r.cached), r.last_used, r.owner, r.label))
+        end
+        local by_type = {}
+        for k, v in pairs(totals.bytes_by_type) do
+            table.insert(by_type, string.format("\"%s\": %d", k, v))
+        end
+        assert(stream:write_chunk(string.format(
+            "{\"count\": %d, \"bytes\": %d, \"budget\": %d, \"evicted\": %d, \"released\": %d, "..
+            "\"over_budget\": %s, \"bytes_by_type\": {%s}, \"resources\": [%s]}",
+            totals.count, totals.bytes, totals.budget, totals.evicted, totals.released,
+            tostring(totals.over_budget), table.concat(by_type, ", "), table.concat(items, ", ")), true))
+
+    elseif path == "/api/stream" and req_method == "GET" then
+        StreamPreview(stream)
+
+    elseif path == "/api/streamstats" and req_method == "GET" then
+        BuildHeaders(stream, 200, "application/json")
+        local stats = C.frame_stream_stats()
+        assert(stream:write_chunk(string.format(
+            "{\"clients\": %d, \"encoded\": %d, \"dropped\": %d, \"mean_encode_ms\": %g, \"bytes\": %d}",
+            preview.clients, stats.encoded, stats.dropped, stats.mean_encode_ms, tonumber(stats.bytes)), true))
+
+    elseif path == "/api/replaystats" and req_method == "GET" then
+        BuildHeaders(stream, 200, "application/json")
+        local items = {}
+        for k, v in pairs(ReplayStats() or {}) do
+            table.insert(items, string.format("\"%s\": %g", k, v))
+        end
+        assert(stream:write_chunk("{"..table.concat(items, ", ").."}", true))
+
+    elseif path == "/action/replay" and req_method == "POST" then
+        BuildHeaders(stream, 200, "text/plain", true)
+        if ReplayStats() then
+            ReplaySave(loader.active_module.source..os.date("_replay_%Y%m%d-%H%M%S.png"))
+        end
+
     elseif path == "/action/reload" and req_method == "POST" then
         BuildHeaders(stream, 200, "text/plain", true)
         loader.HotReload()
@@ -271,6 +387,7 @@ end
 local started = false
 
 function Server:Update()
+    UpdatePreview()
     server:step(0.01)
     if not started then
         started = true
@@ -3,8 +3,11 @@
 layout(location=0) in vec2 pos;
 uniform vec2 resolution;
 out float LENGTH;
+out vec2 uv_coord;
 
 void main() {
     LENGTH = length(resolution);
     gl_Position = vec4(pos, 0.0, 1.0);
+    // For post-processing passes sampling input0..input3
+    uv_coord = (pos + 1) / 2;
 }
@@ -1,11 +1,18 @@
 #version 330
 
 uniform sampler2D pixels;
+// Indexed canvases keep the palette index in the red channel
+uniform sampler2D palette;
+uniform bool indexed;
 
 layout(location = 0) out vec4 outcolor;
 
 in vec2 uv_coord;
 
 void main() {
-    outcolor = texture(pixels, uv_coord);
+    vec4 texel = texture(pixels, uv_coord);
+    if (indexed) {
+        texel = texelFetch(palette, ivec2(texel.r * 255.0 + 0.5, 0), 0);
+    }
+    outcolor = texel;
 }
@@ -0,0 +1,14 @@
+#version 330
+
+layout(location=0) in vec2 pos;
+
+// Part of the canvas to show, (0, 0, 1, 1) unless rendering a poster tile
+uniform vec4 uv_rect;
+
+out vec2 uv_coord;
+
+void main() {
+    gl_Position = vec4(pos, 0.0, 1.0);
+    // pos is range [-1, 1]
+    uv_coord = uv_rect.xy + (pos + 1) / 2 * uv_rect.zw;
+}
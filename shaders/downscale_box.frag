@@ -0,0 +1,33 @@
+#version 330
+
+// Area average: every source texel under the output pixel, weighted by
+// how much of it the pixel covers. Flips vertically for readback.
+
+uniform sampler2D pixels;
+uniform vec2 source_size;
+// Source texels per output pixel
+uniform vec2 scale;
+
+layout(location = 0) out vec4 outcolor;
+
+in vec2 uv_coord;
+
+void main() {
+    vec2 center = vec2(uv_coord.x, 1.0 - uv_coord.y) * source_size;
+    vec2 lo = center - scale * 0.5;
+    vec2 hi = center + scale * 0.5;
+    ivec2 first = ivec2(floor(lo));
+    ivec2 last = min(ivec2(ceil(hi)) - 1, ivec2(source_size) - 1);
+
+    vec4 sum = vec4(0.0);
+    float total = 0.0;
+    for (int y = max(first.y, 0); y <= last.y; y++) {
+        float wy = min(hi.y, float(y + 1)) - max(lo.y, float(y));
+        for (int x = max(first.x, 0); x <= last.x; x++) {
+            float w = wy * (min(hi.x, float(x + 1)) - max(lo.x, float(x)));
+            sum += w * texelFetch(pixels, ivec2(x, y), 0);
+            total += w;
+        }
+    }
+    outcolor = sum / max(total, 1e-6);
+}
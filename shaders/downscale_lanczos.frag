@@ -0,0 +1,46 @@
+#version 330
+
+// One separable Lanczos-2 pass along `direction`. The kernel is stretched
+// by `scale` so it covers every source texel when shrinking.
+
+#define PI 3.14159265
+#define LOBES 2.0
+
+uniform sampler2D pixels;
+uniform vec2 source_size;
+uniform vec2 direction; // (1, 0) or (0, 1)
+// Source texels per output pixel along direction, at least 1
+uniform float scale;
+uniform bool flip;
+
+layout(location = 0) out vec4 outcolor;
+
+in vec2 uv_coord;
+
+float lanczos(float x) {
+    if (abs(x) < 1e-5) return 1.0;
+    if (abs(x) >= LOBES) return 0.0;
+    float px = PI * x;
+    return LOBES * sin(px) * sin(px / LOBES) / (px * px);
+}
+
+void main() {
+    vec2 uv = flip ? vec2(uv_coord.x, 1.0 - uv_coord.y) : uv_coord;
+    vec2 position = uv * source_size;
+    float center = dot(position, direction);
+    float radius = LOBES * scale;
+    int size = int(dot(source_size, direction));
+    ivec2 texel = ivec2(position);
+
+    vec4 sum = vec4(0.0);
+    float total = 0.0;
+    for (int i = int(floor(center - radius)); i <= int(ceil(center + radius)); i++) {
+        float w = lanczos((float(i) + 0.5 - center) / scale);
+        ivec2 p = direction.x > 0.5 ? ivec2(clamp(i, 0, size - 1), texel.y)
+                                    : ivec2(texel.x, clamp(i, 0, size - 1));
+        sum += w * texelFetch(pixels, p, 0);
+        total += w;
+    }
+    // Negative lobes can overshoot, the target clamps on write
+    outcolor = sum / total;
+}
@@ -0,0 +1,11 @@
+#version 330
+
+// Stands in for an entity's fragment shader while that's still compiling,
+// linked with the entity's own vertex shader so the quads land where the
+// entities will be
+
+layout(location = 0) out vec4 outcolor;
+
+void main() {
+    outcolor = vec4(1.0, 1.0, 1.0, 0.25);
+}
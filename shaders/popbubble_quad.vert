@@ -7,6 +7,8 @@ layout(location = 2) in vec4 in_color;
 layout(location = 3) in float in_radius;
 
 uniform vec2 resolution;
+// Scene rectangle drawn into the target, (0, 0, resolution) unless rendering a poster tile
+uniform vec4 view;
 uniform float time;
 uniform float starttime;
 
@@ -15,14 +17,18 @@ out vec4 color;
 out float radius;
 
 void main() {
+    // Position and radius in target pixels, which is what gl_FragCoord is compared to
+    vec2 zoom = resolution / view.zw;
+    vec2 center = (in_position - view.xy) * zoom;
+    float target_radius = in_radius * zoom.x;
     // radius in [0, 2] scale
-    vec2 radius_normalized = (in_radius * 4) / resolution * 2;
+    vec2 radius_normalized = (target_radius * 4) / resolution * 2;
     // position [-1, 1] scale
-    vec2 pos_normalized = in_position / resolution * 2.0 - 1;
+    vec2 pos_normalized = center / resolution * 2.0 - 1;
     // pass in a square around the position
     gl_Position = vec4(vertpos * radius_normalized + pos_normalized, 0.0, 1.0);
 
-    pos = in_position;
+    pos = center;
     color = in_color;
-    radius = in_radius;
+    radius = target_radius;
 }
@@ -0,0 +1,11 @@
+#version 330
+
+uniform sampler2DArray tiles;
+
+layout(location = 0) out vec4 outcolor;
+
+in vec3 uv_coord;
+
+void main() {
+    outcolor = texture(tiles, uv_coord);
+}
@@ -0,0 +1,22 @@
+#version 330
+
+layout(location = 0) in vec2 vertpos;
+
+// Bottom left corner of the tile in the scene, and its texture array layer
+layout(location = 1) in vec2 in_tile;
+layout(location = 2) in float in_layer;
+
+// Scene rectangle drawn into the target, see RenderView
+uniform vec4 view;
+// Size of a tile in the scene
+uniform float extent;
+
+out vec3 uv_coord;
+
+void main() {
+    // vertpos is range [-1, 1]
+    vec2 corner = (vertpos + 1) / 2;
+    vec2 pos = in_tile + corner * extent;
+    gl_Position = vec4((pos - view.xy) / view.zw * 2.0 - 1.0, 0.0, 1.0);
+    uv_coord = vec3(corner, in_layer);
+}
@@ -17,17 +17,23 @@ out vec2 trans_angle;
 out float trans_percent;
 
 uniform vec2 resolution;
+// Scene rectangle drawn into the target, (0, 0, resolution) unless rendering a poster tile
+uniform vec4 view;
 
 void main() {
+    // Position and radius in target pixels, which is what gl_FragCoord is compared to
+    vec2 zoom = resolution / view.zw;
+    vec2 center = (in_bubble - view.xy) * zoom;
+    float radius = in_radius * zoom.x;
     // radius in [0, 2] scale
-    vec2 radius_normalized = in_radius / resolution * 2;
+    vec2 radius_normalized = radius / resolution * 2;
     // bubble position [-1, 1] scale
-    vec2 bubblepos_normalized = in_bubble / resolution * 2.0 - 1;
+    vec2 bubblepos_normalized = center / resolution * 2.0 - 1;
     // pass in a square around the bubble position
     gl_Position = vec4(vertpos * radius_normalized + bubblepos_normalized, 0.0, 1.0);
 
-    bubble_pos = in_bubble;
-    rad = in_radius;
+    bubble_pos = center;
+    rad = radius;
     color_a = in_color_a;
     color_b = in_color_b;
     trans_angle = in_trans_angle;
@@ -92,10 +92,221 @@ void render_pop(Particle particle);
 void render_trans_bubble(TransBubble bubble);
 
 double get_time(void);
-bool screenshot(Window *window, const char *file_name);
+void freeze_time(bool frozen);
+bool write_png(const char *file_name, const uint8_t *pixels, int w, int h);
+bool write_image(const char *file_name, const uint8_t *pixels, int w, int h);
+typedef struct {
+    const uint8_t *pixels;
+    int width, height;
+} ReadbackResult;
+typedef enum {
+    READBACK_LINEAR = 0,
+    READBACK_BOX,
+    READBACK_LANCZOS,
+} ReadbackFilter;
+int request_frame_readback(Window *window, int width, int height, ReadbackFilter filter);
+void finish_readbacks(void);
+bool readback_get(int handle, ReadbackResult *result);
+void readback_release(int handle);
+uint8_t *readback_detach(int handle);
+
+typedef struct {
+    int width, height;
+    int tiles_x, tiles_y;
+    int tile_size;
+    int tiles_done;
+    bool failed;
+} PosterStats;
+typedef struct Poster Poster;
+Poster *poster_open(const char *path, int width, int height, int scene_width, int scene_height, int tile_size);
+bool poster_begin_tile(Poster *poster);
+void poster_end_tile(Poster *poster);
+PosterStats poster_close(Poster *poster);
+
+typedef enum {
+    BACKPRESSURE_BLOCK = 0,
+    BACKPRESSURE_DROP,
+    BACKPRESSURE_GROW,
+} Backpressure;
+typedef struct {
+    int id;
+    bool ok;
+    float wait_ms;
+    float run_ms;
+} WorkResult;
+typedef struct {
+    int threads;
+    int queued;
+    int running;
+    int peak_queued;
+    int completed;
+    int dropped;
+    float mean_wait_ms;
+    float max_wait_ms;
+    float mean_run_ms;
+    float max_run_ms;
+} WorkerPoolStats;
+bool png_writer_init(int threads, int queue_size, Backpressure backpressure);
+void png_writer_shutdown(void);
+int png_write_async(const char *file_name, uint8_t *pixels, int w, int h);
+int png_convert_async(const char *source, const char *file_name);
+int png_writer_poll(WorkResult *results, int max);
+WorkerPoolStats png_writer_stats(void);
+
+typedef struct {
+    int serial;
+    uint8_t *data;
+    size_t size;
+} StreamFrame;
+typedef struct {
+    int encoded;
+    int dropped;
+    float mean_encode_ms;
+    uint64_t bytes;
+} StreamStats;
+bool frame_stream_encode(uint8_t *pixels, int w, int h);
+bool frame_stream_take(StreamFrame *frame);
+StreamStats frame_stream_stats(void);
+void hold_intermediary_framebuffer(bool hold);
 void flush_renderers(void);
 void start_drawing(Window *window);
-void bg_draw(int texture, void *data, int width, int height);
+typedef enum {
+    CANVAS_RGBA8 = 0,
+    CANVAS_R8,
+    CANVAS_RG8,
+    CANVAS_INDEXED,
+} CanvasFormat;
+int bg_format_bytes(CanvasFormat format);
+void bg_draw(int texture, void *data, int width, int height, CanvasFormat format, int palette,
+             int x, int y, int w, int h);
+
+typedef enum {
+    GPU_TEXTURE = 0,
+    GPU_BUFFER,
+    GPU_PROGRAM,
+    GPU_VERTEX_ARRAY,
+    GPU_FRAMEBUFFER,
+    GPU_RESOURCE_TYPES,
+} GpuResourceType;
+typedef struct {
+    uint32_t id;
+} GpuHandle;
+typedef struct {
+    GpuResourceType type;
+    unsigned int name;
+    uint64_t bytes;
+    int refs;
+    bool cached;
+    uint64_t last_used;
+    char owner[48];
+    char label[32];
+} GpuResourceInfo;
+typedef struct {
+    int count;
+    uint64_t bytes;
+    uint64_t type_bytes[5];
+    uint64_t budget;
+    int evicted;
+    int released;
+    bool over_budget;
+} GpuResourceTotals;
+GpuHandle gpu_register(GpuResourceType type, unsigned int name, uint64_t bytes,
+                       const char *owner, const char *label, bool cached);
+void gpu_retain(GpuHandle handle);
+void gpu_release(GpuHandle handle);
+bool gpu_alive(GpuHandle handle);
+bool gpu_touch(GpuHandle handle);
+void gpu_set_owner(const char *owner);
+int gpu_release_owner(const char *owner);
+void gpu_set_budget(uint64_t bytes);
+int gpu_resources_list(GpuResourceInfo *out, int max);
+GpuResourceTotals gpu_resources_totals(void);
+
+typedef struct {
+    int draws;
+    int waits;
+    uint64_t bytes;
+} StreamCanvasStats;
+typedef struct StreamCanvas StreamCanvas;
+StreamCanvas *stream_canvas_new(int width, int height, int buffers);
+void stream_canvas_free(StreamCanvas *canvas);
+Pixel *stream_canvas_data(StreamCanvas *canvas);
+void stream_canvas_draw(StreamCanvas *canvas);
+StreamCanvasStats stream_canvas_stats(StreamCanvas *canvas);
+
+typedef struct {
+    int renders;
+    int draws;
+    int recreated;
+} LayerStats;
+typedef struct Layer Layer;
+Layer *layer_new(int width, int height, int scene_width, int scene_height);
+void layer_free(Layer *layer);
+bool layer_valid(Layer *layer);
+void layer_invalidate(Layer *layer);
+bool layer_begin(Layer *layer, Color clear);
+void layer_end(Layer *layer);
+void layer_draw(Layer *layer);
+LayerStats layer_stats(Layer *layer);
+
+typedef struct {
+    int tiles;
+    int resident;
+    int capacity;
+    int visible;
+    int drawn;
+    int evictions;
+    uint64_t uploads;
+    uint64_t bytes;
+} TiledCanvasStats;
+typedef struct TiledCanvas TiledCanvas;
+TiledCanvas *tiled_canvas_new(int width, int height, int tile_size, int resident);
+void tiled_canvas_free(TiledCanvas *canvas);
+int tiled_canvas_tile_size(TiledCanvas *canvas);
+Pixel *tiled_canvas_tile(TiledCanvas *canvas, int tx, int ty);
+void tiled_canvas_set(TiledCanvas *canvas, int x, int y, Pixel color);
+Pixel tiled_canvas_get(TiledCanvas *canvas, int x, int y);
+void tiled_canvas_fill(TiledCanvas *canvas, int x, int y, int w, int h, Pixel color);
+void tiled_canvas_draw(TiledCanvas *canvas, float x, float y, float scale, int scene_width, int scene_height);
+TiledCanvasStats tiled_canvas_stats(TiledCanvas *canvas);
+
+typedef struct {
+    int width, height;
+    Pixel *pixels;
+    bool cached;
+    float load_ms;
+    void *mapping;
+    size_t mapping_size;
+} Image;
+typedef enum {
+    IMAGE_LOAD_PENDING = 0,
+    IMAGE_LOAD_READY,
+    IMAGE_LOAD_FAILED,
+} ImageLoadStatus;
+bool image_loader_init(const char *cache_dir, int threads);
+Image *image_load(const char *path);
+void image_free(Image *image);
+int image_load_async(const char *path);
+ImageLoadStatus image_load_status(int job);
+Image *image_take(int job);
+
+typedef struct {
+    float h, s, l, a;
+} Hsla;
+typedef enum {
+    CANVAS_COPY = 0,
+    CANVAS_OVER,
+} CanvasBlend;
+void canvas_fill_rect(Pixel *dst, int width, int height, int x, int y, int w, int h, Pixel color);
+void canvas_linear_gradient(Pixel *dst, int width, int height, Vector2 from, Vector2 to,
+                            const Pixel *ramp, int ramp_size);
+void canvas_radial_gradient(Pixel *dst, int width, int height, Vector2 center, float radius,
+                            const Pixel *ramp, int ramp_size);
+void canvas_angular_gradient(Pixel *dst, int width, int height, Vector2 center, float start,
+                             const Pixel *ramp, int ramp_size);
+void canvas_hsl_to_rgb(Pixel *dst, const Hsla *src, int count);
+void canvas_blit(Pixel *dst, int width, int height, const Pixel *src, int src_width, int src_height,
+                 int x, int y, CanvasBlend blend);
 
 bool should_quit(void);
 Window *create_window(const char *window_name, int width, int height);
@@ -103,21 +314,65 @@ void destroy_window(Window *window);
 void set_window_title(Window *window, const char *title);
 void set_window_size(Window *window, int width, int height);
 void SDL_GL_SwapWindow(Window *window);
+void SDL_Delay(uint32_t ms);
 
 Event poll_event(Window *window);
 void update_screen(Window *window);
 Vector2 get_mouse_position(Window *window);
+Vector2 latch_mouse_position(Window *window);
+
+typedef struct {
+    int samples;
+    float last_ms;
+    float mean_ms;
+    float max_ms;
+} LatencyStats;
+LatencyStats get_input_latency(void);
 
+typedef struct {
+    int hits;
+    int misses;
+    int rejected;
+} ShaderCacheStats;
+ShaderCacheStats shader_cache_stats(void);
+typedef struct PendingProgram PendingProgram;
+bool shader_parallel_compile(void);
+PendingProgram *shader_submit_source(const char *id, const char *vertex_source, const char *fragment_source);
+bool shader_poll_program(PendingProgram *pending, Shader *shader);
+void renderers_wait_for_programs(bool wait);
+void startup_mark(const char *what);
 void shader_program_from_source(Shader *shader, const char *id, const char *vertex_source, const char *fragment_source);
 void run_shader_program(Shader *shader);
 void use_shader_program(Shader *shader);
-int glGetUniformLocation(unsigned int program, const char *name);
-void glUniform4f(int uni, float r, float g, float b, float a);
-void glUniform2f(int uni, float x, float y);
-void glUniform1f(int uni, float f);
-void glUniform4fv(int uni, int count, Color *values);
-void glUniform2fv(int uni, int count, Vector2 *values);
-int bg_create_texture(void *data, int width, int height);
+int shader_uniform_location(unsigned int program, const char *name);
+void shader_uniform4f(int uni, float r, float g, float b, float a);
+void shader_uniform2f(int uni, float x, float y);
+void shader_uniform1f(int uni, float f);
+void shader_uniform4fv(int uni, int count, Color *values);
+void shader_uniform2fv(int uni, int count, Vector2 *values);
+int bg_create_texture(void *data, int width, int height, CanvasFormat format);
+int bg_create_palette(const Pixel *colors);
+void bg_set_palette(int palette, const Pixel *colors);
+
+typedef enum {
+    UPLOAD_PENDING = 0,
+    UPLOAD_READY,
+    UPLOAD_FAILED,
+} UploadStatus;
+bool upload_context_available(void);
+int upload_texture_async(const void *data, int width, int height, CanvasFormat format);
+int upload_program_async(const char *id, const char *vertex_source, const char *fragment_source);
+UploadStatus upload_status(int job);
+unsigned int upload_take_texture(int job);
+bool upload_take_program(int job, Shader *shader);
+
+typedef struct {
+    char id[32];
+    float gpu_ms;
+} PassTiming;
+int render_graph_begin_pass(const char *id, Shader *shader, const char **inputs, int num_inputs, const char *output, float scale);
+void render_graph_end_pass(void);
+int render_graph_timings(PassTiming *timings, int max);
 
 void on_update(double dt);
 
@@ -191,5 +446,108 @@ GifskiError gifski_add_frame_rgba(gifski *handle,
 GifskiError gifski_finish(gifski *g);
 GifskiError gifski_set_file_output(gifski *handle, const char *destination_path);
 
+typedef int (*GifskiAddFrameFn)(void *gifski, uint32_t frame_number, uint32_t width, uint32_t height,
+                                const unsigned char *pixels, double timestamp);
+typedef int (*GifskiFinishFn)(void *gifski);
+typedef struct {
+    int pool_frames;
+    int decimate;
+    bool block_when_full;
+} GifRecorderSettings;
+typedef struct {
+    int offered;
+    int added;
+    int written;
+    int dropped;
+    int queued;
+    int errors;
+} GifRecorderStats;
+typedef struct GifRecorder GifRecorder;
+GifRecorder *gif_recorder_start(void *gifski, GifskiAddFrameFn add_frame, GifskiFinishFn finish, GifRecorderSettings settings);
+bool gif_recorder_want_frame(GifRecorder *recorder);
+bool gif_recorder_add_frame(GifRecorder *recorder, const uint8_t *pixels, int width, int height, double timestamp);
+void gif_recorder_flush(GifRecorder *recorder);
+int gif_recorder_stop(GifRecorder *recorder);
+GifRecorderStats gif_recorder_stats(GifRecorder *recorder);
+
+typedef enum {
+    VIDEO_Y4M = 0,
+    VIDEO_RGBA,
+} VideoFormat;
+typedef struct {
+    VideoFormat format;
+    int fps;
+    int pool_frames;
+    bool block_when_full;
+} VideoSinkSettings;
+typedef struct {
+    int captured;
+    int written;
+    int repeated;
+    int skipped;
+    int dropped;
+    int mismatched;
+    int queued;
+    uint64_t bytes;
+    float mean_write_ms;
+    float max_write_ms;
+    bool failed;
+} VideoSinkStats;
+typedef struct VideoSink VideoSink;
+VideoSink *video_sink_open(const char *path, VideoSinkSettings settings);
+bool video_sink_add_frame(VideoSink *sink, const uint8_t *pixels, int width, int height, double timestamp);
+VideoSinkStats video_sink_close(VideoSink *sink);
+VideoSinkStats video_sink_stats(VideoSink *sink);
+
+typedef struct {
+    int plays;
+    int compression;
+    int queue_size;
+    Backpressure backpressure;
+} ApngSettings;
+typedef struct {
+    int frames;
+    int unchanged;
+    int mismatched;
+    int dropped;
+    uint64_t full_bytes;
+    uint64_t delta_bytes;
+    uint64_t file_bytes;
+    float mean_encode_ms;
+    float max_encode_ms;
+} ApngStats;
+typedef struct ApngWriter ApngWriter;
+ApngWriter *apng_open(const char *path, ApngSettings settings);
+bool apng_add_frame(ApngWriter *writer, uint8_t *pixels, int width, int height, double timestamp);
+ApngStats apng_close(ApngWriter *writer);
+ApngStats apng_stats(ApngWriter *writer);
+
+typedef struct {
+    size_t max_bytes;
+    float max_seconds;
+    int keyframe_interval;
+} ReplaySettings;
+typedef struct {
+    int frames;
+    float seconds;
+    uint64_t bytes;
+    uint64_t raw_bytes;
+    int captured;
+    int dropped;
+    int evicted;
+    int saving;
+    float mean_encode_ms;
+    float max_encode_ms;
+} ReplayStats;
+typedef struct ReplayBuffer ReplayBuffer;
+ReplayBuffer *replay_new(ReplaySettings settings);
+void replay_free(ReplayBuffer *replay);
+bool replay_add_frame(ReplayBuffer *replay, uint8_t *pixels, int width, int height, double timestamp);
+int replay_save_apng(ReplayBuffer *replay, const char *path, ApngSettings settings);
+int replay_save_video(ReplayBuffer *replay, const char *path, VideoSinkSettings settings);
+int replay_save_gif(ReplayBuffer *replay, void *gifski, GifskiAddFrameFn add_frame, GifskiFinishFn finish);
+int replay_poll_saves(ReplayBuffer *replay, WorkResult *results, int max);
+ReplayStats replay_stats(ReplayBuffer *replay);
+
 uint8_t get_screen_pixels(Window *window, uint8_t *pixels);
 #endif
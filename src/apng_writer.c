@@ -0,0 +1,482 @@
+/*
+ * Stock libpng can't write APNG, so the chunks are written here directly
+ * and zlib does the compression. The layout is
+ *
+ *   signature, IHDR, acTL, (fcTL IDAT...) for the first frame,
+ *   (fcTL fdAT...) for every later frame, IEND
+ *
+ * A frame's delay is only known once the next changed frame comes in, so
+ * each frame is encoded right away but written one frame late. acTL holds
+ * the frame count and is patched when the file is closed.
+ *
+ * All of the ApngWriter state except `stats` is only touched by the single
+ * worker thread, or by the closing thread after it has exited.
+ */
+
+#include "apng_writer.h"
+#include <SDL.h>
+#include <zlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DEFAULT_DELAY_MS 33
+#define MAX_DELAY_MS 65535
+
+enum { DISPOSE_NONE = 0 };
+enum { BLEND_SOURCE = 0, BLEND_OVER = 1 };
+
+typedef struct {
+    bool valid;
+    int x, y, width, height;
+    uint8_t blend;
+    double timestamp;
+    uint8_t *data;      // Compressed, filtered scanlines
+    size_t size;
+    size_t capacity;
+} EncodedFrame;
+
+struct ApngWriter {
+    FILE *file;
+    ApngSettings settings;
+    WorkerPool *pool;
+
+    int width, height;  // From the first frame
+    uint8_t *previous;  // Last full frame, what the animation shows now
+    uint32_t sequence;
+    long actl_offset;
+    EncodedFrame pending;   // Encoded, written once the next frame comes in
+    EncodedFrame encoded;   // Buffers to encode the next frame into
+    double last_delay_ms;
+    double last_timestamp;  // Of any frame, changed or not
+
+    // Scratch for building rectangles
+    uint8_t *rect;
+    uint8_t *filtered;
+    size_t rect_capacity, filtered_capacity;
+
+    SDL_mutex *lock;
+    ApngStats stats;
+    double total_encode_ms;
+    int jobs;
+};
+
+typedef struct {
+    ApngWriter *writer;
+    uint8_t *pixels;
+    int width, height;
+    double timestamp;
+} ApngJob;
+
+//
+// Chunks
+//
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v;
+}
+
+// `prefix` is written at the start of the data (fdAT's sequence number)
+static void write_chunk(ApngWriter *w, const char type[4], const uint8_t *prefix, size_t prefix_size,
+                        const uint8_t *data, size_t size) {
+    uint8_t header[8];
+    put_u32(header, (uint32_t)(prefix_size + size));
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(0, (const Bytef *)type, 4);
+    if (prefix_size) crc = crc32(crc, prefix, (uInt)prefix_size);
+    if (size) crc = crc32(crc, data, (uInt)size);
+    uint8_t footer[4];
+    put_u32(footer, (uint32_t)crc);
+
+    fwrite(header, 1, 8, w->file);
+    if (prefix_size) fwrite(prefix, 1, prefix_size, w->file);
+    if (size) fwrite(data, 1, size, w->file);
+    fwrite(footer, 1, 4, w->file);
+
+    SDL_LockMutex(w->lock);
+    w->stats.file_bytes += 12 + prefix_size + size;
+    SDL_UnlockMutex(w->lock);
+}
+
+static void write_actl(ApngWriter *w, uint32_t frames) {
+    uint8_t actl[8];
+    put_u32(actl, frames);
+    put_u32(actl + 4, (uint32_t)w->settings.plays);
+    write_chunk(w, "acTL", NULL, 0, actl, sizeof(actl));
+}
+
+static void write_header(ApngWriter *w) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    fwrite(signature, 1, sizeof(signature), w->file);
+
+    uint8_t ihdr[13];
+    put_u32(ihdr, (uint32_t)w->width);
+    put_u32(ihdr + 4, (uint32_t)w->height);
+    ihdr[8] = 8;  // Bit depth
+    ihdr[9] = 6;  // RGBA
+    ihdr[10] = 0; // Deflate
+    ihdr[11] = 0; // Adaptive filtering
+    ihdr[12] = 0; // Not interlaced
+    write_chunk(w, "IHDR", NULL, 0, ihdr, sizeof(ihdr));
+
+    w->actl_offset = ftell(w->file);
+    write_actl(w, 0);
+}
+
+static void write_frame(ApngWriter *w, EncodedFrame *frame, double delay_ms) {
+    const uint16_t delay = (uint16_t)MIN(MAX(delay_ms + 0.5, 1), MAX_DELAY_MS);
+    uint8_t fctl[26];
+    put_u32(fctl, w->sequence++);
+    put_u32(fctl + 4, (uint32_t)frame->width);
+    put_u32(fctl + 8, (uint32_t)frame->height);
+    put_u32(fctl + 12, (uint32_t)frame->x);
+    put_u32(fctl + 16, (uint32_t)frame->y);
+    put_u16(fctl + 20, delay);
+    put_u16(fctl + 22, 1000);
+    fctl[24] = DISPOSE_NONE;
+    fctl[25] = frame->blend;
+    write_chunk(w, "fcTL", NULL, 0, fctl, sizeof(fctl));
+
+    // The first frame is also the default image
+    const bool first = w->sequence == 1;
+    if (first) {
+        write_chunk(w, "IDAT", NULL, 0, frame->data, frame->size);
+    } else {
+        uint8_t sequence[4];
+        put_u32(sequence, w->sequence++);
+        write_chunk(w, "fdAT", sequence, 4, frame->data, frame->size);
+    }
+
+    SDL_LockMutex(w->lock);
+    w->stats.frames++;
+    SDL_UnlockMutex(w->lock);
+}
+
+//
+// Diffing
+//
+
+static bool rows_equal(const uint8_t *a, const uint8_t *b, size_t bytes) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= bytes; i += 16) {
+        const __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+        const __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) return false;
+    }
+#endif
+    return memcmp(&a[i], &b[i], bytes - i) == 0;
+}
+
+// First differing pixel of a row known to differ
+static int first_difference(const uint32_t *a, const uint32_t *b, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= width; x += 4) {
+        const __m128i va = _mm_loadu_si128((const __m128i *)&a[x]);
+        const __m128i vb = _mm_loadu_si128((const __m128i *)&b[x]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xFFFF) break;
+    }
+#endif
+    while (x < width && a[x] == b[x]) x++;
+    return x;
+}
+
+static int last_difference(const uint32_t *a, const uint32_t *b, int width) {
+    int x = width - 1;
+#ifdef __SSE2__
+    for (; x - 3 >= 0; x -= 4) {
+        const __m128i va = _mm_loadu_si128((const __m128i *)&a[x - 3]);
+        const __m128i vb = _mm_loadu_si128((const __m128i *)&b[x - 3]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xFFFF) break;
+    }
+#endif
+    while (x >= 0 && a[x] == b[x]) x--;
+    return x;
+}
+
+// Bounding rectangle of the changes, false if nothing changed
+static bool dirty_rect(const uint8_t *prev, const uint8_t *cur, int width, int height,
+                       int *rx, int *ry, int *rw, int *rh) {
+    const size_t stride = (size_t)width * 4;
+    int top = 0, bottom = height - 1;
+    while (top < height && rows_equal(&prev[top * stride], &cur[top * stride], stride)) top++;
+    if (top == height) return false;
+    while (rows_equal(&prev[bottom * stride], &cur[bottom * stride], stride)) bottom--;
+
+    int left = width, right = -1;
+    for (int y = top; y <= bottom; y++) {
+        const uint32_t *a = (const uint32_t *)&prev[y * stride];
+        const uint32_t *b = (const uint32_t *)&cur[y * stride];
+        if (left == 0 && right == width - 1) break;
+        if (rows_equal((const uint8_t *)a, (const uint8_t *)b, stride)) continue;
+        left = MIN(left, first_difference(a, b, width));
+        right = MAX(right, last_difference(a, b, width));
+    }
+    *rx = left;
+    *ry = top;
+    *rw = right - left + 1;
+    *rh = bottom - top + 1;
+    return true;
+}
+
+//
+// Encoding
+//
+
+static void reserve(uint8_t **buffer, size_t *capacity, size_t size) {
+    if (*capacity >= size) return;
+    free(*buffer);
+    *buffer = malloc(size);
+    *capacity = size;
+}
+
+static int paeth(int a, int b, int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static uint8_t filter_byte(int type, const uint8_t *row, const uint8_t *above, size_t i) {
+    const int a = i >= 4 ? row[i - 4] : 0;
+    const int b = above ? above[i] : 0;
+    const int c = i >= 4 && above ? above[i - 4] : 0;
+    switch (type) {
+        case 1: return (uint8_t)(row[i] - a);
+        case 2: return (uint8_t)(row[i] - b);
+        case 3: return (uint8_t)(row[i] - (a + b) / 2);
+        case 4: return (uint8_t)(row[i] - paeth(a, b, c));
+        default: return row[i];
+    }
+}
+
+// Pick the filter with the smallest sum of absolute values, the usual heuristic
+static void filter_row(const uint8_t *row, const uint8_t *above, size_t bytes, uint8_t *out) {
+    int best_type = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for (int type = 0; type <= 4; type++) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < bytes && sum < best_sum; i++) {
+            const uint8_t f = filter_byte(type, row, above, i);
+            sum += f < 128 ? f : 256 - f;
+        }
+        if (sum < best_sum) {
+            best_sum = sum;
+            best_type = type;
+        }
+    }
+    out[0] = (uint8_t)best_type;
+    for (size_t i = 0; i < bytes; i++) {
+        out[1 + i] = filter_byte(best_type, row, above, i);
+    }
+}
+
+static void encode(ApngWriter *w, const uint8_t *pixels, int x, int y, int width, int height, uint8_t blend, EncodedFrame *frame) {
+    const size_t row_bytes = (size_t)width * 4;
+    const size_t filtered_size = (row_bytes + 1) * height;
+    reserve(&w->filtered, &w->filtered_capacity, filtered_size);
+    for (int row = 0; row < height; row++) {
+        const uint8_t *above = row > 0 ? &pixels[(row - 1) * row_bytes] : NULL;
+        filter_row(&pixels[row * row_bytes], above, row_bytes, &w->filtered[row * (row_bytes + 1)]);
+    }
+
+    uLongf size = compressBound(filtered_size);
+    reserve(&frame->data, &frame->capacity, size);
+    if (compress2(frame->data, &size, w->filtered, filtered_size, w->settings.compression) != Z_OK) {
+        fprintf(stderr, "WARNING: unable to compress APNG frame\n");
+        frame->valid = false;
+        return;
+    }
+    frame->size = size;
+    frame->x = x;
+    frame->y = y;
+    frame->width = width;
+    frame->height = height;
+    frame->blend = blend;
+    frame->valid = true;
+}
+
+// Worker thread
+static bool add_frame(ApngWriter *w, uint8_t *pixels, double timestamp) {
+    int x = 0, y = 0, width = w->width, height = w->height;
+    uint8_t blend = BLEND_SOURCE;
+    const uint8_t *source = pixels;
+    w->last_timestamp = timestamp;
+
+    if (w->previous) {
+        if (!dirty_rect(w->previous, pixels, w->width, w->height, &x, &y, &width, &height)) {
+            SDL_LockMutex(w->lock);
+            w->stats.unchanged++;
+            SDL_UnlockMutex(w->lock);
+            free(pixels);
+            return true;
+        }
+
+        // Copy out the rectangle. If it's opaque, unchanged pixels can be
+        // left transparent and blended over the previous frame.
+        const size_t row_bytes = (size_t)width * 4;
+        reserve(&w->rect, &w->rect_capacity, row_bytes * height);
+        bool opaque = true;
+        for (int row = 0; row < height && opaque; row++) {
+            const uint8_t *cur = &pixels[((size_t)(y + row) * w->width + x) * 4];
+            for (int i = 3; i < (int)row_bytes; i += 4) {
+                if (cur[i] != 0xFF) { opaque = false; break; }
+            }
+        }
+        blend = opaque ? BLEND_OVER : BLEND_SOURCE;
+        for (int row = 0; row < height; row++) {
+            const size_t offset = ((size_t)(y + row) * w->width + x) * 4;
+            const uint32_t *cur = (const uint32_t *)&pixels[offset];
+            const uint32_t *prev = (const uint32_t *)&w->previous[offset];
+            uint32_t *dst = (uint32_t *)&w->rect[row * row_bytes];
+            for (int i = 0; i < width; i++) {
+                dst[i] = opaque && cur[i] == prev[i] ? 0 : cur[i];
+            }
+        }
+        source = w->rect;
+    }
+
+    encode(w, source, x, y, width, height, blend, &w->encoded);
+    if (!w->encoded.valid) {
+        // The animation still shows the previous frame, keep diffing against it
+        free(pixels);
+        return false;
+    }
+    w->encoded.timestamp = timestamp;
+
+    SDL_LockMutex(w->lock);
+    w->stats.full_bytes += (uint64_t)w->width * w->height * 4;
+    w->stats.delta_bytes += (uint64_t)width * height * 4;
+    SDL_UnlockMutex(w->lock);
+
+    // Now the pending frame's delay is known
+    if (w->pending.valid) {
+        w->last_delay_ms = (timestamp - w->pending.timestamp) * 1000.0;
+        write_frame(w, &w->pending, w->last_delay_ms);
+    }
+    const EncodedFrame swap = w->pending;
+    w->pending = w->encoded;
+    w->encoded = swap;
+    w->encoded.valid = false;
+
+    free(w->previous);
+    w->previous = pixels;
+    return true;
+}
+
+static bool run_job(void *arg) {
+    ApngJob *job = arg;
+    ApngWriter *w = job->writer;
+    const Uint64 started = SDL_GetPerformanceCounter();
+    bool ok;
+    if (w->width == 0) {
+        w->width = job->width;
+        w->height = job->height;
+        write_header(w);
+    }
+    if (job->width != w->width || job->height != w->height) {
+        SDL_LockMutex(w->lock);
+        w->stats.mismatched++;
+        SDL_UnlockMutex(w->lock);
+        free(job->pixels);
+        ok = false;
+    } else {
+        ok = add_frame(w, job->pixels, job->timestamp);
+    }
+    free(job);
+
+    const float ms = (float)((double)(SDL_GetPerformanceCounter() - started) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+    SDL_LockMutex(w->lock);
+    w->total_encode_ms += ms;
+    w->jobs++;
+    w->stats.mean_encode_ms = w->total_encode_ms / w->jobs;
+    w->stats.max_encode_ms = MAX(w->stats.max_encode_ms, ms);
+    SDL_UnlockMutex(w->lock);
+    return ok;
+}
+
+//
+// Lua thread
+//
+
+ApngWriter *apng_open(const char *path, ApngSettings settings) {
+    if (settings.compression < 0 || settings.compression > 9) settings.compression = Z_DEFAULT_COMPRESSION;
+    if (settings.queue_size <= 0) settings.queue_size = 4;
+
+    ApngWriter *w = calloc(1, sizeof(ApngWriter));
+    w->settings = settings;
+    w->last_delay_ms = DEFAULT_DELAY_MS;
+    w->file = fopen(path, "wb");
+    if (w->file == NULL) {
+        fprintf(stderr, "ERROR: unable to open %s: %s\n", path, ERROR());
+        free(w);
+        return NULL;
+    }
+    w->lock = SDL_CreateMutex();
+    // One worker, frames have to be encoded in order
+    w->pool = worker_pool_new("bubbl apng", 1, settings.queue_size, settings.backpressure);
+    if (w->pool == NULL) {
+        fclose(w->file);
+        SDL_DestroyMutex(w->lock);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+bool apng_add_frame(ApngWriter *w, uint8_t *pixels, int width, int height, double timestamp) {
+    ApngJob *job = malloc(sizeof(ApngJob));
+    *job = (ApngJob){ w, pixels, width, height, timestamp };
+    if (worker_pool_submit(w->pool, run_job, job) < 0) {
+        SDL_LockMutex(w->lock);
+        w->stats.dropped++;
+        SDL_UnlockMutex(w->lock);
+        free(pixels);
+        free(job);
+        return false;
+    }
+    return true;
+}
+
+ApngStats apng_close(ApngWriter *w) {
+    // Drains the queue
+    worker_pool_free(w->pool);
+
+    if (w->pending.valid) {
+        // Held through any unchanged frames at the end, plus one frame
+        const double held_ms = (w->last_timestamp - w->pending.timestamp) * 1000.0;
+        write_frame(w, &w->pending, held_ms + w->last_delay_ms);
+    }
+    if (w->width > 0) {
+        write_chunk(w, "IEND", NULL, 0, NULL, 0);
+        fseek(w->file, w->actl_offset, SEEK_SET);
+        write_actl(w, (uint32_t)w->stats.frames);
+    }
+    fclose(w->file);
+
+    ApngStats stats = w->stats;
+    free(w->previous);
+    free(w->rect);
+    free(w->filtered);
+    free(w->pending.data);
+    free(w->encoded.data);
+    SDL_DestroyMutex(w->lock);
+    free(w);
+    return stats;
+}
+
+ApngStats apng_stats(ApngWriter *w) {
+    SDL_LockMutex(w->lock);
+    ApngStats stats = w->stats;
+    SDL_UnlockMutex(w->lock);
+    return stats;
+}
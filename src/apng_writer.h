@@ -0,0 +1,44 @@
+/**
+ * Animated PNG export with delta frames.
+ *
+ * Each frame is diffed against the previous one and only the bounding
+ * rectangle of what changed is stored. Unchanged pixels inside that
+ * rectangle are left transparent and blended over the previous frame, which
+ * compresses to almost nothing. Frames that don't change at all just make
+ * the previous frame last longer. Encoding runs on a worker thread.
+ */
+
+#ifndef APNG_WRITER_H
+#define APNG_WRITER_H
+#include "common.h"
+#include "worker_pool.h"
+
+typedef struct {
+    int plays;              // 0 loops forever
+    int compression;        // zlib level, 0-9
+    int queue_size;
+    Backpressure backpressure;
+} ApngSettings;
+
+typedef struct {
+    int frames;             // Frames in the file
+    int unchanged;          // Merged into the previous frame
+    int mismatched;         // Different size from the first frame
+    int dropped;
+    uint64_t full_bytes;    // Pixels before diffing
+    uint64_t delta_bytes;   // Pixels inside the changed rectangles
+    uint64_t file_bytes;
+    float mean_encode_ms;
+    float max_encode_ms;
+} ApngStats;
+
+typedef struct ApngWriter ApngWriter;
+
+ApngWriter *apng_open(const char *path, ApngSettings settings);
+// Takes ownership of `pixels` (malloc'd RGBA, top row first)
+bool apng_add_frame(ApngWriter *writer, uint8_t *pixels, int width, int height, double timestamp);
+// Writes the remaining frames, closes the file and frees the writer
+ApngStats apng_close(ApngWriter *writer);
+ApngStats apng_stats(ApngWriter *writer);
+
+#endif // APNG_WRITER_H
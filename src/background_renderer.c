@@ -5,47 +5,230 @@
 
 #include "background_renderer.h"
 #include "shaderutil.h"
+#include "render_thread.h"
+#include "render_view.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 static Shader shader;
+static PendingProgram *pending;
+static GLint uv_rect, indexed;
 
+static const struct {
+    GLenum internal_format, format;
+    int bytes;
+} formats[] = {
+    [CANVAS_RGBA8] = { GL_RGBA8, GL_RGBA, 4 },
+    [CANVAS_R8] = { GL_R8, GL_RED, 1 },
+    [CANVAS_RG8] = { GL_RG8, GL_RG, 2 },
+    [CANVAS_INDEXED] = { GL_R8, GL_RED, 1 },
+};
+
+// Only submitted, it compiles alongside whatever else starts up
 void bg_init(void) {
-   shader_program_from_files(&shader, "shaders/blit.vert", "shaders/blit.frag"); 
+   pending = shader_submit_files("shaders/canvas.vert", "shaders/blit.frag");
+   shader_init_quad(&shader);
+}
+
+// A canvas draw carries its upload so it can't be skipped, the first one
+// waits for the program
+static void finish_program(void) {
+   shader.program = shader_finish_program(pending);
+   pending = NULL;
+   if (!shader.program) exit(1);
+   uv_rect = glGetUniformLocation(shader.program, "uv_rect");
+   indexed = glGetUniformLocation(shader.program, "indexed");
+   glUseProgram(shader.program);
+   glUniform1i(glGetUniformLocation(shader.program, "pixels"), 0);
+   glUniform1i(glGetUniformLocation(shader.program, "palette"), 1);
+   glUseProgram(0);
 }
 
-int bg_create_texture(void *data, int width, int height)
+int bg_format_bytes(CanvasFormat format)
+{
+    return formats[format].bytes;
+}
+
+typedef struct {
+    void *data;
+    int width, height;
+    CanvasFormat format;
+    GLuint texture;
+} TextureCreation;
+
+GLuint bg_new_canvas_texture(const void *data, int width, int height, CanvasFormat format)
 {
     GLuint texture;
     glActiveTexture(GL_TEXTURE0);
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
     
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    // Indices can't be blended, the palette is looked up per texel
+    const GLint filter = format == CANVAS_INDEXED ? GL_NEAREST : GL_LINEAR;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (format == CANVAS_R8) {
+        const GLint swizzle[] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    } else if (format == CANVAS_RG8) {
+        const GLint swizzle[] = { GL_RED, GL_RED, GL_RED, GL_GREEN };
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    }
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    // Rows of one or two byte pixels aren't 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, formats[format].internal_format, width, height, 0,
+                 formats[format].format, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
     glBindTexture(GL_TEXTURE_2D, 0);
-    
     return texture;
 }
 
-void bg_draw(GLuint texture, void *data, int width, int height) {
+GLuint bg_new_texture(const void *data, int width, int height)
+{
+    return bg_new_canvas_texture(data, width, height, CANVAS_RGBA8);
+}
+
+static void create_texture(void *arg)
+{
+    TextureCreation *tc = arg;
+    tc->texture = bg_new_canvas_texture(tc->data, tc->width, tc->height, tc->format);
+}
+
+int bg_create_texture(void *data, int width, int height, CanvasFormat format)
+{
+    TextureCreation tc = { data, width, height, format, 0 };
+    render_thread_invoke(create_texture, &tc);
+    return tc.texture;
+}
+
+static void create_palette(void *arg)
+{
+    TextureCreation *tc = arg;
+    tc->texture = bg_new_canvas_texture(tc->data, CANVAS_PALETTE_SIZE, 1, CANVAS_RGBA8);
+    glBindTexture(GL_TEXTURE_2D, tc->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+int bg_create_palette(const Pixel *colors)
+{
+    TextureCreation tc = { (void *)colors, 0, 0, CANVAS_RGBA8, 0 };
+    render_thread_invoke(create_palette, &tc);
+    return tc.texture;
+}
+
+typedef struct {
+    GLuint palette;
+    Pixel colors[CANVAS_PALETTE_SIZE];
+} PaletteUpload;
+
+static void upload_palette(void *payload) {
+    const PaletteUpload *upload = payload;
+    glBindTexture(GL_TEXTURE_2D, upload->palette);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CANVAS_PALETTE_SIZE, 1, GL_RGBA, GL_UNSIGNED_BYTE, upload->colors);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Replaces all CANVAS_PALETTE_SIZE colors, the indices are left alone
+void bg_set_palette(GLuint palette, const Pixel *colors) {
+    if (render_thread_active()) {
+        PaletteUpload *upload = render_thread_record(upload_palette, sizeof(PaletteUpload));
+        upload->palette = palette;
+        memcpy(upload->colors, colors, sizeof(upload->colors));
+        return;
+    }
+    PaletteUpload upload = { palette, { { 0 } } };
+    memcpy(upload.colors, colors, sizeof(upload.colors));
+    upload_palette(&upload);
+}
+
+void bg_draw_canvas(GLuint texture, CanvasFormat format, GLuint palette,
+                    const void *pixels, int row_length, int x, int y, int w, int h) {
+    if (pending) finish_program();
     glUseProgram(shader.program);
     glBindVertexArray(shader.vao);
     glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(indexed, format == CANVAS_INDEXED);
+    if (format == CANVAS_INDEXED) {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, palette);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // Canvases stretch over the whole scene, show the part that's in view
+    const RenderView view = render_view_get();
+    glUniform4f(uv_rect, view.x / view.scene_width, view.y / view.scene_height,
+                view.width / view.scene_width, view.height / view.scene_height);
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    if (w > 0 && h > 0) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, formats[format].format, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
 
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
+    if (format == CANVAS_INDEXED) {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
     glBindVertexArray(0);
     glUseProgram(0);
 }
 
+void bg_draw_texture(GLuint texture, const Pixel *pixels, int row_length, int x, int y, int w, int h) {
+    bg_draw_canvas(texture, CANVAS_RGBA8, 0, pixels, row_length, x, y, w, h);
+}
+
+// Recorded canvas draw, the changed pixels follow the header
+typedef struct {
+    GLuint texture, palette;
+    CanvasFormat format;
+    int x, y, w, h;
+} CanvasUpload;
+
+static void replay_draw(void *payload) {
+    CanvasUpload *upload = payload;
+    bg_draw_canvas(upload->texture, upload->format, upload->palette, upload + 1, upload->w,
+                   upload->x, upload->y, upload->w, upload->h);
+}
+
+// x, y, w, h is what changed in `data` since the last draw, an empty
+// rectangle skips the upload
+void bg_draw(GLuint texture, void *data, int width, int height, CanvasFormat format, GLuint palette,
+             int x, int y, int w, int h) {
+    // Only the part inside the canvas
+    w = MIN(x + w, width) - MAX(x, 0);
+    h = MIN(y + h, height) - MAX(y, 0);
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (w <= 0 || h <= 0) w = h = 0;
+
+    const int bytes = formats[format].bytes;
+    const uint8_t *pixels = (const uint8_t *)data + ((size_t)y * width + x) * bytes;
+    if (render_thread_active()) {
+        // The canvas can be modified as soon as we return, so take a copy
+        const size_t row_bytes = (size_t)w * bytes;
+        CanvasUpload *upload = render_thread_record(replay_draw, sizeof(CanvasUpload) + row_bytes * h);
+        *upload = (CanvasUpload){ texture, palette, format, x, y, w, h };
+        uint8_t *dst = (uint8_t *)(upload + 1);
+        for (int row = 0; row < h; row++) {
+            memcpy(dst + row * row_bytes, pixels + (size_t)row * width * bytes, row_bytes);
+        }
+        return;
+    }
+    bg_draw_canvas(texture, format, palette, pixels, width, x, y, w, h);
+}
+
 #if 0
 void bg_init(void) {
     glGenFramebuffers(1, &framebuffer);
@@ -2,6 +2,30 @@
 #define BG_H
 #include "common.h"
 
+#include "shaderutil.h"
+
+// R8 canvases show as grey and RG8 as grey with alpha. Indexed canvases
+// hold an index per pixel into a palette of CANVAS_PALETTE_SIZE colors,
+// looked up when drawn.
+typedef enum {
+    CANVAS_RGBA8 = 0,
+    CANVAS_R8,
+    CANVAS_RG8,
+    CANVAS_INDEXED,
+} CanvasFormat;
+
+#define CANVAS_PALETTE_SIZE 256
+
 void bg_init(void);
+int bg_format_bytes(CanvasFormat format);
+GLuint bg_new_texture(const void *data, int width, int height);
+GLuint bg_new_canvas_texture(const void *data, int width, int height, CanvasFormat format);
+// On the GL thread. Uploads the x, y, w, h rectangle (if not empty), then
+// draws the texture over the view. `pixels` is the rectangle's top left and
+// `row_length` the pixels between its rows.
+void bg_draw_texture(GLuint texture, const Pixel *pixels, int row_length, int x, int y, int w, int h);
+// The same for any format, `palette` is only used by indexed canvases
+void bg_draw_canvas(GLuint texture, CanvasFormat format, GLuint palette,
+                    const void *pixels, int row_length, int x, int y, int w, int h);
 
 #endif // BG_H
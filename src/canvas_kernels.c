@@ -0,0 +1,319 @@
+/*
+ * Each kernel has an SSE2 path for 4 pixels at a time and a scalar path
+ * for the rest of the row (or everything, without SSE2). Both do the same
+ * float operations in the same order, so they give the same pixels.
+ * Pixels are sampled at their centres.
+ */
+
+#include "canvas_kernels.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PI_F 3.14159265f
+#define TAU_F 6.28318531f
+
+static inline int ramp_clamped(float t, int ramp_size)
+{
+    const float i = t * (ramp_size - 1) + 0.5f;
+    if (!(i > 0)) return 0;
+    return MIN((int)i, ramp_size - 1);
+}
+
+static inline int ramp_wrapped(float t, int ramp_size)
+{
+    const int i = (int)(t * ramp_size + 0.5f);
+    return i >= ramp_size ? i - ramp_size : i;
+}
+
+// Within 1e-5 radians, in [-pi, pi]
+static inline float fast_atan2(float y, float x)
+{
+    const float ax = fabsf(x), ay = fabsf(y);
+    const float a = MIN(ax, ay) / MAX(MAX(ax, ay), 1e-30f);
+    const float s = a * a;
+    float r = ((((-0.0134804700f * s + 0.0574773140f) * s - 0.1212390710f) * s + 0.1956359250f) * s
+               - 0.3329946920f) * s * a + a;
+    if (ay > ax) r = PI_F / 2 - r;
+    if (x < 0) r = PI_F - r;
+    if (y < 0) r = -r;
+    return r;
+}
+
+static inline uint8_t to_byte(float v)
+{
+    v = v * 255;
+    if (!(v > 0)) return 0;
+    return v >= 255 ? 255 : (uint8_t)v;
+}
+
+static inline float hsl_channel(float n, float h, float l, float a)
+{
+    float k = n + h / 30;
+    k = k - 12 * floorf(k / 12);
+    const float f = MAX(-1.0f, MIN(MIN(k - 3, 9 - k), 1.0f));
+    return l - a * f;
+}
+
+static inline Pixel hsl_pixel(Hsla c)
+{
+    const float a = c.s * MIN(c.l, 1 - c.l);
+    return (Pixel){
+        to_byte(hsl_channel(0, c.h, c.l, a)),
+        to_byte(hsl_channel(8, c.h, c.l, a)),
+        to_byte(hsl_channel(4, c.h, c.l, a)),
+        to_byte(c.a),
+    };
+}
+
+// (v + 127) / 255 for v up to 255 * 255
+static inline uint32_t div255(uint32_t v)
+{
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
+
+static inline Pixel blend_over(Pixel s, Pixel d)
+{
+    const uint32_t sa = s.a, da = 255 - s.a;
+    return (Pixel){
+        div255(s.r * sa + d.r * da),
+        div255(s.g * sa + d.g * da),
+        div255(s.b * sa + d.b * da),
+        div255(255 * sa + d.a * da),
+    };
+}
+
+#ifdef __SSE2__
+static inline __m128 floor4(__m128 x)
+{
+    const __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1)));
+}
+
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 atan2_4(__m128 y, __m128 x)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 ax = _mm_andnot_ps(sign, x), ay = _mm_andnot_ps(sign, y);
+    const __m128 a = _mm_div_ps(_mm_min_ps(ax, ay), _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(1e-30f)));
+    const __m128 s = _mm_mul_ps(a, a);
+    __m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-0.0134804700f), s), _mm_set1_ps(0.0574773140f));
+    p = _mm_sub_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.1212390710f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.1956359250f));
+    p = _mm_sub_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.3329946920f));
+    __m128 r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, s), a), a);
+    r = select4(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(PI_F / 2), r), r);
+    r = select4(_mm_cmplt_ps(x, zero), _mm_sub_ps(_mm_set1_ps(PI_F), r), r);
+    return select4(_mm_cmplt_ps(y, zero), _mm_xor_ps(r, sign), r);
+}
+
+static inline __m128 hsl_channel4(float n, __m128 h, __m128 l, __m128 a)
+{
+    __m128 k = _mm_add_ps(_mm_set1_ps(n), _mm_div_ps(h, _mm_set1_ps(30)));
+    k = _mm_sub_ps(k, _mm_mul_ps(_mm_set1_ps(12), floor4(_mm_div_ps(k, _mm_set1_ps(12)))));
+    __m128 f = _mm_min_ps(_mm_sub_ps(k, _mm_set1_ps(3)), _mm_sub_ps(_mm_set1_ps(9), k));
+    f = _mm_max_ps(_mm_set1_ps(-1), _mm_min_ps(f, _mm_set1_ps(1)));
+    return _mm_sub_ps(l, _mm_mul_ps(a, f));
+}
+
+// Scaled, clamped and truncated like to_byte
+static inline __m128i to_bytes4(__m128 v)
+{
+    v = _mm_mul_ps(v, _mm_set1_ps(255));
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255));
+    return _mm_cvttps_epi32(v);
+}
+
+// Look up 4 ramp entries and store them
+static inline void store_ramp4(Pixel *dst, const Pixel *ramp, __m128i index)
+{
+    int32_t i[4];
+    _mm_storeu_si128((__m128i *)i, index);
+    dst[0] = ramp[i[0]];
+    dst[1] = ramp[i[1]];
+    dst[2] = ramp[i[2]];
+    dst[3] = ramp[i[3]];
+}
+
+static inline __m128i ramp_clamped4(__m128 t, int ramp_size)
+{
+    __m128 i = _mm_add_ps(_mm_mul_ps(t, _mm_set1_ps((float)(ramp_size - 1))), _mm_set1_ps(0.5f));
+    i = _mm_min_ps(_mm_max_ps(i, _mm_setzero_ps()), _mm_set1_ps((float)(ramp_size - 1)));
+    return _mm_cvttps_epi32(i);
+}
+
+static inline __m128i ramp_wrapped4(__m128 t, int ramp_size)
+{
+    const __m128i size = _mm_set1_epi32(ramp_size);
+    const __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t, _mm_set1_ps((float)ramp_size)), _mm_set1_ps(0.5f)));
+    // Subtract the size where i >= size
+    const __m128i over = _mm_cmpgt_epi32(size, i);
+    return _mm_sub_epi32(i, _mm_andnot_si128(over, size));
+}
+#endif
+
+void canvas_fill_rect(Pixel *dst, int width, int height, int x, int y, int w, int h, Pixel color)
+{
+    const int x0 = MAX(x, 0), y0 = MAX(y, 0);
+    const int x1 = MIN(x + w, width), y1 = MIN(y + h, height);
+    for (int row = y0; row < y1; row++) {
+        Pixel *p = &dst[(size_t)row * width];
+        int i = x0;
+#ifdef __SSE2__
+        uint32_t packed;
+        memcpy(&packed, &color, sizeof(packed));
+        const __m128i fill = _mm_set1_epi32((int)packed);
+        for (; i + 4 <= x1; i += 4) _mm_storeu_si128((__m128i *)&p[i], fill);
+#endif
+        for (; i < x1; i++) p[i] = color;
+    }
+}
+
+void canvas_linear_gradient(Pixel *dst, int width, int height, Vector2 from, Vector2 to,
+                            const Pixel *ramp, int ramp_size)
+{
+    // t = dot(p - from, to - from) / |to - from|^2
+    const float dx = to.x - from.x, dy = to.y - from.y;
+    const float len2 = MAX(dx * dx + dy * dy, 1e-12f);
+    const float tx = dx / len2, ty = dy / len2;
+    for (int y = 0; y < height; y++) {
+        Pixel *row = &dst[(size_t)y * width];
+        const float row_t = (y + 0.5f - from.y) * ty - from.x * tx;
+        int x = 0;
+#ifdef __SSE2__
+        const __m128 step = _mm_set1_ps(4);
+        __m128 px = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        for (; x + 4 <= width; x += 4, px = _mm_add_ps(px, step)) {
+            const __m128 t = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(tx)), _mm_set1_ps(row_t));
+            store_ramp4(&row[x], ramp, ramp_clamped4(t, ramp_size));
+        }
+#endif
+        for (; x < width; x++) {
+            row[x] = ramp[ramp_clamped((x + 0.5f) * tx + row_t, ramp_size)];
+        }
+    }
+}
+
+void canvas_radial_gradient(Pixel *dst, int width, int height, Vector2 center, float radius,
+                            const Pixel *ramp, int ramp_size)
+{
+    const float inv_radius = 1 / MAX(radius, 1e-6f);
+    for (int y = 0; y < height; y++) {
+        Pixel *row = &dst[(size_t)y * width];
+        const float dy = (y + 0.5f - center.y) * inv_radius;
+        const float dy2 = dy * dy;
+        int x = 0;
+#ifdef __SSE2__
+        const __m128 step = _mm_set1_ps(4);
+        __m128 px = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        for (; x + 4 <= width; x += 4, px = _mm_add_ps(px, step)) {
+            const __m128 dx = _mm_mul_ps(_mm_sub_ps(px, _mm_set1_ps(center.x)), _mm_set1_ps(inv_radius));
+            const __m128 t = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_set1_ps(dy2)));
+            store_ramp4(&row[x], ramp, ramp_clamped4(t, ramp_size));
+        }
+#endif
+        for (; x < width; x++) {
+            const float dx = (x + 0.5f - center.x) * inv_radius;
+            row[x] = ramp[ramp_clamped(sqrtf(dx * dx + dy2), ramp_size)];
+        }
+    }
+}
+
+void canvas_angular_gradient(Pixel *dst, int width, int height, Vector2 center, float start,
+                             const Pixel *ramp, int ramp_size)
+{
+    const float offset = start / TAU_F;
+    for (int y = 0; y < height; y++) {
+        Pixel *row = &dst[(size_t)y * width];
+        const float dy = y + 0.5f - center.y;
+        int x = 0;
+#ifdef __SSE2__
+        const __m128 step = _mm_set1_ps(4);
+        __m128 px = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        for (; x + 4 <= width; x += 4, px = _mm_add_ps(px, step)) {
+            const __m128 angle = atan2_4(_mm_set1_ps(dy), _mm_sub_ps(px, _mm_set1_ps(center.x)));
+            __m128 t = _mm_sub_ps(_mm_div_ps(angle, _mm_set1_ps(TAU_F)), _mm_set1_ps(offset));
+            t = _mm_sub_ps(t, floor4(t));
+            store_ramp4(&row[x], ramp, ramp_wrapped4(t, ramp_size));
+        }
+#endif
+        for (; x < width; x++) {
+            float t = fast_atan2(dy, x + 0.5f - center.x) / TAU_F - offset;
+            t = t - floorf(t);
+            row[x] = ramp[ramp_wrapped(t, ramp_size)];
+        }
+    }
+}
+
+void canvas_hsl_to_rgb(Pixel *dst, const Hsla *src, int count)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4) {
+        // Four pixels of h, s, l, a become h, s, l and a of four pixels
+        __m128 h = _mm_loadu_ps(&src[i].h), s = _mm_loadu_ps(&src[i + 1].h);
+        __m128 l = _mm_loadu_ps(&src[i + 2].h), a = _mm_loadu_ps(&src[i + 3].h);
+        _MM_TRANSPOSE4_PS(h, s, l, a);
+
+        const __m128 chroma = _mm_mul_ps(s, _mm_min_ps(l, _mm_sub_ps(_mm_set1_ps(1), l)));
+        const __m128i r = to_bytes4(hsl_channel4(0, h, l, chroma));
+        const __m128i g = to_bytes4(hsl_channel4(8, h, l, chroma));
+        const __m128i b = to_bytes4(hsl_channel4(4, h, l, chroma));
+        const __m128i alpha = to_bytes4(a);
+        // Each channel is in the low byte of its lane, shift them into place
+        const __m128i rgba = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                                          _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(alpha, 24)));
+        _mm_storeu_si128((__m128i *)&dst[i], rgba);
+    }
+#endif
+    for (; i < count; i++) dst[i] = hsl_pixel(src[i]);
+}
+
+void canvas_blit(Pixel *dst, int width, int height, const Pixel *src, int src_width, int src_height,
+                 int x, int y, CanvasBlend blend)
+{
+    const int x0 = MAX(x, 0), y0 = MAX(y, 0);
+    const int x1 = MIN(x + src_width, width), y1 = MIN(y + src_height, height);
+    if (x0 >= x1) return;
+    for (int row = y0; row < y1; row++) {
+        Pixel *d = &dst[(size_t)row * width + x0];
+        const Pixel *s = &src[(size_t)(row - y) * src_width + (x0 - x)];
+        const int n = x1 - x0;
+        if (blend == CANVAS_COPY) {
+            memcpy(d, s, (size_t)n * sizeof(Pixel));
+            continue;
+        }
+        int i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+        // Source alpha is swapped for 255 so the alpha lane works out to sa + da * (1 - sa)
+        const __m128i alpha_lanes = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+        for (; i + 4 <= n; i += 4) {
+            const __m128i sp = _mm_loadu_si128((const __m128i *)&s[i]);
+            const __m128i dp = _mm_loadu_si128((const __m128i *)&d[i]);
+            __m128i out[2];
+            for (int half = 0; half < 2; half++) {
+                __m128i sv = half ? _mm_unpackhi_epi8(sp, zero) : _mm_unpacklo_epi8(sp, zero);
+                const __m128i dv = half ? _mm_unpackhi_epi8(dp, zero) : _mm_unpacklo_epi8(dp, zero);
+                __m128i sa = _mm_shufflelo_epi16(sv, _MM_SHUFFLE(3, 3, 3, 3));
+                sa = _mm_shufflehi_epi16(sa, _MM_SHUFFLE(3, 3, 3, 3));
+                sv = _mm_or_si128(_mm_andnot_si128(alpha_lanes, sv), _mm_and_si128(alpha_lanes, c255));
+                // At most 255 * 255, so 16 bit unsigned arithmetic is exact
+                __m128i v = _mm_add_epi16(_mm_mullo_epi16(sv, sa), _mm_mullo_epi16(dv, _mm_sub_epi16(c255, sa)));
+                v = _mm_add_epi16(v, c128);
+                out[half] = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+            }
+            _mm_storeu_si128((__m128i *)&d[i], _mm_packus_epi16(out[0], out[1]));
+        }
+#endif
+        for (; i < n; i++) d[i] = blend_over(s[i], d[i]);
+    }
+}
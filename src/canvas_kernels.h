@@ -0,0 +1,39 @@
+/**
+ * Bulk operations on canvas pixels (RGBA, top row first), so a canvas
+ * can be filled without a Lua call per pixel.
+ *
+ * Gradients work out where each pixel falls along the gradient and look
+ * its color up in a ramp, which can be built from color stops or hues
+ * (see ColorRamp and HueRamp in lua/api.lua). Linear and radial gradients
+ * clamp to the ends of the ramp, angular gradients wrap around it.
+ */
+
+#ifndef CANVAS_KERNELS_H
+#define CANVAS_KERNELS_H
+#include "common.h"
+
+typedef struct {
+    float h, s, l, a; // Hue in degrees, the rest in [0, 1]
+} Hsla;
+
+typedef enum {
+    CANVAS_COPY = 0,
+    CANVAS_OVER,     // Source alpha over the destination, as with glBlendFunc
+} CanvasBlend;
+
+// Clipped to the canvas
+void canvas_fill_rect(Pixel *dst, int width, int height, int x, int y, int w, int h, Pixel color);
+void canvas_linear_gradient(Pixel *dst, int width, int height, Vector2 from, Vector2 to,
+                            const Pixel *ramp, int ramp_size);
+void canvas_radial_gradient(Pixel *dst, int width, int height, Vector2 center, float radius,
+                            const Pixel *ramp, int ramp_size);
+// `start` is the angle in radians where the ramp begins, going clockwise on screen
+void canvas_angular_gradient(Pixel *dst, int width, int height, Vector2 center, float start,
+                             const Pixel *ramp, int ramp_size);
+// Rounds down like Color:Pixel()
+void canvas_hsl_to_rgb(Pixel *dst, const Hsla *src, int count);
+// Draws `src` with its top left at x, y, clipped to the destination
+void canvas_blit(Pixel *dst, int width, int height, const Pixel *src, int src_width, int src_height,
+                 int x, int y, CanvasBlend blend);
+
+#endif // CANVAS_KERNELS_H
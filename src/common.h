@@ -9,6 +9,7 @@
 
 #define ERROR() strerror(errno)
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
 #define STATIC_LEN(arr) (sizeof(arr) / sizeof(arr[0]))
 
 extern float scale;
@@ -17,6 +18,7 @@ extern const float QUAD[8];
 #define SCALECONTENT(p) (p * scale)
 
 double get_time(void);
+void freeze_time(bool frozen);
 
 typedef struct {
     float r, g, b, a;
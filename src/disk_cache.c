@@ -0,0 +1,68 @@
+#include "disk_cache.h"
+#include <SDL.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+uint64_t cache_hash(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *bytes = data;
+    uint64_t h = (seed ^ 0x9E3779B97F4A7C15ull ^ size) * 0x100000001B3ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ word) * 0x100000001B3ull;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ bytes[i]) * 0x100000001B3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+void cache_make_dirs(const char *dir)
+{
+    char partial[512];
+    snprintf(partial, sizeof(partial), "%s", dir);
+    for (char *p = partial + 1; ; p++) {
+        const char c = *p;
+        if (c != '/' && c != '\0') continue;
+        *p = '\0';
+#ifdef _WIN32
+        _mkdir(partial);
+#else
+        mkdir(partial, 0755);
+#endif
+        if (c == '\0') break;
+        *p = c;
+    }
+}
+
+bool cache_write(const char *path, const void *header, size_t header_size, const void *data, size_t size)
+{
+    static SDL_atomic_t counter;
+    char temp[512];
+    snprintf(temp, sizeof(temp), "%s.%d.%d.tmp", path, (int)SDL_ThreadID(), SDL_AtomicAdd(&counter, 1));
+    FILE *file = fopen(temp, "wb");
+    if (!file) {
+        fprintf(stderr, "WARNING: unable to write cache file %s: %s\n", temp, ERROR());
+        return false;
+    }
+    bool ok = fwrite(header, header_size, 1, file) == 1 && fwrite(data, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    // rename doesn't replace an existing file on Windows
+    remove(path);
+    if (!ok || rename(temp, path) != 0) {
+        fprintf(stderr, "WARNING: unable to write cache file %s\n", path);
+        remove(temp);
+        return false;
+    }
+    return true;
+}
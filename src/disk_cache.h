@@ -0,0 +1,19 @@
+/**
+ * Files caching something expensive to make, named after a hash of what it
+ * was made from. A cache file is written under a temporary name and renamed
+ * into place, so a reader never sees one half written and threads (or
+ * processes) making the same file don't clash.
+ */
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+#include "common.h"
+
+// Chain calls through `seed` to hash several inputs, start with 0
+uint64_t cache_hash(const void *data, size_t size, uint64_t seed);
+// Creates `dir` and any missing parents
+void cache_make_dirs(const char *dir);
+// Writes `header` then `data` to `path`, replacing any older file
+bool cache_write(const char *path, const void *header, size_t header_size, const void *data, size_t size);
+
+#endif // DISK_CACHE_H
@@ -7,15 +7,33 @@
 
 #include "entity_renderer.h"
 #include "SDL_video.h"
+#include "render_thread.h"
+#include "render_view.h"
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
 
+#define PLACEHOLDER_FRAG "shaders/placeholder.frag"
+
+static void get_uniforms(GLuint program, EntityUniforms *uniforms)
+{
+    uniforms->resolution = glGetUniformLocation(program, "resolution");
+    uniforms->time = glGetUniformLocation(program, "time");
+    uniforms->view = glGetUniformLocation(program, "view");
+}
+
 void entity_init(EntityRenderer *r, const EntityRendererData data)
 {
-    shader_program_from_files(&r->shader, data.vert, data.frag);
-    r->uniforms.resolution = glGetUniformLocation(r->shader.program, "resolution");
-    r->uniforms.time = glGetUniformLocation(r->shader.program, "time");
+    r->vert = data.vert;
+    r->frag = data.frag;
+    if (shader_parallel_compile()) {
+        r->pending = shader_submit_files(r->vert, r->frag);
+        // Built now, only the vertex shader is the renderer's own so it's
+        // quick, and used until the real program is ready
+        r->placeholder = shader_finish_program(shader_submit_files(r->vert, PLACEHOLDER_FRAG));
+        if (r->placeholder) get_uniforms(r->placeholder, &r->placeholder_uniforms);
+    }
+    shader_init_quad(&r->shader);
 
     r->num_entities = 0;
     r->entity_size = data.particle_size;
@@ -39,32 +57,88 @@ void entity_init(EntityRenderer *r, const EntityRendererData data)
     glBindVertexArray(0);
 }
 
-void flush_entities(EntityRenderer *r)
+// Whether the program can be used, finishing it once it's compiled
+static bool program_ready(EntityRenderer *r, bool wait)
 {
+    if (r->shader.program) return true;
+    if (!r->pending) r->pending = shader_submit_files(r->vert, r->frag);
+    if (!wait && !shader_program_ready(r->pending)) return false;
+
+    r->shader.program = shader_finish_program(r->pending);
+    r->pending = NULL;
+    if (!r->shader.program) exit(1);
+    get_uniforms(r->shader.program, &r->uniforms);
+    if (r->placeholder) {
+        glDeleteProgram(r->placeholder);
+        r->placeholder = 0;
+    }
+    return true;
+}
+
+static void draw_entities(EntityRenderer *r, const void *entities, size_t count, double time, bool wait)
+{
+    GLuint program = r->placeholder;
+    const EntityUniforms *uniforms = &r->placeholder_uniforms;
+    if (program_ready(r, wait)) {
+        program = r->shader.program;
+        uniforms = &r->uniforms;
+    } else if (!program) {
+        // Nothing to draw with if even the placeholder failed
+        return;
+    }
+
     /* Bind */
-    glUseProgram(r->shader.program);
+    glUseProgram(program);
     glBindVertexArray(r->shader.vao);
     glBindBuffer(GL_ARRAY_BUFFER, r->vbo);
 
-    SDL_Window *window = SDL_GL_GetCurrentWindow();
-    int w, h;
-    SDL_GL_GetDrawableSize(window, &w, &h);
+    const RenderView view = render_view_get();
 
     /* Update */
-    glBufferSubData(GL_ARRAY_BUFFER, 0, ENTITIY_BUFFER_SIZE, r->buffer);
-    glUniform2f(r->uniforms.resolution, w, h);
-    glUniform1f(r->uniforms.time, get_time());
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * r->entity_size, entities);
+    glUniform2f(uniforms->resolution, view.target_width, view.target_height);
+    glUniform4f(uniforms->view, view.x, view.y, view.width, view.height);
+    glUniform1f(uniforms->time, time);
 
     /* Draw */
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, r->num_entities);
-    
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
     /* Reset */
-    r->num_entities = 0;
     glUseProgram(0);
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+// Recorded form of a flush for the render thread.
+// The entity records follow the header in the payload.
+typedef struct {
+    EntityRenderer *renderer;
+    size_t count;
+    double time;
+    bool wait;
+} EntityBatch;
+
+static void replay_entities(void *payload)
+{
+    EntityBatch *batch = payload;
+    draw_entities(batch->renderer, batch + 1, batch->count, batch->time, batch->wait);
+}
+
+void flush_entities(EntityRenderer *r)
+{
+    if (r->num_entities == 0) return;
+
+    if (render_thread_active()) {
+        const size_t bytes = r->num_entities * r->entity_size;
+        EntityBatch *batch = render_thread_record(replay_entities, sizeof(EntityBatch) + bytes);
+        *batch = (EntityBatch){ r, r->num_entities, get_time(), r->wait_for_program };
+        memcpy(batch + 1, r->buffer, bytes);
+    } else {
+        draw_entities(r, r->buffer, r->num_entities, get_time(), r->wait_for_program);
+    }
+    r->num_entities = 0;
+}
+
 void render_entity(EntityRenderer *restrict r, const void *restrict entity)
 {
     // The size of the entity varies by the renderer
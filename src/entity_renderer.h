@@ -23,11 +23,19 @@ typedef struct {
 #define ENTITIY_BUFFER_SIZE 500000
 
 typedef struct {
-    Shader shader;
-    struct {
-        GLint time;
-        GLint resolution;
-    } uniforms;
+    GLint time;
+    GLint resolution;
+    GLint view;
+} EntityUniforms;
+
+typedef struct {
+    Shader shader;               // The program is 0 until it's finished
+    PendingProgram *pending;
+    const char *vert, *frag;
+    bool wait_for_program;       // Rather than drawing the placeholder until it's ready
+    EntityUniforms uniforms;
+    GLuint placeholder;          // Flat colour program drawn meanwhile, 0 once it's not needed
+    EntityUniforms placeholder_uniforms;
     char buffer[ENTITIY_BUFFER_SIZE];
     size_t num_entities;
     size_t buffer_size;
@@ -35,6 +43,9 @@ typedef struct {
     GLuint vbo;
 } EntityRenderer;
 
+// The program is built on first use unless the driver compiles in
+// parallel, then it's submitted straight away and entities are drawn
+// with a flat colour placeholder until it's ready
 void entity_init(EntityRenderer *r, const EntityRendererData data);
 void flush_entities(EntityRenderer *r);
 void render_entity(EntityRenderer *restrict r, const void *restrict entity);
@@ -0,0 +1,145 @@
+/*
+ * The pool is a fixed array of frames. Free frames are taken by the
+ * producer, filled without the lock and pushed on a FIFO. The consumer
+ * pops them in order and returns them to the free list once done.
+ */
+
+#include "frame_queue.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct FrameQueue {
+    FrameConsumer consume;
+    void *user;
+    bool block_when_full;
+
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *has_frame;
+    SDL_cond *has_room;
+    bool stopping;
+
+    QueuedFrame frames[FRAME_QUEUE_MAX_FRAMES];
+    int free_frames[FRAME_QUEUE_MAX_FRAMES];
+    int num_free;
+    int queue[FRAME_QUEUE_MAX_FRAMES];
+    int queue_head, queue_count;
+    int consuming; // Taken off the queue but not yet done
+};
+
+static int consumer_main(void *data) {
+    FrameQueue *q = data;
+    SDL_LockMutex(q->lock);
+    for (;;) {
+        while (q->queue_count == 0 && !q->stopping) {
+            SDL_CondWait(q->has_frame, q->lock);
+        }
+        if (q->queue_count == 0) break;
+
+        const int index = q->queue[q->queue_head];
+        q->queue_head = (q->queue_head + 1) % FRAME_QUEUE_MAX_FRAMES;
+        q->queue_count--;
+        q->consuming++;
+        SDL_UnlockMutex(q->lock);
+
+        q->consume(q->user, &q->frames[index]);
+
+        SDL_LockMutex(q->lock);
+        q->consuming--;
+        q->free_frames[q->num_free++] = index;
+        SDL_CondBroadcast(q->has_room);
+    }
+    SDL_UnlockMutex(q->lock);
+    return 0;
+}
+
+FrameQueue *frame_queue_new(const char *thread_name, int frames, bool block_when_full,
+                            FrameConsumer consume, void *user) {
+    if (frames <= 0) frames = FRAME_QUEUE_DEFAULT_FRAMES;
+    frames = MIN(frames, FRAME_QUEUE_MAX_FRAMES);
+
+    FrameQueue *q = calloc(1, sizeof(FrameQueue));
+    q->consume = consume;
+    q->user = user;
+    q->block_when_full = block_when_full;
+    for (int i = 0; i < frames; i++) {
+        q->free_frames[q->num_free++] = i;
+    }
+    q->lock = SDL_CreateMutex();
+    q->has_frame = SDL_CreateCond();
+    q->has_room = SDL_CreateCond();
+    q->thread = SDL_CreateThread(consumer_main, thread_name, q);
+    if (q->thread == NULL) {
+        fprintf(stderr, "ERROR: unable to create %s thread: %s\n", thread_name, SDL_GetError());
+        SDL_DestroyCond(q->has_room);
+        SDL_DestroyCond(q->has_frame);
+        SDL_DestroyMutex(q->lock);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+bool frame_queue_push(FrameQueue *q, const uint8_t *pixels, int width, int height, double timestamp) {
+    SDL_LockMutex(q->lock);
+    if (q->num_free == 0 && !q->block_when_full) {
+        SDL_UnlockMutex(q->lock);
+        return false;
+    }
+    while (q->num_free == 0) {
+        SDL_CondWait(q->has_room, q->lock);
+    }
+    const int index = q->free_frames[--q->num_free];
+    SDL_UnlockMutex(q->lock);
+
+    // Free frames belong to this thread, fill it without the lock
+    QueuedFrame *frame = &q->frames[index];
+    const size_t bytes = (size_t)width * height * 4;
+    if (frame->capacity < bytes) {
+        free(frame->pixels);
+        frame->pixels = malloc(bytes);
+        frame->capacity = bytes;
+    }
+    memcpy(frame->pixels, pixels, bytes);
+    frame->width = width;
+    frame->height = height;
+    frame->timestamp = timestamp;
+
+    SDL_LockMutex(q->lock);
+    q->queue[(q->queue_head + q->queue_count) % FRAME_QUEUE_MAX_FRAMES] = index;
+    q->queue_count++;
+    SDL_CondSignal(q->has_frame);
+    SDL_UnlockMutex(q->lock);
+    return true;
+}
+
+void frame_queue_flush(FrameQueue *q) {
+    SDL_LockMutex(q->lock);
+    while (q->queue_count > 0 || q->consuming > 0) {
+        SDL_CondWait(q->has_room, q->lock);
+    }
+    SDL_UnlockMutex(q->lock);
+}
+
+int frame_queue_pending(FrameQueue *q) {
+    SDL_LockMutex(q->lock);
+    const int pending = q->queue_count + q->consuming;
+    SDL_UnlockMutex(q->lock);
+    return pending;
+}
+
+void frame_queue_free(FrameQueue *q) {
+    SDL_LockMutex(q->lock);
+    q->stopping = true;
+    SDL_CondSignal(q->has_frame);
+    SDL_UnlockMutex(q->lock);
+    // The consumer drains the queue before exiting
+    SDL_WaitThread(q->thread, NULL);
+
+    for (int i = 0; i < FRAME_QUEUE_MAX_FRAMES; i++) free(q->frames[i].pixels);
+    SDL_DestroyCond(q->has_room);
+    SDL_DestroyCond(q->has_frame);
+    SDL_DestroyMutex(q->lock);
+    free(q);
+}
@@ -0,0 +1,43 @@
+/**
+ * A bounded queue of captured frames handed to a consumer thread, shared
+ * by the GIF recorder and the video sink.
+ *
+ * Frames are copied into a fixed pool of buffers, so memory stays bounded
+ * however far behind the consumer falls: once every buffer is waiting new
+ * frames are dropped, or the caller blocks for a free one. The consumer
+ * gets the frames in the order they were pushed.
+ */
+
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+#include "common.h"
+
+#define FRAME_QUEUE_DEFAULT_FRAMES 8
+#define FRAME_QUEUE_MAX_FRAMES 64
+
+typedef struct {
+    uint8_t *pixels;
+    size_t capacity;
+    int width, height;
+    double timestamp;
+} QueuedFrame;
+
+// Called on the consumer thread for each frame, without the queue locked
+typedef void (*FrameConsumer)(void *user, QueuedFrame *frame);
+
+typedef struct FrameQueue FrameQueue;
+
+// `frames` is clamped to FRAME_QUEUE_MAX_FRAMES, 0 picks the default.
+// NULL if the thread couldn't be started.
+FrameQueue *frame_queue_new(const char *thread_name, int frames, bool block_when_full,
+                            FrameConsumer consume, void *user);
+// Copies the RGBA pixels, returns false if the pool was full and it doesn't block
+bool frame_queue_push(FrameQueue *queue, const uint8_t *pixels, int width, int height, double timestamp);
+// Wait until every pushed frame has been consumed
+void frame_queue_flush(FrameQueue *queue);
+// Frames queued or being consumed
+int frame_queue_pending(FrameQueue *queue);
+// Consumes what's queued, then stops the thread and frees the queue
+void frame_queue_free(FrameQueue *queue);
+
+#endif // FRAME_QUEUE_H
@@ -0,0 +1,95 @@
+#include "frame_stream.h"
+#include "png_writer.h"
+#include "worker_pool.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    uint8_t *pixels;
+    int w, h;
+} EncodeJob;
+
+static struct {
+    WorkerPool *pool;
+    SDL_mutex *lock;
+    StreamFrame latest; // data is NULL once taken
+    int serial;
+    StreamStats stats;
+    double total_encode_ms;
+} fs = { 0 };
+
+static bool run_encode(void *arg)
+{
+    EncodeJob *job = arg;
+    const Uint64 started = SDL_GetPerformanceCounter();
+    size_t size = 0;
+    uint8_t *png = encode_png(job->pixels, job->w, job->h, &size);
+    const float ms = (float)((double)(SDL_GetPerformanceCounter() - started) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+    free(job->pixels);
+    free(job);
+    if (!png) {
+        fprintf(stderr, "WARNING: unable to encode preview frame\n");
+        return false;
+    }
+
+    SDL_LockMutex(fs.lock);
+    // Nobody took the previous one in time
+    free(fs.latest.data);
+    fs.latest = (StreamFrame){ ++fs.serial, png, size };
+    fs.stats.encoded++;
+    fs.stats.bytes += size;
+    fs.total_encode_ms += ms;
+    fs.stats.mean_encode_ms = fs.total_encode_ms / fs.stats.encoded;
+    SDL_UnlockMutex(fs.lock);
+    return true;
+}
+
+void frame_stream_shutdown(void)
+{
+    if (!fs.pool) return;
+    worker_pool_free(fs.pool);
+    SDL_DestroyMutex(fs.lock);
+    free(fs.latest.data);
+    memset(&fs, 0, sizeof(fs));
+}
+
+bool frame_stream_encode(uint8_t *pixels, int w, int h)
+{
+    if (!fs.pool) {
+        fs.lock = SDL_CreateMutex();
+        // One frame encoding, one waiting, anything more is dropped
+        fs.pool = worker_pool_new("bubbl stream", 1, 1, BACKPRESSURE_DROP);
+    }
+    EncodeJob *job = malloc(sizeof(EncodeJob));
+    *job = (EncodeJob){ pixels, w, h };
+    if (worker_pool_submit(fs.pool, run_encode, job) >= 0) return true;
+    free(pixels);
+    free(job);
+    SDL_LockMutex(fs.lock);
+    fs.stats.dropped++;
+    SDL_UnlockMutex(fs.lock);
+    return false;
+}
+
+bool frame_stream_take(StreamFrame *frame)
+{
+    if (!fs.pool) return false;
+    SDL_LockMutex(fs.lock);
+    const bool fresh = fs.latest.data != NULL;
+    if (fresh) {
+        *frame = fs.latest;
+        fs.latest.data = NULL;
+    }
+    SDL_UnlockMutex(fs.lock);
+    return fresh;
+}
+
+StreamStats frame_stream_stats(void)
+{
+    if (!fs.pool) return (StreamStats){ 0 };
+    SDL_LockMutex(fs.lock);
+    const StreamStats stats = fs.stats;
+    SDL_UnlockMutex(fs.lock);
+    return stats;
+}
@@ -0,0 +1,36 @@
+/**
+ * Frames for the web server's live preview.
+ *
+ * Captured frames are encoded to PNG on a worker thread and only the newest
+ * encoded frame is kept. Frames arriving while one is still being encoded
+ * are dropped, so a slow encoder lowers the preview's frame rate instead of
+ * queueing up behind it.
+ */
+
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+#include "common.h"
+
+typedef struct {
+    int serial;     // Increases with every encoded frame
+    uint8_t *data;  // PNG, malloc'd
+    size_t size;
+} StreamFrame;
+
+typedef struct {
+    int encoded;
+    int dropped;
+    float mean_encode_ms;
+    uint64_t bytes;
+} StreamStats;
+
+// Waits for the frame being encoded
+void frame_stream_shutdown(void);
+// Takes ownership of `pixels` (malloc'd RGBA, top row first).
+// Returns false if dropped.
+bool frame_stream_encode(uint8_t *pixels, int w, int h);
+// The newest frame if it hasn't been taken yet, the caller frees its data
+bool frame_stream_take(StreamFrame *frame);
+StreamStats frame_stream_stats(void);
+
+#endif // FRAME_STREAM_H
@@ -0,0 +1,100 @@
+/*
+ * Frames go through a FrameQueue, whose consumer is the feeder. It takes
+ * them in order, so frame numbers given to gifski are always contiguous,
+ * even when frames are dropped.
+ */
+
+#include "gif_recorder.h"
+#include "frame_queue.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define GIFSKI_OK 0
+
+struct GifRecorder {
+    void *gifski;
+    GifskiAddFrameFn add_frame;
+    GifskiFinishFn finish;
+    GifRecorderSettings settings;
+
+    FrameQueue *frames;
+    SDL_mutex *lock; // For the stats, which the feeder updates too
+
+    // Feeder thread only
+    uint32_t next_frame_number;
+
+    GifRecorderStats stats;
+};
+
+static void feed(void *user, QueuedFrame *frame) {
+    GifRecorder *rec = user;
+    // gifski copies the pixels, and blocks here if it's behind
+    const int err = rec->add_frame(rec->gifski, rec->next_frame_number++, frame->width, frame->height,
+                                   frame->pixels, frame->timestamp);
+    if (err != GIFSKI_OK) {
+        fprintf(stderr, "WARNING: (code %d) unable to add GIF frame\n", err);
+    }
+    SDL_LockMutex(rec->lock);
+    rec->stats.written++;
+    if (err != GIFSKI_OK) rec->stats.errors++;
+    SDL_UnlockMutex(rec->lock);
+}
+
+GifRecorder *gif_recorder_start(void *gifski, GifskiAddFrameFn add_frame, GifskiFinishFn finish, GifRecorderSettings settings) {
+    settings.decimate = MAX(settings.decimate, 1);
+
+    GifRecorder *rec = calloc(1, sizeof(GifRecorder));
+    rec->gifski = gifski;
+    rec->add_frame = add_frame;
+    rec->finish = finish;
+    rec->settings = settings;
+    rec->lock = SDL_CreateMutex();
+    rec->frames = frame_queue_new("bubbl gif", settings.pool_frames, settings.block_when_full, feed, rec);
+    if (rec->frames == NULL) {
+        SDL_DestroyMutex(rec->lock);
+        free(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+bool gif_recorder_want_frame(GifRecorder *rec) {
+    SDL_LockMutex(rec->lock);
+    const bool want = rec->stats.offered++ % rec->settings.decimate == 0;
+    SDL_UnlockMutex(rec->lock);
+    return want;
+}
+
+bool gif_recorder_add_frame(GifRecorder *rec, const uint8_t *pixels, int width, int height, double timestamp) {
+    const bool added = frame_queue_push(rec->frames, pixels, width, height, timestamp);
+    SDL_LockMutex(rec->lock);
+    if (added) rec->stats.added++;
+    else rec->stats.dropped++;
+    SDL_UnlockMutex(rec->lock);
+    return added;
+}
+
+void gif_recorder_flush(GifRecorder *rec) {
+    frame_queue_flush(rec->frames);
+}
+
+int gif_recorder_stop(GifRecorder *rec) {
+    // Feeds what's queued before returning
+    frame_queue_free(rec->frames);
+
+    const int err = rec->finish(rec->gifski);
+
+    SDL_DestroyMutex(rec->lock);
+    free(rec);
+    return err;
+}
+
+GifRecorderStats gif_recorder_stats(GifRecorder *rec) {
+    SDL_LockMutex(rec->lock);
+    GifRecorderStats stats = rec->stats;
+    SDL_UnlockMutex(rec->lock);
+    stats.queued = frame_queue_pending(rec->frames);
+    return stats;
+}
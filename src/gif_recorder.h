@@ -0,0 +1,48 @@
+/**
+ * Records GIFs through gifski without holding up the frame.
+ *
+ * Captured frames, already at the GIF's size, are copied into a fixed pool
+ * of buffers and a feeder thread hands them to gifski, which can take a
+ * while per frame. Memory stays bounded by the pool: once every buffer is
+ * waiting on gifski new frames are dropped (or the caller blocks).
+ *
+ * gifski is loaded at runtime from Lua, so its functions are passed in.
+ */
+
+#ifndef GIF_RECORDER_H
+#define GIF_RECORDER_H
+#include "common.h"
+
+typedef int (*GifskiAddFrameFn)(void *gifski, uint32_t frame_number, uint32_t width, uint32_t height,
+                                const unsigned char *pixels, double timestamp);
+typedef int (*GifskiFinishFn)(void *gifski);
+
+typedef struct {
+    int pool_frames;     // Frame buffers, bounds memory use
+    int decimate;        // Keep one in every `decimate` frames
+    bool block_when_full;
+} GifRecorderSettings;
+
+typedef struct {
+    int offered;         // Frames passed to gif_recorder_want_frame
+    int added;
+    int written;
+    int dropped;         // Pool was full
+    int queued;
+    int errors;
+} GifRecorderStats;
+
+typedef struct GifRecorder GifRecorder;
+
+GifRecorder *gif_recorder_start(void *gifski, GifskiAddFrameFn add_frame, GifskiFinishFn finish, GifRecorderSettings settings);
+// Whether to capture this frame, applies decimation
+bool gif_recorder_want_frame(GifRecorder *recorder);
+// Copies the RGBA pixels (top row first), returns false if dropped
+bool gif_recorder_add_frame(GifRecorder *recorder, const uint8_t *pixels, int width, int height, double timestamp);
+// Wait until every added frame is in gifski
+void gif_recorder_flush(GifRecorder *recorder);
+// Flush, finish the file and free the recorder. Returns gifski's error code.
+int gif_recorder_stop(GifRecorder *recorder);
+GifRecorderStats gif_recorder_stats(GifRecorder *recorder);
+
+#endif // GIF_RECORDER_H
@@ -0,0 +1,206 @@
+/*
+ * Entries live in a growing array of slots. A handle is the slot index plus
+ * one in the low bits and the slot's generation in the high bits, so a
+ * handle to a deleted object never matches whatever reuses its slot.
+ */
+
+#include "gpu_resources.h"
+#include "render_thread.h"
+#include <gl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SLOT_BITS 20
+#define SLOT_MASK ((1u << SLOT_BITS) - 1)
+
+typedef struct {
+    GpuResourceInfo info;
+    uint32_t generation;
+    bool used;
+} Slot;
+
+static struct {
+    Slot *slots;
+    int count, capacity;
+    int *free_slots;
+    int num_free;
+    char owner[GPU_OWNER_SIZE];
+    uint64_t frame;
+    GpuResourceTotals totals;
+} reg = { .owner = "engine" };
+
+typedef struct {
+    GpuResourceType type;
+    GLuint name;
+} Deletion;
+
+static void delete_object(void *payload)
+{
+    const Deletion *d = payload;
+    switch (d->type) {
+    case GPU_TEXTURE: glDeleteTextures(1, &d->name); break;
+    case GPU_BUFFER: glDeleteBuffers(1, &d->name); break;
+    case GPU_PROGRAM: glDeleteProgram(d->name); break;
+    case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &d->name); break;
+    case GPU_FRAMEBUFFER: glDeleteFramebuffers(1, &d->name); break;
+    case GPU_RESOURCE_TYPES: break;
+    }
+}
+
+static Slot *lookup(GpuHandle handle)
+{
+    const uint32_t index = (handle.id & SLOT_MASK) - 1;
+    if (handle.id == 0 || index >= (uint32_t)reg.count) return NULL;
+    Slot *slot = &reg.slots[index];
+    if (!slot->used || slot->generation != handle.id >> SLOT_BITS) return NULL;
+    return slot;
+}
+
+static void destroy(Slot *slot)
+{
+    Deletion d = { slot->info.type, slot->info.name };
+    if (render_thread_active()) {
+        render_thread_record_copy(delete_object, &d, sizeof(d));
+    } else {
+        delete_object(&d);
+    }
+    reg.totals.count--;
+    reg.totals.bytes -= slot->info.bytes;
+    reg.totals.type_bytes[slot->info.type] -= slot->info.bytes;
+    slot->used = false;
+    slot->generation = (slot->generation + 1) & (UINT32_MAX >> SLOT_BITS);
+    reg.free_slots[reg.num_free++] = (int)(slot - reg.slots);
+}
+
+// Least recently used first, never what's been used this frame
+static void evict_over_budget(void)
+{
+    reg.totals.over_budget = false;
+    while (reg.totals.budget > 0 && reg.totals.bytes > reg.totals.budget) {
+        Slot *oldest = NULL;
+        for (int i = 0; i < reg.count; i++) {
+            Slot *slot = &reg.slots[i];
+            if (!slot->used || !slot->info.cached || slot->info.last_used >= reg.frame) continue;
+            if (!oldest || slot->info.last_used < oldest->info.last_used) oldest = slot;
+        }
+        if (!oldest) {
+            reg.totals.over_budget = true;
+            return;
+        }
+        destroy(oldest);
+        reg.totals.evicted++;
+    }
+}
+
+static void copy_name(char *dst, const char *src, size_t size)
+{
+    snprintf(dst, size, "%s", src ? src : "");
+}
+
+GpuHandle gpu_register(GpuResourceType type, unsigned int name, uint64_t bytes,
+                       const char *owner, const char *label, bool cached)
+{
+    if (name == 0 || type >= GPU_RESOURCE_TYPES) return (GpuHandle){ 0 };
+    if (reg.num_free == 0) {
+        if (reg.count == (int)SLOT_MASK) {
+            fprintf(stderr, "WARNING: too many GPU resources, %s won't be tracked\n", label);
+            return (GpuHandle){ 0 };
+        }
+        if (reg.count == reg.capacity) {
+            reg.capacity = reg.capacity ? reg.capacity * 2 : 64;
+            reg.slots = realloc(reg.slots, reg.capacity * sizeof(Slot));
+            reg.free_slots = realloc(reg.free_slots, reg.capacity * sizeof(int));
+        }
+        reg.slots[reg.count] = (Slot){ 0 };
+        reg.free_slots[reg.num_free++] = reg.count++;
+    }
+    const int index = reg.free_slots[--reg.num_free];
+    Slot *slot = &reg.slots[index];
+    slot->used = true;
+    slot->info = (GpuResourceInfo){
+        .type = type,
+        .name = name,
+        .bytes = bytes,
+        .refs = 1,
+        .cached = cached,
+        .last_used = reg.frame,
+    };
+    copy_name(slot->info.owner, owner ? owner : reg.owner, sizeof(slot->info.owner));
+    copy_name(slot->info.label, label, sizeof(slot->info.label));
+
+    reg.totals.count++;
+    reg.totals.bytes += bytes;
+    reg.totals.type_bytes[type] += bytes;
+    const GpuHandle handle = { slot->generation << SLOT_BITS | (uint32_t)(index + 1) };
+    evict_over_budget();
+    return handle;
+}
+
+void gpu_retain(GpuHandle handle)
+{
+    Slot *slot = lookup(handle);
+    if (slot) slot->info.refs++;
+}
+
+void gpu_release(GpuHandle handle)
+{
+    Slot *slot = lookup(handle);
+    if (slot && --slot->info.refs == 0) destroy(slot);
+}
+
+bool gpu_alive(GpuHandle handle)
+{
+    return lookup(handle) != NULL;
+}
+
+bool gpu_touch(GpuHandle handle)
+{
+    Slot *slot = lookup(handle);
+    if (!slot) return false;
+    slot->info.last_used = reg.frame;
+    return true;
+}
+
+void gpu_set_owner(const char *owner)
+{
+    copy_name(reg.owner, owner, sizeof(reg.owner));
+}
+
+int gpu_release_owner(const char *owner)
+{
+    int released = 0;
+    for (int i = 0; i < reg.count; i++) {
+        Slot *slot = &reg.slots[i];
+        if (!slot->used || strcmp(slot->info.owner, owner) != 0) continue;
+        destroy(slot);
+        released++;
+    }
+    reg.totals.released += released;
+    return released;
+}
+
+void gpu_set_budget(uint64_t bytes)
+{
+    reg.totals.budget = bytes;
+    evict_over_budget();
+}
+
+void gpu_resources_next_frame(void)
+{
+    reg.frame++;
+    evict_over_budget();
+}
+
+int gpu_resources_list(GpuResourceInfo *out, int max)
+{
+    int n = 0;
+    for (int i = 0; i < reg.count && n < max; i++) {
+        if (reg.slots[i].used) out[n++] = reg.slots[i].info;
+    }
+    return n;
+}
+
+GpuResourceTotals gpu_resources_totals(void)
+{
+    return reg.totals;
+}
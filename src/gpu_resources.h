@@ -0,0 +1,78 @@
+/**
+ * Registry of the GL objects made for Lua: canvas textures, streaming
+ * buffers, shader programs, their vertex arrays and layer framebuffers.
+ *
+ * Each object belongs to an owner, normally the module that was loaded when
+ * it was created, and carries an estimate of its size. Handles are
+ * reference counted and the object is deleted with the last reference;
+ * from Lua that's when ffi.gc collects the handle. Releasing an owner
+ * deletes everything it still has, which is how unloading a module frees
+ * its resources. Objects registered as cached (canvas textures, which can
+ * be uploaded again) are evicted least recently used first while the total
+ * is over budget. A handle whose object is gone is no longer alive.
+ *
+ * Lua thread only. Deleting is recorded for the render thread like any
+ * other GL call, so commands already recorded still see the object.
+ */
+
+#ifndef GPU_RESOURCES_H
+#define GPU_RESOURCES_H
+#include "common.h"
+
+#define GPU_OWNER_SIZE 48
+#define GPU_LABEL_SIZE 32
+
+typedef enum {
+    GPU_TEXTURE = 0,
+    GPU_BUFFER,
+    GPU_PROGRAM,
+    GPU_VERTEX_ARRAY,
+    GPU_FRAMEBUFFER,
+    GPU_RESOURCE_TYPES,
+} GpuResourceType;
+
+// 0 is never a valid handle
+typedef struct {
+    uint32_t id;
+} GpuHandle;
+
+typedef struct {
+    GpuResourceType type;
+    unsigned int name;
+    uint64_t bytes;
+    int refs;
+    bool cached;
+    uint64_t last_used; // Frame number
+    char owner[GPU_OWNER_SIZE];
+    char label[GPU_LABEL_SIZE];
+} GpuResourceInfo;
+
+typedef struct {
+    int count;
+    uint64_t bytes;
+    uint64_t type_bytes[GPU_RESOURCE_TYPES];
+    uint64_t budget;   // 0 is unlimited
+    int evicted;
+    int released;      // Deleted with their owner rather than their last reference
+    bool over_budget;  // Nothing left to evict, everything cached was used this frame
+} GpuResourceTotals;
+
+// `owner` NULL is the current owner
+GpuHandle gpu_register(GpuResourceType type, unsigned int name, uint64_t bytes,
+                       const char *owner, const char *label, bool cached);
+void gpu_retain(GpuHandle handle);
+void gpu_release(GpuHandle handle);
+bool gpu_alive(GpuHandle handle);
+// Marks it used this frame, returns false if it's been deleted
+bool gpu_touch(GpuHandle handle);
+
+void gpu_set_owner(const char *owner);
+// Deletes what the owner still has, returns how many objects
+int gpu_release_owner(const char *owner);
+
+void gpu_set_budget(uint64_t bytes);
+void gpu_resources_next_frame(void);
+int gpu_resources_list(GpuResourceInfo *out, int max);
+GpuResourceTotals gpu_resources_totals(void);
+
+#endif // GPU_RESOURCES_H
@@ -0,0 +1,248 @@
+/*
+ * QOI follows the spec at qoiformat.org: a 14 byte header, then chunks
+ * tagged by their top bits, then 7 zero bytes and a 1.
+ */
+
+#include "image_formats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+// Stops a corrupt header from asking for gigabytes
+#define QOI_MAX_PIXELS 400000000u
+
+static const uint8_t qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+typedef union {
+    struct { uint8_t r, g, b, a; } rgba;
+    uint32_t v;
+} QoiPixel;
+
+static inline int qoi_hash(QoiPixel p)
+{
+    return (p.rgba.r * 3 + p.rgba.g * 5 + p.rgba.b * 7 + p.rgba.a * 11) % 64;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static bool has_extension(const char *file_name, const char *ext)
+{
+    const size_t len = strlen(file_name), ext_len = strlen(ext);
+    if (len < ext_len) return false;
+    const char *p = file_name + len - ext_len;
+    for (size_t i = 0; i < ext_len; i++) {
+        if (tolower((unsigned char)p[i]) != ext[i]) return false;
+    }
+    return true;
+}
+
+ImageFormat image_format_for(const char *file_name)
+{
+    if (has_extension(file_name, ".qoi")) return IMAGE_QOI;
+    if (has_extension(file_name, ".ppm")) return IMAGE_PPM;
+    if (has_extension(file_name, ".pam")) return IMAGE_PAM;
+    return IMAGE_PNG;
+}
+
+uint8_t *qoi_encode(const uint8_t *pixels, int w, int h, size_t *size)
+{
+    const size_t count = (size_t)w * h;
+    // Worst case every pixel is a QOI_OP_RGBA
+    uint8_t *out = malloc(QOI_HEADER_SIZE + count * 5 + sizeof(qoi_padding));
+    if (!out) return NULL;
+
+    uint8_t *p = out;
+    memcpy(p, "qoif", 4);
+    put_u32(p + 4, w);
+    put_u32(p + 8, h);
+    p[12] = 4; // RGBA
+    p[13] = 0; // sRGB with linear alpha
+    p += QOI_HEADER_SIZE;
+
+    QoiPixel index[64] = { 0 };
+    QoiPixel prev = { .rgba = { 0, 0, 0, 255 } };
+    int run = 0;
+    for (size_t i = 0; i < count; i++) {
+        QoiPixel px;
+        memcpy(&px, &pixels[i * 4], 4);
+        if (px.v == prev.v) {
+            if (++run == QOI_MAX_RUN) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *p++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        const int hash = qoi_hash(px);
+        if (index[hash].v == px.v) {
+            *p++ = QOI_OP_INDEX | hash;
+        } else if (px.rgba.a != prev.rgba.a) {
+            index[hash] = px;
+            *p++ = QOI_OP_RGBA;
+            memcpy(p, &px, 4);
+            p += 4;
+        } else {
+            index[hash] = px;
+            const int8_t dr = px.rgba.r - prev.rgba.r;
+            const int8_t dg = px.rgba.g - prev.rgba.g;
+            const int8_t db = px.rgba.b - prev.rgba.b;
+            const int8_t dr_dg = dr - dg;
+            const int8_t db_dg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                *p++ = QOI_OP_LUMA | (dg + 32);
+                *p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+            } else {
+                *p++ = QOI_OP_RGB;
+                *p++ = px.rgba.r;
+                *p++ = px.rgba.g;
+                *p++ = px.rgba.b;
+            }
+        }
+        prev = px;
+    }
+    if (run > 0) *p++ = QOI_OP_RUN | (run - 1);
+    memcpy(p, qoi_padding, sizeof(qoi_padding));
+    p += sizeof(qoi_padding);
+
+    *size = p - out;
+    return out;
+}
+
+uint8_t *qoi_decode(const uint8_t *data, size_t size, int *w, int *h)
+{
+    if (size < QOI_HEADER_SIZE + sizeof(qoi_padding) || memcmp(data, "qoif", 4) != 0) return NULL;
+    const uint32_t width = get_u32(data + 4), height = get_u32(data + 8);
+    if (width == 0 || height == 0 || height > QOI_MAX_PIXELS / width) return NULL;
+
+    const size_t count = (size_t)width * height;
+    uint8_t *pixels = malloc(count * 4);
+    if (!pixels) return NULL;
+
+    QoiPixel index[64] = { 0 };
+    QoiPixel px = { .rgba = { 0, 0, 0, 255 } };
+    const size_t end = size - sizeof(qoi_padding);
+    size_t pos = QOI_HEADER_SIZE;
+    int run = 0;
+    size_t i = 0;
+    for (; i < count; i++) {
+        if (run > 0) {
+            run--;
+        } else if (pos < end) {
+            const uint8_t b1 = data[pos++];
+            if (b1 == QOI_OP_RGB) {
+                if (pos + 3 > end) break;
+                px.rgba.r = data[pos++];
+                px.rgba.g = data[pos++];
+                px.rgba.b = data[pos++];
+            } else if (b1 == QOI_OP_RGBA) {
+                if (pos + 4 > end) break;
+                memcpy(&px, &data[pos], 4);
+                pos += 4;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                px = index[b1];
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                px.rgba.r += ((b1 >> 4) & 3) - 2;
+                px.rgba.g += ((b1 >> 2) & 3) - 2;
+                px.rgba.b += (b1 & 3) - 2;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                if (pos >= end) break;
+                const uint8_t b2 = data[pos++];
+                const int dg = (b1 & 0x3f) - 32;
+                px.rgba.r += dg - 8 + ((b2 >> 4) & 0x0f);
+                px.rgba.g += dg;
+                px.rgba.b += dg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+            index[qoi_hash(px)] = px;
+        }
+        memcpy(&pixels[i * 4], &px, 4);
+    }
+    // A truncated file repeats its last pixel to the end
+    for (; i < count; i++) memcpy(&pixels[i * 4], &px, 4);
+    *w = width;
+    *h = height;
+    return pixels;
+}
+
+bool write_qoi(const char *file_name, const uint8_t *pixels, int w, int h)
+{
+    size_t size;
+    uint8_t *data = qoi_encode(pixels, w, h, &size);
+    if (!data) return false;
+    FILE *file = fopen(file_name, "wb");
+    bool ok = file && fwrite(data, 1, size, file) == size;
+    if (file) ok = fclose(file) == 0 && ok;
+    free(data);
+    return ok;
+}
+
+uint8_t *read_qoi(const char *file_name, int *w, int *h)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file) return NULL;
+    uint8_t *pixels = NULL;
+    long size;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        uint8_t *data = malloc(size);
+        if (data && fread(data, 1, size, file) == (size_t)size) {
+            pixels = qoi_decode(data, size, w, h);
+        }
+        free(data);
+    }
+    fclose(file);
+    return pixels;
+}
+
+bool write_ppm(const char *file_name, const uint8_t *pixels, int w, int h)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file) return false;
+    bool ok = fprintf(file, "P6\n%d %d\n255\n", w, h) > 0;
+    uint8_t *row = malloc((size_t)w * 3);
+    for (int y = 0; ok && row && y < h; y++) {
+        const uint8_t *src = &pixels[(size_t)y * w * 4];
+        for (int x = 0; x < w; x++) {
+            row[x * 3 + 0] = src[x * 4 + 0];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 2];
+        }
+        ok = fwrite(row, 3, w, file) == (size_t)w;
+    }
+    ok = row && ok;
+    free(row);
+    return fclose(file) == 0 && ok;
+}
+
+bool write_pam(const char *file_name, const uint8_t *pixels, int w, int h)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file) return false;
+    const size_t bytes = (size_t)w * h * 4;
+    bool ok = fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", w, h) > 0
+              && fwrite(pixels, 1, bytes, file) == bytes;
+    return fclose(file) == 0 && ok;
+}
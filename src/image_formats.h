@@ -0,0 +1,32 @@
+/**
+ * Lossless image files that are quicker to write than PNG, for dumping
+ * frame sequences. QOI compresses screen content nearly as well as PNG at
+ * a fraction of the CPU time; PPM and PAM are raw pixels behind a header.
+ * QOI sequences can be turned into PNGs afterwards (bubbl --convert).
+ */
+
+#ifndef IMAGE_FORMATS_H
+#define IMAGE_FORMATS_H
+#include "common.h"
+
+typedef enum {
+    IMAGE_PNG = 0,
+    IMAGE_QOI,
+    IMAGE_PPM, // RGB, alpha is dropped
+    IMAGE_PAM, // RGBA
+} ImageFormat;
+
+// By extension, anything unknown is PNG
+ImageFormat image_format_for(const char *file_name);
+
+// All take RGBA pixels, top row first
+uint8_t *qoi_encode(const uint8_t *pixels, int w, int h, size_t *size);
+bool write_qoi(const char *file_name, const uint8_t *pixels, int w, int h);
+bool write_ppm(const char *file_name, const uint8_t *pixels, int w, int h);
+bool write_pam(const char *file_name, const uint8_t *pixels, int w, int h);
+
+// Returns malloc'd RGBA pixels or NULL
+uint8_t *qoi_decode(const uint8_t *data, size_t size, int *w, int *h);
+uint8_t *read_qoi(const char *file_name, int *w, int *h);
+
+#endif // IMAGE_FORMATS_H
@@ -0,0 +1,321 @@
+/*
+ * A cache file is a CacheHeader followed by the pixels. The header repeats
+ * the hash it's named after, so a file from a colliding name or an older
+ * layout is decoded over rather than trusted.
+ */
+
+#include "image_loader.h"
+#include "disk_cache.h"
+#include "image_formats.h"
+#include "worker_pool.h"
+#include <SDL.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CACHE_VERSION 1
+#define CACHE_PATH_SIZE 512
+// Leaves room in a path for "/<16 hex digits>.rgba"
+#define CACHE_DIR_SIZE (CACHE_PATH_SIZE - 32)
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint64_t hash;
+} CacheHeader;
+
+typedef enum {
+    JOB_FREE = 0,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+} JobState;
+
+typedef struct {
+    int handle;
+    char *path;
+} LoadJob;
+
+static struct {
+    WorkerPool *pool;
+    SDL_mutex *lock;
+    char cache_dir[CACHE_DIR_SIZE];
+    struct {
+        JobState state;
+        Image *image;
+    } jobs[IMAGE_LOADER_MAX_JOBS];
+} loader = { 0 };
+
+// Whole file, read only. Mapped where there's mmap, read in otherwise.
+static uint8_t *map_file(const char *path, size_t *size, bool writable)
+{
+#ifdef _WIN32
+    (void)writable;
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    const long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = length > 0 ? malloc(length) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        // Private, writes to the pixels stay in this process
+        data = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+    }
+    close(fd);
+    *size = st.st_size;
+    return data;
+#endif
+}
+
+static void unmap_file(void *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+static void flip_rows(Pixel *pixels, int w, int h)
+{
+    Pixel *row = malloc(w * sizeof(Pixel));
+    for (int y = 0; y < h / 2; y++) {
+        Pixel *top = &pixels[(size_t)y * w], *bottom = &pixels[(size_t)(h - 1 - y) * w];
+        memcpy(row, top, w * sizeof(Pixel));
+        memcpy(top, bottom, w * sizeof(Pixel));
+        memcpy(bottom, row, w * sizeof(Pixel));
+    }
+    free(row);
+}
+
+static Pixel *decode(const char *path, const uint8_t *data, size_t size, int *w, int *h)
+{
+    if (size >= 4 && memcmp(data, "qoif", 4) == 0) {
+        Pixel *pixels = (Pixel *)qoi_decode(data, size, w, h);
+        if (!pixels) fprintf(stderr, "WARNING: unable to decode %s\n", path);
+        else flip_rows(pixels, *w, *h);
+        return pixels;
+    }
+    png_image image = { .version = PNG_IMAGE_VERSION };
+    if (!png_image_begin_read_from_memory(&image, data, size)) {
+        fprintf(stderr, "WARNING: unable to decode %s: %s\n", path, image.message);
+        return NULL;
+    }
+    image.format = PNG_FORMAT_RGBA;
+    Pixel *pixels = malloc(PNG_IMAGE_SIZE(image));
+    // A negative stride has libpng write the bottom row first
+    const png_int_32 stride = -(png_int_32)PNG_IMAGE_ROW_STRIDE(image);
+    if (!pixels || !png_image_finish_read(&image, NULL, pixels, stride, NULL)) {
+        fprintf(stderr, "WARNING: unable to decode %s: %s\n", path, image.message);
+        png_image_free(&image);
+        free(pixels);
+        return NULL;
+    }
+    *w = image.width;
+    *h = image.height;
+    return pixels;
+}
+
+static Image *open_cached(const char *cache_path, uint64_t hash)
+{
+    size_t size = 0;
+    uint8_t *data = map_file(cache_path, &size, true);
+    if (!data) return NULL;
+    CacheHeader header;
+    memcpy(&header, data, MIN(size, sizeof(header)));
+    if (size < sizeof(header) || memcmp(header.magic, "BUBI", 4) != 0 || header.version != CACHE_VERSION
+        || header.hash != hash || size != sizeof(header) + (size_t)header.width * header.height * sizeof(Pixel)) {
+        unmap_file(data, size);
+        return NULL;
+    }
+    Image *image = calloc(1, sizeof(Image));
+    image->width = header.width;
+    image->height = header.height;
+    image->pixels = (Pixel *)(data + sizeof(header));
+    image->cached = true;
+    image->mapping = data;
+    image->mapping_size = size;
+    return image;
+}
+
+static void write_cache(const char *cache_path, uint64_t hash, const Image *image)
+{
+    const CacheHeader header = { { 'B', 'U', 'B', 'I' }, CACHE_VERSION, image->width, image->height, hash };
+    cache_write(cache_path, &header, sizeof(header), image->pixels, (size_t)image->width * image->height * sizeof(Pixel));
+}
+
+Image *image_load(const char *path)
+{
+    const uint64_t start = SDL_GetPerformanceCounter();
+    size_t size = 0;
+    uint8_t *data = map_file(path, &size, false);
+    if (!data) {
+        fprintf(stderr, "WARNING: unable to read image %s\n", path);
+        return NULL;
+    }
+    const uint64_t hash = cache_hash(data, size, 0);
+    char cache_path[CACHE_PATH_SIZE] = "";
+    if (loader.cache_dir[0]) {
+        snprintf(cache_path, sizeof(cache_path), "%s/%016llx.rgba", loader.cache_dir, (unsigned long long)hash);
+    }
+
+    Image *image = cache_path[0] ? open_cached(cache_path, hash) : NULL;
+    if (!image) {
+        int w = 0, h = 0;
+        Pixel *pixels = decode(path, data, size, &w, &h);
+        if (pixels) {
+            image = calloc(1, sizeof(Image));
+            *image = (Image){ .width = w, .height = h, .pixels = pixels };
+            if (cache_path[0]) write_cache(cache_path, hash, image);
+        }
+    }
+    unmap_file(data, size);
+    if (image) {
+        image->load_ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    }
+    return image;
+}
+
+void image_free(Image *image)
+{
+    if (!image) return;
+    if (image->mapping) {
+        unmap_file(image->mapping, image->mapping_size);
+    } else {
+        free(image->pixels);
+    }
+    free(image);
+}
+
+bool image_loader_init(const char *cache_dir, int threads)
+{
+    if (loader.pool) return true;
+    const int length = snprintf(loader.cache_dir, sizeof(loader.cache_dir), "%s", cache_dir ? cache_dir : "");
+    if (length >= (int)sizeof(loader.cache_dir)) {
+        fprintf(stderr, "WARNING: image cache path %s is too long, images aren't cached\n", cache_dir);
+        loader.cache_dir[0] = '\0';
+    }
+    if (loader.cache_dir[0]) cache_make_dirs(loader.cache_dir);
+    loader.lock = SDL_CreateMutex();
+    // Loads are never dropped, every handle gets its image or a failure
+    loader.pool = worker_pool_new("bubbl images", MAX(threads, 1), IMAGE_LOADER_MAX_JOBS, BACKPRESSURE_GROW);
+    return loader.pool != NULL;
+}
+
+void image_loader_shutdown(void)
+{
+    if (!loader.pool) return;
+    worker_pool_free(loader.pool);
+    loader.pool = NULL;
+    for (int i = 0; i < IMAGE_LOADER_MAX_JOBS; i++) {
+        image_free(loader.jobs[i].image);
+        loader.jobs[i].image = NULL;
+        loader.jobs[i].state = JOB_FREE;
+    }
+    SDL_DestroyMutex(loader.lock);
+    loader.lock = NULL;
+}
+
+static bool load_job(void *arg)
+{
+    LoadJob *job = arg;
+    Image *image = image_load(job->path);
+    SDL_LockMutex(loader.lock);
+    loader.jobs[job->handle].image = image;
+    loader.jobs[job->handle].state = image ? JOB_DONE : JOB_FAILED;
+    SDL_UnlockMutex(loader.lock);
+    free(job->path);
+    free(job);
+    return image != NULL;
+}
+
+// Images are handed out through the handles, the pool's results are only
+// taken so they don't pile up
+static void drain_results(void)
+{
+    WorkResult results[16];
+    while (worker_pool_poll(loader.pool, results, 16) == 16)
+        ;
+}
+
+int image_load_async(const char *path)
+{
+    if (!loader.pool) return -1;
+    drain_results();
+    int handle = -1;
+    SDL_LockMutex(loader.lock);
+    for (int i = 0; i < IMAGE_LOADER_MAX_JOBS; i++) {
+        if (loader.jobs[i].state == JOB_FREE) {
+            loader.jobs[i].state = JOB_RUNNING;
+            handle = i;
+            break;
+        }
+    }
+    SDL_UnlockMutex(loader.lock);
+    if (handle < 0) return -1;
+
+    LoadJob *job = malloc(sizeof(LoadJob));
+    job->handle = handle;
+    const size_t len = strlen(path) + 1;
+    job->path = malloc(len);
+    memcpy(job->path, path, len);
+    if (worker_pool_submit(loader.pool, load_job, job) < 0) {
+        free(job->path);
+        free(job);
+        SDL_LockMutex(loader.lock);
+        loader.jobs[handle].state = JOB_FREE;
+        SDL_UnlockMutex(loader.lock);
+        return -1;
+    }
+    return handle;
+}
+
+ImageLoadStatus image_load_status(int handle)
+{
+    assert(handle >= 0 && handle < IMAGE_LOADER_MAX_JOBS);
+    if (loader.pool) drain_results();
+    SDL_LockMutex(loader.lock);
+    const JobState state = loader.jobs[handle].state;
+    SDL_UnlockMutex(loader.lock);
+    switch (state) {
+        case JOB_DONE: return IMAGE_LOAD_READY;
+        case JOB_FAILED: return IMAGE_LOAD_FAILED;
+        default: return IMAGE_LOAD_PENDING;
+    }
+}
+
+Image *image_take(int handle)
+{
+    assert(handle >= 0 && handle < IMAGE_LOADER_MAX_JOBS);
+    SDL_LockMutex(loader.lock);
+    Image *image = NULL;
+    if (loader.jobs[handle].state == JOB_DONE || loader.jobs[handle].state == JOB_FAILED) {
+        image = loader.jobs[handle].image;
+        loader.jobs[handle].image = NULL;
+        loader.jobs[handle].state = JOB_FREE;
+    }
+    SDL_UnlockMutex(loader.lock);
+    return image;
+}
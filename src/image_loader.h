@@ -0,0 +1,51 @@
+/**
+ * Loading PNG and QOI images for canvases, on a pool of worker threads.
+ *
+ * Decoded pixels are kept in a disk cache as raw RGBA, one file per image
+ * named after a hash of the file's contents. Loading an image that's in
+ * the cache maps that file instead of decoding it again, so the pixels are
+ * only paged in as they're read. Mapped pixels are private: writing to them
+ * never changes the cache.
+ *
+ * Rows are bottom first, like canvases.
+ */
+
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+#include "common.h"
+
+#define IMAGE_LOADER_MAX_JOBS 64
+
+typedef struct {
+    int width, height;
+    Pixel *pixels;
+    bool cached;       // Mapped from the disk cache rather than decoded
+    float load_ms;
+    // Where the pixels came from, for image_free
+    void *mapping;
+    size_t mapping_size;
+} Image;
+
+typedef enum {
+    IMAGE_LOAD_PENDING = 0,
+    IMAGE_LOAD_READY,
+    IMAGE_LOAD_FAILED,
+} ImageLoadStatus;
+
+// `cache_dir` is created if needed, NULL or "" doesn't cache. Calling this
+// again once running has no effect.
+bool image_loader_init(const char *cache_dir, int threads);
+// Waits for queued images, then frees any nobody took
+void image_loader_shutdown(void);
+
+// On the calling thread, NULL if it couldn't be read
+Image *image_load(const char *path);
+void image_free(Image *image);
+
+// Returns a job handle, or -1 if too many are in flight
+int image_load_async(const char *path);
+ImageLoadStatus image_load_status(int job);
+// Take the image of a finished job, freeing the handle. NULL if it failed.
+Image *image_take(int job);
+
+#endif // IMAGE_LOADER_H
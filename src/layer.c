@@ -0,0 +1,222 @@
+/*
+ * Everything that touches GL is recorded, so beginning and ending a layer
+ * lands between the draws around it. What to go back to (framebuffers,
+ * viewport, view) is only known on the GL thread and is kept in the layer
+ * until its end is replayed.
+ */
+
+#include "layer.h"
+#include "background_renderer.h"
+#include "gpu_resources.h"
+#include "render_thread.h"
+#include "render_view.h"
+#include "renderer_defs.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Layer {
+    int width, height;
+    int scene_width, scene_height;
+    GLuint framebuffer, texture;
+    GpuHandle texture_handle, framebuffer_handle;
+
+    // Lua thread only
+    bool valid;
+    bool drawing;
+    LayerStats stats;
+
+    // GL thread only, while drawing into it
+    GLint previous_draw, previous_read;
+    GLint previous_viewport[4];
+    GLfloat previous_clear[4];
+    RenderView previous_view;
+};
+
+typedef struct {
+    Layer *layer;
+    Color clear;
+} LayerStart;
+
+// GL thread, layers open for drawing
+static int open_layers = 0;
+
+static void create_target(void *arg)
+{
+    Layer *layer = arg;
+    // Layers can be made part way through drawing a frame
+    GLint draw, read;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read);
+    layer->texture = bg_new_texture(NULL, layer->width, layer->height);
+    glGenFramebuffers(1, &layer->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, layer->framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, layer->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "WARNING: unable to build %dx%d layer framebuffer\n", layer->width, layer->height);
+    }
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, read);
+}
+
+static void make_target(Layer *layer)
+{
+    render_thread_invoke(create_target, layer);
+    layer->texture_handle = gpu_register(GPU_TEXTURE, layer->texture,
+                                         (uint64_t)layer->width * layer->height * sizeof(Pixel),
+                                         NULL, "layer", true);
+    layer->framebuffer_handle = gpu_register(GPU_FRAMEBUFFER, layer->framebuffer, 0, NULL, "layer", false);
+}
+
+Layer *layer_new(int width, int height, int scene_width, int scene_height)
+{
+    if (width <= 0 || height <= 0 || scene_width <= 0 || scene_height <= 0) {
+        fprintf(stderr, "WARNING: invalid layer size %dx%d\n", width, height);
+        return NULL;
+    }
+    Layer *layer = calloc(1, sizeof(Layer));
+    layer->width = width;
+    layer->height = height;
+    layer->scene_width = scene_width;
+    layer->scene_height = scene_height;
+    make_target(layer);
+    return layer;
+}
+
+static void free_layer(void *payload)
+{
+    free(*(Layer **)payload);
+}
+
+void layer_free(Layer *layer)
+{
+    if (!layer) return;
+    gpu_release(layer->texture_handle);
+    gpu_release(layer->framebuffer_handle);
+    // Commands already recorded still use the layer
+    if (render_thread_active()) {
+        render_thread_record_copy(free_layer, &layer, sizeof(layer));
+        return;
+    }
+    free_layer(&layer);
+}
+
+bool layer_valid(Layer *layer)
+{
+    return layer->valid && gpu_alive(layer->texture_handle);
+}
+
+void layer_invalidate(Layer *layer)
+{
+    layer->valid = false;
+}
+
+static void bind_layer(void *payload)
+{
+    const LayerStart *start = payload;
+    Layer *layer = start->layer;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &layer->previous_draw);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &layer->previous_read);
+    glGetIntegerv(GL_VIEWPORT, layer->previous_viewport);
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, layer->previous_clear);
+    layer->previous_view = render_view_exchange((RenderView){
+        .x = 0, .y = 0,
+        .width = layer->scene_width, .height = layer->scene_height,
+        .scene_width = layer->scene_width, .scene_height = layer->scene_height,
+        .target_width = layer->width, .target_height = layer->height,
+    });
+
+    glBindFramebuffer(GL_FRAMEBUFFER, layer->framebuffer);
+    glViewport(0, 0, layer->width, layer->height);
+    glClearColor(start->clear.r, start->clear.g, start->clear.b, start->clear.a);
+    glClear(GL_COLOR_BUFFER_BIT);
+    // Keep the colour premultiplied and the alpha as coverage, so the
+    // layer can be composited with GL_ONE
+    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    open_layers++;
+}
+
+static void unbind_layer(void *payload)
+{
+    Layer *layer = *(Layer **)payload;
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, layer->previous_draw);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, layer->previous_read);
+    glViewport(layer->previous_viewport[0], layer->previous_viewport[1],
+               layer->previous_viewport[2], layer->previous_viewport[3]);
+    glClearColor(layer->previous_clear[0], layer->previous_clear[1],
+                 layer->previous_clear[2], layer->previous_clear[3]);
+    render_view_exchange(layer->previous_view);
+    if (--open_layers == 0) {
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+}
+
+bool layer_begin(Layer *layer, Color clear)
+{
+    if (layer->drawing) {
+        fprintf(stderr, "WARNING: layer is already being drawn into\n");
+        return false;
+    }
+    if (!gpu_alive(layer->texture_handle)) {
+        // Evicted, or released with its owner. The framebuffer goes with it.
+        gpu_release(layer->framebuffer_handle);
+        make_target(layer);
+        layer->stats.recreated++;
+    }
+    gpu_touch(layer->texture_handle);
+    layer->drawing = true;
+    layer->valid = false;
+
+    // Whatever was submitted before belongs to the frame
+    flush_renderers();
+    const LayerStart start = { layer, clear };
+    if (render_thread_active()) {
+        render_thread_record_copy(bind_layer, &start, sizeof(start));
+        return true;
+    }
+    bind_layer((void *)&start);
+    return true;
+}
+
+void layer_end(Layer *layer)
+{
+    if (!layer->drawing) return;
+    flush_renderers();
+    if (render_thread_active()) {
+        render_thread_record_copy(unbind_layer, &layer, sizeof(layer));
+    } else {
+        unbind_layer(&layer);
+    }
+    layer->drawing = false;
+    layer->valid = true;
+    layer->stats.renders++;
+}
+
+static void composite(void *payload)
+{
+    const GLuint texture = *(GLuint *)payload;
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    bg_draw_texture(texture, NULL, 0, 0, 0, 0, 0);
+    if (open_layers > 0) {
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    } else {
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+}
+
+void layer_draw(Layer *layer)
+{
+    if (layer->drawing || !layer->valid || !gpu_touch(layer->texture_handle)) return;
+    // Entities submitted before go under it
+    flush_renderers();
+    layer->stats.draws++;
+    if (render_thread_active()) {
+        render_thread_record_copy(composite, &layer->texture, sizeof(GLuint));
+        return;
+    }
+    composite(&layer->texture);
+}
+
+LayerStats layer_stats(Layer *layer)
+{
+    return layer->stats;
+}
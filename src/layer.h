@@ -0,0 +1,47 @@
+/**
+ * Layers: offscreen targets for caching parts of the scene that rarely
+ * change.
+ *
+ * Between layer_begin and layer_end, entities and background shaders are
+ * drawn into the layer's texture instead of the frame, with a render view
+ * showing the whole scene. After that the layer is composited with a single
+ * textured quad each frame until it's invalidated. A layer smaller than the
+ * scene is drawn at that lower resolution and stretched when composited.
+ *
+ * The texture holds premultiplied alpha, so what's drawn into a layer
+ * cleared to transparent blends over the frame like it would have been
+ * drawn there directly. Its texture is cached in the GPU registry: if it's
+ * evicted the layer is no longer valid and is made again by the next
+ * layer_begin.
+ */
+
+#ifndef LAYER_H
+#define LAYER_H
+#include "common.h"
+
+typedef struct {
+    int renders;   // Times it was drawn into
+    int draws;     // Times it was composited
+    int recreated; // Times its texture had been evicted
+} LayerStats;
+
+typedef struct Layer Layer;
+
+// width x height pixels showing the whole scene
+Layer *layer_new(int width, int height, int scene_width, int scene_height);
+void layer_free(Layer *layer);
+// False until something has been drawn into it, and after it's invalidated
+// or its texture evicted
+bool layer_valid(Layer *layer);
+void layer_invalidate(Layer *layer);
+// Clears it and sends what's drawn next into it. Layers can be nested, but
+// not a layer inside itself. Returns false if it's already being drawn into.
+bool layer_begin(Layer *layer, Color clear);
+// Back to drawing wherever the frame was being drawn before, the layer is
+// valid from now on
+void layer_end(Layer *layer);
+// Composite it over the view, nothing if it isn't valid
+void layer_draw(Layer *layer);
+LayerStats layer_stats(Layer *layer);
+
+#endif // LAYER_H
@@ -20,7 +20,6 @@
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
 
-#include <png.h>
 
 #include "luajit.h"
 #include <lualib.h>
@@ -34,19 +33,58 @@
 #include "common.h"
 #include "renderer_defs.h"
 #include "background_renderer.h"
+#include "render_thread.h"
+#include "render_graph.h"
+#include "upload_context.h"
+#include "readback.h"
+#include "frame_stream.h"
+#include "png_writer.h"
+#include "image_loader.h"
+#include "startup_timeline.h"
+#include "gpu_resources.h"
 
 // We're first rendering to an intermediary color texture which must be done through
 // a Frame Buffer Object. This is then blit to the screen.
 // I think this is how people normally do things?
 // Anyways, we do this for two reasons:
-// 1. Post-processing effects (TODO)
+// 1. Post-processing effects (see render_graph.c)
 // 2. GIF generation doesn't require the screen or need to get
 //    ruined when e.g. screen is resized
+// When none of that is going on we skip it and draw straight to the
+// default framebuffer, saving a full window copy every frame.
 static GLuint intermediary_framebuffer = 0;
 static GLuint intermediary_color_texture = 0;
 
+// Lua thread: whether the frame being recorded draws to the intermediary
+static bool drawing_offscreen = true;
+static bool frame_in_progress = false;
+static bool post_processing_last_frame = false;
+// Number of users (e.g. GIF recordings) keeping us on the intermediary
+static int intermediary_holds = 0;
+// BUBBL_ALWAYS_OFFSCREEN, read when the window is made
+static bool always_offscreen = false;
+// GL thread: what the current frame is actually bound to
+static bool bound_offscreen = true;
+
+typedef struct {
+    int handle;
+    int w, h; // Output size
+    ReadbackFilter filter;
+    int window_w, window_h;
+    bool presented; // Of the final image, after post-processing
+} Capture;
+
+// Readbacks requested between frames, captured at the end of the next one
+static Capture pending_captures[READBACK_RING_SIZE];
+static int num_pending_captures = 0;
+
 // How about we just do everything in seconds please and thank you
-double get_time(void) { return SDL_GetTicks64() * 0.001; }
+// Set while rendering a poster so every tile sees the same moment
+static double frozen_time = -1;
+
+double get_time(void) { return frozen_time >= 0 ? frozen_time : SDL_GetTicks64() * 0.001; }
+
+void freeze_time(bool frozen) { frozen_time = frozen ? SDL_GetTicks64() * 0.001 : -1; }
 
 float scale;
 const float QUAD[] = { 1.0,  1.0, -1.0,  1.0, 1.0, -1.0, -1.0, -1.0 };
@@ -137,14 +175,43 @@ static void clear_screen(void) {
     glClear(GL_COLOR_BUFFER_BIT);
 }
 
-void start_drawing(SDL_Window *window) {
-    glBindFramebuffer(GL_FRAMEBUFFER, intermediary_framebuffer);
+void hold_intermediary_framebuffer(bool hold) {
+    intermediary_holds += hold ? 1 : -1;
+    assert(intermediary_holds >= 0);
+}
+
+static bool needs_intermediary(void) {
+    return intermediary_holds > 0
+        || post_processing_last_frame
+        || always_offscreen;
+}
+
+typedef struct {
     int w, h;
-    SDL_GetWindowSize(window, &w, &h);
-    glViewport(0,0,w,h);
+    bool offscreen;
+} FrameStart;
+
+static void begin_frame(void *payload) {
+    FrameStart *start = payload;
+    bound_offscreen = start->offscreen;
+    glBindFramebuffer(GL_FRAMEBUFFER, start->offscreen ? intermediary_framebuffer : 0);
+    glViewport(0, 0, start->w, start->h);
     clear_screen();
 }
 
+void start_drawing(SDL_Window *window) {
+    gpu_resources_next_frame();
+    FrameStart start;
+    SDL_GetWindowSize(window, &start.w, &start.h);
+    drawing_offscreen = start.offscreen = needs_intermediary();
+    frame_in_progress = true;
+    if (render_thread_active()) {
+        render_thread_record_copy(begin_frame, &start, sizeof(start));
+        return;
+    }
+    begin_frame(&start);
+}
+
 bool quit = false;
 bool should_quit(void) {
     return quit;
@@ -182,12 +249,73 @@ typedef struct {
     };
 } Event;
 
+typedef struct {
+    SDL_Window *window;
+    int w, h;
+} Resize;
+
+static void resize_targets(void *payload) {
+    Resize *resize = payload;
+    glViewport(0, 0, resize->w, resize->h);
+    allocate_intermediary_color_texture(resize->window);
+}
+
+/*
+ * Input-to-photon latency instrumentation.
+ * We remember the SDL timestamp of the oldest input event handled
+ * since the last present, and measure up to the end of the next swap.
+ */
+typedef struct {
+    int samples;
+    float last_ms;
+    float mean_ms;
+    float max_ms;
+} LatencyStats;
+
+static Uint32 oldest_input_timestamp = 0;
+static LatencyStats latency = { 0 };
+static SDL_mutex *latency_lock = NULL;
+
+static void note_input_event(Uint32 timestamp) {
+    if (oldest_input_timestamp == 0 || timestamp < oldest_input_timestamp) {
+        oldest_input_timestamp = timestamp;
+    }
+}
+
+static void record_latency(Uint32 input_timestamp) {
+    if (input_timestamp == 0) return;
+    const float ms = SDL_GetTicks() - input_timestamp;
+    // Presenting may be happening on the render thread
+    if (latency_lock) SDL_LockMutex(latency_lock);
+    latency.samples += 1;
+    latency.last_ms = ms;
+    latency.mean_ms += (ms - latency.mean_ms) / latency.samples;
+    latency.max_ms = MAX(latency.max_ms, ms);
+    if (latency_lock) SDL_UnlockMutex(latency_lock);
+}
+
+// Returns stats since the last call
+LatencyStats get_input_latency(void) {
+    if (latency_lock) SDL_LockMutex(latency_lock);
+    LatencyStats stats = latency;
+    latency = (LatencyStats){ 0 };
+    if (latency_lock) SDL_UnlockMutex(latency_lock);
+    return stats;
+}
+
 // Handles and/or return event
 Event poll_event(SDL_Window *window)
 {
     int w, h; SDL_GetWindowSize(window, &w, &h);
     SDL_Event e;
     while (SDL_PollEvent(&e)) {
+        switch (e.type) {
+        case SDL_KEYDOWN: case SDL_KEYUP:
+        case SDL_MOUSEBUTTONDOWN: case SDL_MOUSEBUTTONUP:
+        case SDL_MOUSEMOTION: case SDL_MOUSEWHEEL:
+            note_input_event(e.common.timestamp);
+            break;
+        }
         switch (e.type) {
         case SDL_QUIT:
             quit = true;
@@ -245,8 +373,12 @@ Event poll_event(SDL_Window *window)
         case SDL_WINDOWEVENT:
             if (e.window.event == SDL_WINDOWEVENT_RESIZED) {
                 SDL_GL_GetDrawableSize(window, &w, &h);
-                glViewport(0, 0, w, h);
-                allocate_intermediary_color_texture(window);
+                Resize resize = { window, w, h };
+                if (render_thread_active()) {
+                    render_thread_record_copy(resize_targets, &resize, sizeof(resize));
+                } else {
+                    resize_targets(&resize);
+                }
 
                 return (Event) {
                     .type = EVENT_RESIZE,
@@ -282,47 +414,120 @@ static void vertical_flip_pixels(uint8_t *pixels, int w, int h) {
     }
 }
 
+// The intermediary texture has no alpha channel so it always reads back
+// as opaque. The default framebuffer might, so match it when reading there.
+static void force_opaque_pixels(uint8_t *pixels, int w, int h) {
+    for (size_t i = 3; i < (size_t)w * h * 4; i += 4) {
+        pixels[i] = 0xFF;
+    }
+}
+
+typedef struct {
+    uint8_t *pixels;
+    int w, h;
+    bool from_backbuffer;
+} PixelRead;
+
+static void read_screen_pixels(void *arg) {
+    PixelRead *read = arg;
+    read->from_backbuffer = !bound_offscreen;
+    glReadPixels(0, 0, read->w, read->h, GL_RGBA, GL_UNSIGNED_BYTE, read->pixels);
+}
+
+static void read_framebuffer_pixels(void *arg) {
+    PixelRead *read = arg;
+    read->from_backbuffer = !bound_offscreen;
+    if (bound_offscreen) {
+        glBindTexture(GL_TEXTURE_2D, intermediary_color_texture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, read->pixels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    } else {
+        // This frame is being drawn straight to the (not yet swapped) back buffer
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glReadBuffer(GL_BACK);
+        glReadPixels(0, 0, read->w, read->h, GL_RGBA, GL_UNSIGNED_BYTE, read->pixels);
+    }
+}
+
+static void finish_pixel_read(PixelRead *read) {
+    vertical_flip_pixels(read->pixels, read->w, read->h);
+    if (read->from_backbuffer) force_opaque_pixels(read->pixels, read->w, read->h);
+}
+
 void get_screen_pixels(SDL_Window *window, uint8_t *pixels) {
     int w, h; SDL_GetWindowSize(window, &w, &h);
     flush_renderers();
-    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-    vertical_flip_pixels(pixels, w, h);
+    PixelRead read = { pixels, w, h, false };
+    render_thread_invoke(read_screen_pixels, &read);
+    finish_pixel_read(&read);
 }
 
 void get_framebuffer_pixels(SDL_Window *window, uint8_t *pixels) {
     (void)window;
     int w, h; SDL_GetWindowSize(window, &w, &h);
     flush_renderers();
-    glBindTexture(GL_TEXTURE_2D, intermediary_color_texture);
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-    vertical_flip_pixels(pixels, w, h);
+    PixelRead read = { pixels, w, h, false };
+    render_thread_invoke(read_framebuffer_pixels, &read);
+    finish_pixel_read(&read);
 }
 
-bool screenshot(SDL_Window *window, const char *file_name)
+static void capture_frame(void *payload)
 {
-    int w, h; SDL_GetWindowSize(window, &w, &h);
-    const int ncomps = 4;
-    const size_t stride = w * ncomps;
-    uint8_t *pixeldata = malloc(h * stride);
-
-    /* get_screen_pixels(window, pixeldata); */
-    get_framebuffer_pixels(window, pixeldata);
-
-    png_image image = {
-        .version = PNG_IMAGE_VERSION,
-        .opaque = NULL,
-        .width = w,
-        .height = h,
-        .format = PNG_FORMAT_RGBA,
-        .flags = 0,
-        .colormap_entries = 0,
-    };
+    Capture *capture = payload;
+    ReadbackSource source = { 0, 0, capture->window_w, capture->window_h };
+    // Passes writing to the screen leave the final image in the back buffer
+    if (bound_offscreen && !(capture->presented && render_graph_wrote_screen())) {
+        source.framebuffer = intermediary_framebuffer;
+        source.texture = intermediary_color_texture;
+    }
+    readback_capture(capture->handle, source, capture->w, capture->h, capture->filter);
+}
 
-    int ok = png_image_write_to_file (&image, file_name, 0,  pixeldata, 0, NULL);
+static void record_capture(SDL_Window *window, Capture capture)
+{
+    SDL_GetWindowSize(window, &capture.window_w, &capture.window_h);
+    if (capture.w <= 0 || capture.h <= 0) {
+        capture.w = capture.window_w;
+        capture.h = capture.window_h;
+    }
+    flush_renderers();
+    if (render_thread_active()) {
+        render_thread_record_copy(capture_frame, &capture, sizeof(capture));
+        return;
+    }
+    capture_frame(&capture);
+}
 
-    if (!ok) return false;
-    free(pixeldata);
-    return true;
+// Start copying the frame as drawn so far, without waiting for it.
+// It's filtered down to width x height on the GPU, or taken at the
+// window size if either is 0.
+// Returns a handle for readback_get, or -1 if too many are in flight.
+int request_frame_readback(SDL_Window *window, int width, int height, ReadbackFilter filter)
+{
+    const int handle = readback_request();
+    if (handle < 0) return -1;
+    Capture capture = { .handle = handle, .w = width, .h = height, .filter = filter };
+    if (frame_in_progress) {
+        record_capture(window, capture);
+        return handle;
+    }
+    // Between frames the last image may already be gone with the swap,
+    // so take it at the end of the next frame instead, as it's presented
+    capture.presented = true;
+    pending_captures[num_pending_captures++] = capture;
+    return handle;
+}
+
+static void finish_readbacks_now(void *arg)
+{
+    (void)arg;
+    readback_finish();
+}
+
+// Block until every capture so far can be taken
+void finish_readbacks(void)
+{
+    render_thread_invoke(finish_readbacks_now, NULL);
 }
 
 SDL_Window *create_window(const char *window_name, int width, int height)
@@ -337,9 +542,10 @@ SDL_Window *create_window(const char *window_name, int width, int height)
         fprintf(stderr, "error creating OpenGL context: %s\n", SDL_GetError());
         return NULL;
     }
+    startup_mark("window and GL context");
 
     int version = gladLoadGL((GLADloadfunc) SDL_GL_GetProcAddress);
-    printf("GL %d.%d\n", GLAD_VERSION_MAJOR(version), GLAD_VERSION_MINOR(version));
+    fprintf(stderr, "INFO: GL %d.%d\n", GLAD_VERSION_MAJOR(version), GLAD_VERSION_MINOR(version));
 
     if (getenv("USE_VSYNC")) {
         fprintf(stderr, "INFO: Attempting to set VSync\n");
@@ -370,14 +576,39 @@ SDL_Window *create_window(const char *window_name, int width, int height)
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glBlendEquation(GL_FUNC_ADD);
 
+    // Programs are submitted here and finished on first use, in between
+    // they compile alongside the rest of startup
+    shader_parallel_compile_init();
+    shader_cache_init(getenv("BUBBL_NO_SHADER_CACHE") ? NULL : "cache/shaders");
     init_renderers();
     bg_init();
+    startup_mark("shaders submitted");
     init_intermediary_framebuffer(window);
+    always_offscreen = getenv("BUBBL_ALWAYS_OFFSCREEN") != NULL;
+    readback_init();
+
+    latency_lock = SDL_CreateMutex();
+    if (!getenv("BUBBL_NO_UPLOAD_THREAD")) {
+        upload_context_init(window);
+    }
+    if (getenv("USE_RENDER_THREAD")) {
+        fprintf(stderr, "INFO: Submitting GL commands from a render thread\n");
+        render_thread_start(window, context);
+    }
+    startup_mark("window ready");
     return window;
 }
 
 void destroy_window(SDL_Window *window) 
 {
+    const ShaderCacheStats shaders = shader_cache_stats();
+    fprintf(stderr, "INFO: Shader cache %d hits, %d misses (%d rejected)\n", shaders.hits, shaders.misses, shaders.rejected);
+    upload_context_shutdown();
+    render_thread_stop();
+    readback_shutdown();
+    png_writer_shutdown();
+    image_loader_shutdown();
+    frame_stream_shutdown();
     SDL_GL_DeleteContext(SDL_GL_GetCurrentContext());
     SDL_DestroyWindow(window);
 }
@@ -398,18 +629,78 @@ Vector2 get_mouse_position(SDL_Window *window)
     return (Vector2){ x, height - y };
 }
 
-void update_screen(SDL_Window *window)
+// Pull in any pending OS input and re-sample the cursor.
+// Called right before flushing so that cursor-following
+// entities are drawn at the freshest possible position.
+Vector2 latch_mouse_position(SDL_Window *window)
 {
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, intermediary_framebuffer);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    SDL_PumpEvents();
+    return get_mouse_position(window);
+}
+
+typedef struct {
+    SDL_Window *window;
     int w, h;
-    SDL_GetWindowSize(window, &w, &h);
-    glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-    SDL_GL_SwapWindow(window);
+    Uint32 input_timestamp;
+} Present;
+
+static void present(void *payload)
+{
+    Present *p = payload;
+    // Post-processing passes may have already written the final image
+    if (bound_offscreen && !render_graph_wrote_screen()) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, intermediary_framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, p->w, p->h, 0, 0, p->w, p->h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+    SDL_GL_SwapWindow(p->window);
+    startup_presented();
+    record_latency(p->input_timestamp);
+    readback_update();
+}
+
+static void copy_backbuffer_to_intermediary(void *payload)
+{
+    FrameStart *size = payload;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, intermediary_framebuffer);
+    glBlitFramebuffer(0, 0, size->w, size->h, 0, 0, size->w, size->h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void update_screen(SDL_Window *window)
+{
+    Present p = { .window = window, .input_timestamp = oldest_input_timestamp };
+    oldest_input_timestamp = 0;
+    SDL_GetWindowSize(window, &p.w, &p.h);
+
+    post_processing_last_frame = render_graph_has_passes();
+    if (post_processing_last_frame && !drawing_offscreen) {
+        // Post-processing just started; the passes need the scene as a texture
+        FrameStart copy = { p.w, p.h, false };
+        if (render_thread_active()) {
+            render_thread_record_copy(copy_backbuffer_to_intermediary, &copy, sizeof(copy));
+        } else {
+            copy_backbuffer_to_intermediary(&copy);
+        }
+    }
+    render_graph_execute_frame(intermediary_color_texture, p.w, p.h);
+    for (int i = 0; i < num_pending_captures; i++) {
+        record_capture(window, pending_captures[i]);
+    }
+    num_pending_captures = 0;
+    frame_in_progress = false;
+    if (render_thread_active()) {
+        render_thread_record_copy(present, &p, sizeof(p));
+        render_thread_submit_frame();
+        return;
+    }
+    present(&p);
 }
 
 int main(int argc, char **argv) {
     (void)argc;
+    startup_mark("main");
 
     lua_State *L = luaL_newstate();
     luaL_openlibs(L);
@@ -421,6 +712,7 @@ int main(int argc, char **argv) {
     srand(time(NULL));
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
         return fprintf(stderr, "error initializing SDL: %s\n", SDL_GetError()), 1;
+    startup_mark("SDL");
 
     SDL_GL_SetAttribute( SDL_GL_CONTEXT_MAJOR_VERSION, 3 );
     SDL_GL_SetAttribute( SDL_GL_CONTEXT_MINOR_VERSION, 3 );
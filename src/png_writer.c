@@ -0,0 +1,143 @@
+#include "png_writer.h"
+#include "image_formats.h"
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+typedef struct {
+    char *file_name;
+    char *source; // QOI to convert, when there are no pixels
+    uint8_t *pixels;
+    int w, h;
+} PngJob;
+
+static WorkerPool *pool = NULL;
+
+bool write_png(const char *file_name, const uint8_t *pixels, int w, int h)
+{
+    png_image image = {
+        .version = PNG_IMAGE_VERSION,
+        .opaque = NULL,
+        .width = w,
+        .height = h,
+        .format = PNG_FORMAT_RGBA,
+        .flags = 0,
+        .colormap_entries = 0,
+    };
+    return png_image_write_to_file(&image, file_name, 0, pixels, 0, NULL);
+}
+
+uint8_t *encode_png(const uint8_t *pixels, int w, int h, size_t *size)
+{
+    png_image image = {
+        .version = PNG_IMAGE_VERSION,
+        .width = w,
+        .height = h,
+        .format = PNG_FORMAT_RGBA,
+        .flags = PNG_IMAGE_FLAG_FAST,
+    };
+    png_alloc_size_t bytes = PNG_IMAGE_PNG_SIZE_MAX(image);
+    uint8_t *png = malloc(bytes);
+    if (!png || !png_image_write_to_memory(&image, png, &bytes, 0, pixels, 0, NULL)) {
+        free(png);
+        return NULL;
+    }
+    *size = bytes;
+    // The bound is about the size of the raw pixels, give the rest back
+    uint8_t *trimmed = realloc(png, bytes);
+    return trimmed ? trimmed : png;
+}
+
+bool write_image(const char *file_name, const uint8_t *pixels, int w, int h)
+{
+    switch (image_format_for(file_name)) {
+    case IMAGE_QOI: return write_qoi(file_name, pixels, w, h);
+    case IMAGE_PPM: return write_ppm(file_name, pixels, w, h);
+    case IMAGE_PAM: return write_pam(file_name, pixels, w, h);
+    case IMAGE_PNG: break;
+    }
+    return write_png(file_name, pixels, w, h);
+}
+
+static void free_job(PngJob *job)
+{
+    free(job->file_name);
+    free(job->source);
+    free(job->pixels);
+    free(job);
+}
+
+static bool run_png_job(void *arg)
+{
+    PngJob *job = arg;
+    if (job->source) {
+        job->pixels = read_qoi(job->source, &job->w, &job->h);
+        if (!job->pixels) {
+            fprintf(stderr, "WARNING: unable to read QOI %s\n", job->source);
+            free_job(job);
+            return false;
+        }
+    }
+    const bool ok = write_image(job->file_name, job->pixels, job->w, job->h);
+    if (!ok) fprintf(stderr, "WARNING: unable to write %s\n", job->file_name);
+    free_job(job);
+    return ok;
+}
+
+bool png_writer_init(int threads, int queue_size, Backpressure backpressure)
+{
+    if (pool) return true;
+    pool = worker_pool_new("bubbl png", threads, queue_size, backpressure);
+    return pool != NULL;
+}
+
+void png_writer_shutdown(void)
+{
+    if (!pool) return;
+    worker_pool_free(pool);
+    pool = NULL;
+}
+
+static char *copy_string(const char *s)
+{
+    const size_t len = strlen(s) + 1;
+    char *copy = malloc(len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+static int submit(PngJob *job)
+{
+    assert(pool && "png_writer_init must be called first");
+    const int id = worker_pool_submit(pool, run_png_job, job);
+    if (id < 0) {
+        fprintf(stderr, "WARNING: PNG queue full, dropping %s\n", job->file_name);
+        free_job(job);
+    }
+    return id;
+}
+
+int png_write_async(const char *file_name, uint8_t *pixels, int w, int h)
+{
+    PngJob *job = malloc(sizeof(PngJob));
+    *job = (PngJob){ copy_string(file_name), NULL, pixels, w, h };
+    return submit(job);
+}
+
+int png_convert_async(const char *source, const char *file_name)
+{
+    PngJob *job = malloc(sizeof(PngJob));
+    *job = (PngJob){ copy_string(file_name), copy_string(source), NULL, 0, 0 };
+    return submit(job);
+}
+
+int png_writer_poll(WorkResult *results, int max)
+{
+    return pool ? worker_pool_poll(pool, results, max) : 0;
+}
+
+WorkerPoolStats png_writer_stats(void)
+{
+    return pool ? worker_pool_stats(pool) : (WorkerPoolStats){ 0 };
+}
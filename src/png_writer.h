@@ -0,0 +1,32 @@
+/**
+ * Encoding and writing PNGs on a pool of worker threads,
+ * so saving a frame doesn't hitch the frame after it.
+ * Files named .qoi, .ppm or .pam are written in that format instead.
+ */
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+#include "common.h"
+#include "worker_pool.h"
+
+// Write RGBA pixels, top row first, on the calling thread
+bool write_png(const char *file_name, const uint8_t *pixels, int w, int h);
+// Picks the format by extension, see image_formats.h
+bool write_image(const char *file_name, const uint8_t *pixels, int w, int h);
+// Encode into memory, favouring speed over size. Returns a malloc'd PNG or NULL.
+uint8_t *encode_png(const uint8_t *pixels, int w, int h, size_t *size);
+
+// Calling this again once running has no effect
+bool png_writer_init(int threads, int queue_size, Backpressure backpressure);
+// Waits for queued files to be written
+void png_writer_shutdown(void);
+
+// Takes ownership of `pixels` (malloc'd) and frees them when written.
+// Returns a job id, or -1 if the write was dropped.
+int png_write_async(const char *file_name, uint8_t *pixels, int w, int h);
+// Reads a QOI and writes it as `file_name` on the pool
+int png_convert_async(const char *source, const char *file_name);
+int png_writer_poll(WorkResult *results, int max);
+WorkerPoolStats png_writer_stats(void);
+
+#endif // PNG_WRITER_H
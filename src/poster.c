@@ -0,0 +1,332 @@
+/*
+ * Tiles are drawn a row at a time, left to right, starting at the top of
+ * the poster. Captures are consumed in the order they were made, so a band
+ * is complete when the last tile of its row comes back. Bands go to a
+ * single writer thread, which keeps rows reaching libpng in order.
+ */
+
+#include "poster.h"
+#include "readback.h"
+#include "render_thread.h"
+#include "render_view.h"
+#include "renderer_defs.h"
+#include "worker_pool.h"
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define DEFAULT_TILE_SIZE 2048
+// Finished bands waiting for the writer before drawing blocks
+#define QUEUED_BANDS 1
+
+typedef struct {
+    int handle; // -1 if the tile couldn't be captured
+    int x, y;   // From the top left of the poster
+    int w, h;
+} Tile;
+
+typedef struct {
+    Poster *poster;
+    uint8_t *pixels;
+    int rows;
+} BandJob;
+
+struct Poster {
+    int width, height;
+    int scene_width, scene_height;
+    int tile_size;
+    int tiles_x, tiles_y;
+    int next_tile;
+    Tile drawing;
+
+    // Created on the GL thread
+    GLuint framebuffer, texture;
+
+    Tile pending[READBACK_RING_SIZE];
+    int num_pending;
+    uint8_t *band; // The current row of tiles, poster width
+    int band_tiles;
+
+    // The writer thread's once the file is open
+    FILE *file;
+    png_structp png;
+    png_infop info;
+    bool write_failed;
+    WorkerPool *writer;
+
+    PosterStats stats;
+};
+
+static void create_target(void *arg) {
+    Poster *poster = arg;
+    GLint max_texture = 0, max_viewport[2] = { 0 };
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture);
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, max_viewport);
+    poster->tile_size = MIN(poster->tile_size, MIN(max_texture, MIN(max_viewport[0], max_viewport[1])));
+    const int w = MIN(poster->tile_size, poster->width);
+    const int h = MIN(poster->tile_size, poster->height);
+
+    glGenTextures(1, &poster->texture);
+    glBindTexture(GL_TEXTURE_2D, poster->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &poster->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, poster->framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, poster->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "ERROR: unable to build poster tile framebuffer\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+typedef struct {
+    GLuint framebuffer, texture;
+} TargetNames;
+
+static void delete_target(void *payload) {
+    TargetNames *names = payload;
+    glDeleteFramebuffers(1, &names->framebuffer);
+    glDeleteTextures(1, &names->texture);
+}
+
+static bool open_png(Poster *poster, const char *path) {
+    poster->file = fopen(path, "wb");
+    if (!poster->file) {
+        fprintf(stderr, "ERROR: unable to open %s: %s\n", path, ERROR());
+        return false;
+    }
+    poster->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    poster->info = poster->png ? png_create_info_struct(poster->png) : NULL;
+    if (!poster->info || setjmp(png_jmpbuf(poster->png))) {
+        fprintf(stderr, "ERROR: unable to start writing %s\n", path);
+        png_destroy_write_struct(&poster->png, &poster->info);
+        fclose(poster->file);
+        return false;
+    }
+    png_init_io(poster->png, poster->file);
+    // Readbacks are always opaque, drop the alpha byte
+    png_set_IHDR(poster->png, poster->info, poster->width, poster->height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(poster->png, poster->info);
+    png_set_filler(poster->png, 0, PNG_FILLER_AFTER);
+    return true;
+}
+
+Poster *poster_open(const char *path, int width, int height, int scene_width, int scene_height, int tile_size) {
+    if (width <= 0 || height <= 0 || scene_width <= 0 || scene_height <= 0) {
+        fprintf(stderr, "ERROR: invalid poster size %dx%d\n", width, height);
+        return NULL;
+    }
+    Poster *poster = calloc(1, sizeof(Poster));
+    poster->width = width;
+    poster->height = height;
+    poster->scene_width = scene_width;
+    poster->scene_height = scene_height;
+    poster->tile_size = tile_size > 0 ? tile_size : DEFAULT_TILE_SIZE;
+    if (!open_png(poster, path)) {
+        free(poster);
+        return NULL;
+    }
+    render_thread_invoke(create_target, poster);
+    poster->tiles_x = (width + poster->tile_size - 1) / poster->tile_size;
+    poster->tiles_y = (height + poster->tile_size - 1) / poster->tile_size;
+    poster->band = calloc((size_t)width * MIN(poster->tile_size, height), 4);
+    poster->writer = worker_pool_new("bubbl poster", 1, QUEUED_BANDS, BACKPRESSURE_BLOCK);
+
+    poster->stats = (PosterStats){
+        .width = width, .height = height,
+        .tiles_x = poster->tiles_x, .tiles_y = poster->tiles_y,
+        .tile_size = poster->tile_size,
+    };
+    return poster;
+}
+
+static bool write_band(void *arg) {
+    BandJob *job = arg;
+    Poster *poster = job->poster;
+    bool ok = !poster->write_failed;
+    if (ok) {
+        if (setjmp(png_jmpbuf(poster->png))) {
+            poster->write_failed = true;
+            ok = false;
+        } else {
+            for (int row = 0; row < job->rows; row++) {
+                png_write_row(poster->png, &job->pixels[(size_t)row * poster->width * 4]);
+            }
+        }
+    }
+    free(job->pixels);
+    free(job);
+    return ok;
+}
+
+// Copy a captured tile into the band, handing the band to the writer once its row is done
+static void complete_tile(Poster *poster, const Tile *tile) {
+    ReadbackResult result;
+    if (tile->handle >= 0 && readback_get(tile->handle, &result)) {
+        for (int row = 0; row < tile->h; row++) {
+            memcpy(&poster->band[((size_t)row * poster->width + tile->x) * 4],
+                   &result.pixels[(size_t)row * tile->w * 4], (size_t)tile->w * 4);
+        }
+    }
+    if (tile->handle >= 0) readback_release(tile->handle);
+    poster->stats.tiles_done++;
+
+    if (++poster->band_tiles < poster->tiles_x) return;
+    BandJob *job = malloc(sizeof(BandJob));
+    *job = (BandJob){ poster, poster->band, tile->h };
+    worker_pool_submit(poster->writer, write_band, job);
+    poster->band = calloc((size_t)poster->width * MIN(poster->tile_size, poster->height), 4);
+    poster->band_tiles = 0;
+}
+
+static void update_captures(void *arg) {
+    const bool *wait = arg;
+    if (*wait) readback_finish();
+    else readback_update();
+}
+
+// Take the captured tiles that have come back, in order
+static void consume_tiles(Poster *poster, bool wait) {
+    if (poster->num_pending == 0) return;
+    render_thread_invoke(update_captures, &wait);
+    int done = 0;
+    ReadbackResult result;
+    while (done < poster->num_pending) {
+        const Tile *tile = &poster->pending[done];
+        if (tile->handle >= 0 && !readback_get(tile->handle, &result)) break;
+        complete_tile(poster, tile);
+        done++;
+    }
+    poster->num_pending -= done;
+    memmove(poster->pending, &poster->pending[done], poster->num_pending * sizeof(Tile));
+}
+
+typedef struct {
+    GLuint framebuffer;
+    int w, h;
+} TileStart;
+
+static void bind_tile(void *payload) {
+    TileStart *start = payload;
+    glBindFramebuffer(GL_FRAMEBUFFER, start->framebuffer);
+    glViewport(0, 0, start->w, start->h);
+    // Same as the window is cleared to
+    glClearColor(1.0, 1.0, 1.0, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+static Tile tile_at(const Poster *poster, int index) {
+    Tile tile = { .handle = -1 };
+    tile.x = index % poster->tiles_x * poster->tile_size;
+    tile.y = index / poster->tiles_x * poster->tile_size;
+    tile.w = MIN(poster->tile_size, poster->width - tile.x);
+    tile.h = MIN(poster->tile_size, poster->height - tile.y);
+    return tile;
+}
+
+bool poster_begin_tile(Poster *poster) {
+    if (poster->next_tile >= poster->tiles_x * poster->tiles_y) return false;
+    poster->drawing = tile_at(poster, poster->next_tile);
+    const Tile *tile = &poster->drawing;
+
+    TileStart start = { poster->framebuffer, tile->w, tile->h };
+    if (render_thread_active()) {
+        render_thread_record_copy(bind_tile, &start, sizeof(start));
+    } else {
+        bind_tile(&start);
+    }
+
+    // GL's origin is the bottom left, tiles count down from the top
+    const float scale_x = (float)poster->width / poster->scene_width;
+    const float scale_y = (float)poster->height / poster->scene_height;
+    render_view_set((RenderView){
+        .x = tile->x / scale_x,
+        .y = (poster->height - tile->y - tile->h) / scale_y,
+        .width = tile->w / scale_x,
+        .height = tile->h / scale_y,
+        .scene_width = poster->scene_width,
+        .scene_height = poster->scene_height,
+        .target_width = tile->w,
+        .target_height = tile->h,
+    });
+    return true;
+}
+
+typedef struct {
+    int handle;
+    ReadbackSource source;
+} TileCapture;
+
+static void capture_tile(void *payload) {
+    TileCapture *capture = payload;
+    readback_capture(capture->handle, capture->source, capture->source.width, capture->source.height,
+                     READBACK_LINEAR);
+}
+
+void poster_end_tile(Poster *poster) {
+    flush_renderers();
+    Tile tile = poster->drawing;
+    tile.handle = readback_request();
+    if (tile.handle < 0) {
+        // The ring is full of our own tiles, make room
+        consume_tiles(poster, true);
+        tile.handle = readback_request();
+    }
+    if (tile.handle < 0) {
+        fprintf(stderr, "WARNING: no readback free for poster tile %d, leaving it blank\n", poster->next_tile);
+        poster->stats.failed = true;
+    } else {
+        TileCapture capture = { tile.handle, { poster->framebuffer, poster->texture, tile.w, tile.h } };
+        if (render_thread_active()) {
+            render_thread_record_copy(capture_tile, &capture, sizeof(capture));
+            // Get the GPU started on this tile while the next one is recorded
+            render_thread_submit_frame();
+        } else {
+            capture_tile(&capture);
+        }
+    }
+    poster->pending[poster->num_pending++] = tile;
+    poster->next_tile++;
+    consume_tiles(poster, false);
+}
+
+PosterStats poster_close(Poster *poster) {
+    consume_tiles(poster, true);
+    // Stopped early, the rest of the poster is left blank
+    while (poster->next_tile < poster->tiles_x * poster->tiles_y) {
+        const Tile blank = tile_at(poster, poster->next_tile++);
+        complete_tile(poster, &blank);
+        poster->stats.failed = true;
+    }
+    worker_pool_free(poster->writer);
+
+    if (!poster->write_failed) {
+        if (setjmp(png_jmpbuf(poster->png))) {
+            poster->write_failed = true;
+        } else {
+            png_write_end(poster->png, NULL);
+        }
+    }
+    png_destroy_write_struct(&poster->png, &poster->info);
+    if (fclose(poster->file) != 0) poster->write_failed = true;
+
+    TargetNames names = { poster->framebuffer, poster->texture };
+    if (render_thread_active()) {
+        render_thread_record_copy(delete_target, &names, sizeof(names));
+    } else {
+        delete_target(&names);
+    }
+    render_view_reset();
+
+    PosterStats stats = poster->stats;
+    stats.failed |= poster->write_failed;
+    free(poster->band);
+    free(poster);
+    return stats;
+}
@@ -0,0 +1,36 @@
+/**
+ * Poster rendering: stills bigger than the window, or than the GPU can
+ * hold in a single texture.
+ *
+ * The scene is drawn once per tile into an offscreen target, with a render
+ * view showing that tile's rectangle of the scene scaled up. Tiles are read
+ * back asynchronously and copied into a band one tile row tall, and whole
+ * bands are streamed into a PNG on a worker thread. Memory stays around a
+ * couple of bands however large the poster is.
+ */
+
+#ifndef POSTER_H
+#define POSTER_H
+#include "common.h"
+
+typedef struct {
+    int width, height;
+    int tiles_x, tiles_y;
+    int tile_size;    // After clamping to the GPU's limits
+    int tiles_done;
+    bool failed;
+} PosterStats;
+
+typedef struct Poster Poster;
+
+// The scene is the window's content, scaled to fill width x height
+Poster *poster_open(const char *path, int width, int height, int scene_width, int scene_height, int tile_size);
+// Bind the next tile's target and view, false once every tile is drawn.
+// Draw the scene after this as if it were the window.
+bool poster_begin_tile(Poster *poster);
+// Capture what was drawn into the tile
+void poster_end_tile(Poster *poster);
+// Writes what's left, closes the file and frees the poster
+PosterStats poster_close(Poster *poster);
+
+#endif // POSTER_H
@@ -0,0 +1,355 @@
+/*
+ * A ring of READBACK_RING_SIZE slots, each with a flip target and a pixel
+ * pack buffer. A slot goes
+ *
+ *   FREE -> RESERVED (Lua thread requested it)
+ *        -> IN_FLIGHT (GL thread copied into the PBO and fenced it)
+ *        -> READY (fence passed, PBO mapped into the slot's pixels)
+ *        -> FREE (Lua thread released it)
+ *
+ * The state is shared between threads, everything else belongs to whichever
+ * thread the state says owns the slot.
+ *
+ * Scaled captures are drawn into the slot's target with a filter shader
+ * instead of blitted. Shaders need a texture to sample, so a capture of the
+ * default framebuffer is first blitted into a full size scratch texture.
+ */
+
+#include "readback.h"
+#include "shaderutil.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define FINISH_TIMEOUT_NS 100000000 // 100ms, waited on repeatedly
+
+typedef enum {
+    SLOT_FREE = 0,
+    SLOT_RESERVED,
+    SLOT_IN_FLIGHT,
+    SLOT_READY,
+} SlotState;
+
+typedef struct {
+    SlotState state;
+    // GL thread
+    GLuint pbo;
+    GLuint framebuffer, texture; // Flip target
+    int target_width, target_height;
+    GLsync fence;
+    // Result, owned by the Lua thread once READY
+    int width, height;
+    uint8_t *pixels;
+    size_t capacity;
+} ReadbackSlot;
+
+typedef struct {
+    GLuint framebuffer, texture;
+    int width, height;
+} ScaleTarget;
+
+static struct {
+    SDL_mutex *lock;
+    ReadbackSlot slots[READBACK_RING_SIZE];
+    int next;
+} rb = { 0 };
+
+// GL thread only
+static struct {
+    bool loaded;
+    Shader box, lanczos;
+    ScaleTarget source_copy; // Default framebuffer as a texture
+    ScaleTarget horizontal;  // Output of Lanczos' first pass
+} scaler = { 0 };
+
+static SlotState get_state(ReadbackSlot *slot) {
+    SDL_LockMutex(rb.lock);
+    const SlotState state = slot->state;
+    SDL_UnlockMutex(rb.lock);
+    return state;
+}
+
+static void set_state(ReadbackSlot *slot, SlotState state) {
+    SDL_LockMutex(rb.lock);
+    slot->state = state;
+    SDL_UnlockMutex(rb.lock);
+}
+
+bool readback_init(void) {
+    rb.lock = SDL_CreateMutex();
+    return rb.lock != NULL;
+}
+
+static void delete_scale_target(ScaleTarget *target) {
+    glDeleteFramebuffers(1, &target->framebuffer);
+    glDeleteTextures(1, &target->texture);
+    *target = (ScaleTarget){ 0 };
+}
+
+void readback_shutdown(void) {
+    if (scaler.loaded) {
+        glDeleteProgram(scaler.box.program);
+        glDeleteVertexArrays(1, &scaler.box.vao);
+        glDeleteProgram(scaler.lanczos.program);
+        glDeleteVertexArrays(1, &scaler.lanczos.vao);
+        delete_scale_target(&scaler.source_copy);
+        delete_scale_target(&scaler.horizontal);
+        scaler.loaded = false;
+    }
+    for (int i = 0; i < READBACK_RING_SIZE; i++) {
+        ReadbackSlot *slot = &rb.slots[i];
+        if (slot->fence) glDeleteSync(slot->fence);
+        glDeleteBuffers(1, &slot->pbo);
+        glDeleteFramebuffers(1, &slot->framebuffer);
+        glDeleteTextures(1, &slot->texture);
+        free(slot->pixels);
+        *slot = (ReadbackSlot){ 0 };
+    }
+    SDL_DestroyMutex(rb.lock);
+    rb.lock = NULL;
+}
+
+int readback_request(void) {
+    SDL_LockMutex(rb.lock);
+    int handle = -1;
+    // Hand slots out round robin so the oldest capture is reused last
+    for (int i = 0; i < READBACK_RING_SIZE; i++) {
+        const int index = (rb.next + i) % READBACK_RING_SIZE;
+        if (rb.slots[index].state == SLOT_FREE) {
+            handle = index;
+            break;
+        }
+    }
+    if (handle >= 0) {
+        rb.slots[handle].state = SLOT_RESERVED;
+        rb.next = (handle + 1) % READBACK_RING_SIZE;
+    }
+    SDL_UnlockMutex(rb.lock);
+    return handle;
+}
+
+static void allocate_target(ReadbackSlot *slot, int width, int height) {
+    if (!slot->framebuffer) {
+        glGenFramebuffers(1, &slot->framebuffer);
+        glGenTextures(1, &slot->texture);
+        glGenBuffers(1, &slot->pbo);
+    }
+    if (slot->target_width == width && slot->target_height == height) return;
+
+    // No alpha channel, so reads come back opaque whatever the source has
+    glBindTexture(GL_TEXTURE_2D, slot->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, slot->framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, slot->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "ERROR: unable to build readback framebuffer\n");
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, NULL, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot->target_width = width;
+    slot->target_height = height;
+}
+
+static void resize_scale_target(ScaleTarget *target, int width, int height) {
+    if (!target->framebuffer) {
+        glGenFramebuffers(1, &target->framebuffer);
+        glGenTextures(1, &target->texture);
+    }
+    if (target->width == width && target->height == height) return;
+
+    glBindTexture(GL_TEXTURE_2D, target->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "ERROR: unable to build readback scale target\n");
+    }
+    target->width = width;
+    target->height = height;
+}
+
+static void draw_filter_pass(Shader *shader, GLuint texture, int source_width, int source_height) {
+    glUseProgram(shader->program);
+    glBindVertexArray(shader->vao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(glGetUniformLocation(shader->program, "pixels"), 0);
+    glUniform2f(glGetUniformLocation(shader->program, "source_size"), source_width, source_height);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+// Filter the source down into the slot's target, flipped like the blit
+static void scale_into(ReadbackSlot *slot, ReadbackSource source, int width, int height, ReadbackFilter filter) {
+    if (!scaler.loaded) {
+        shader_program_from_files(&scaler.box, "shaders/blit.vert", "shaders/downscale_box.frag");
+        shader_program_from_files(&scaler.lanczos, "shaders/blit.vert", "shaders/downscale_lanczos.frag");
+        scaler.loaded = true;
+    }
+
+    GLuint texture = source.texture;
+    if (!texture) {
+        resize_scale_target(&scaler.source_copy, source.width, source.height);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, source.framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, scaler.source_copy.framebuffer);
+        glBlitFramebuffer(0, 0, source.width, source.height, 0, 0, source.width, source.height,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        texture = scaler.source_copy.texture;
+    }
+
+    glDisable(GL_BLEND);
+    if (filter == READBACK_LANCZOS) {
+        Shader *sh = &scaler.lanczos;
+        resize_scale_target(&scaler.horizontal, width, source.height);
+        glBindFramebuffer(GL_FRAMEBUFFER, scaler.horizontal.framebuffer);
+        glViewport(0, 0, width, source.height);
+        glUseProgram(sh->program);
+        glUniform2f(glGetUniformLocation(sh->program, "direction"), 1, 0);
+        glUniform1f(glGetUniformLocation(sh->program, "scale"), MAX(1.0f, (float)source.width / width));
+        glUniform1i(glGetUniformLocation(sh->program, "flip"), false);
+        draw_filter_pass(sh, texture, source.width, source.height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->framebuffer);
+        glViewport(0, 0, width, height);
+        glUniform2f(glGetUniformLocation(sh->program, "direction"), 0, 1);
+        glUniform1f(glGetUniformLocation(sh->program, "scale"), MAX(1.0f, (float)source.height / height));
+        glUniform1i(glGetUniformLocation(sh->program, "flip"), true);
+        draw_filter_pass(sh, scaler.horizontal.texture, width, source.height);
+    } else {
+        Shader *sh = &scaler.box;
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->framebuffer);
+        glViewport(0, 0, width, height);
+        glUseProgram(sh->program);
+        glUniform2f(glGetUniformLocation(sh->program, "scale"),
+                    (float)source.width / width, (float)source.height / height);
+        draw_filter_pass(sh, texture, source.width, source.height);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glEnable(GL_BLEND);
+    glViewport(0, 0, source.width, source.height);
+}
+
+void readback_capture(int handle, ReadbackSource source, int width, int height, ReadbackFilter filter) {
+    assert(handle >= 0 && handle < READBACK_RING_SIZE);
+    ReadbackSlot *slot = &rb.slots[handle];
+    assert(get_state(slot) == SLOT_RESERVED);
+
+    allocate_target(slot, width, height);
+    slot->width = width;
+    slot->height = height;
+
+    const bool shrinking = width < source.width || height < source.height;
+    if (filter != READBACK_LINEAR && shrinking) {
+        scale_into(slot, source, width, height, filter);
+    } else {
+        // GL's origin is the bottom left, flip while copying so rows
+        // come out top first and nobody has to swap them on the CPU
+        const bool same_size = width == source.width && height == source.height;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, source.framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, slot->framebuffer);
+        glBlitFramebuffer(0, 0, source.width, source.height, 0, height, width, 0,
+                          GL_COLOR_BUFFER_BIT, same_size ? GL_NEAREST : GL_LINEAR);
+    }
+
+    // With a pack buffer bound this only queues the copy
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, slot->framebuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    // Drawing carries on where it was
+    glBindFramebuffer(GL_FRAMEBUFFER, source.framebuffer);
+    set_state(slot, SLOT_IN_FLIGHT);
+}
+
+static void map_result(ReadbackSlot *slot) {
+    const size_t bytes = (size_t)slot->width * slot->height * 4;
+    if (slot->capacity < bytes) {
+        free(slot->pixels);
+        slot->pixels = malloc(bytes);
+        slot->capacity = slot->pixels ? bytes : 0;
+    }
+    if (!slot->pixels) {
+        // Handed out as a failed capture so the slot still comes back
+        fprintf(stderr, "WARNING: out of memory reading back a %dx%d frame\n", slot->width, slot->height);
+        slot->width = slot->height = 0;
+        glDeleteSync(slot->fence);
+        slot->fence = NULL;
+        set_state(slot, SLOT_READY);
+        return;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    const void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+    if (mapped) {
+        memcpy(slot->pixels, mapped, bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        fprintf(stderr, "WARNING: unable to map readback buffer\n");
+        memset(slot->pixels, 0, bytes);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    glDeleteSync(slot->fence);
+    slot->fence = NULL;
+    set_state(slot, SLOT_READY);
+}
+
+void readback_update(void) {
+    for (int i = 0; i < READBACK_RING_SIZE; i++) {
+        ReadbackSlot *slot = &rb.slots[i];
+        if (get_state(slot) != SLOT_IN_FLIGHT) continue;
+        const GLenum status = glClientWaitSync(slot->fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            map_result(slot);
+        }
+    }
+}
+
+void readback_finish(void) {
+    for (int i = 0; i < READBACK_RING_SIZE; i++) {
+        ReadbackSlot *slot = &rb.slots[i];
+        if (get_state(slot) != SLOT_IN_FLIGHT) continue;
+        while (glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, FINISH_TIMEOUT_NS) == GL_TIMEOUT_EXPIRED)
+            ;
+        map_result(slot);
+    }
+}
+
+bool readback_get(int handle, ReadbackResult *result) {
+    assert(handle >= 0 && handle < READBACK_RING_SIZE);
+    ReadbackSlot *slot = &rb.slots[handle];
+    if (get_state(slot) != SLOT_READY) return false;
+    *result = (ReadbackResult){ slot->pixels, slot->width, slot->height };
+    return true;
+}
+
+void readback_release(int handle) {
+    assert(handle >= 0 && handle < READBACK_RING_SIZE);
+    set_state(&rb.slots[handle], SLOT_FREE);
+}
+
+uint8_t *readback_detach(int handle) {
+    assert(handle >= 0 && handle < READBACK_RING_SIZE);
+    ReadbackSlot *slot = &rb.slots[handle];
+    assert(get_state(slot) == SLOT_READY);
+    uint8_t *pixels = slot->pixels;
+    slot->pixels = NULL;
+    slot->capacity = 0;
+    set_state(slot, SLOT_FREE);
+    return pixels;
+}
@@ -0,0 +1,65 @@
+/**
+ * Asynchronous frame readback.
+ *
+ * Reading pixels straight into client memory stalls until the GPU has
+ * finished everything queued before it. Instead a capture blits the frame
+ * (flipped, so rows come out top first) into a small target, reads that
+ * into a pixel pack buffer and fences it. The copy completes while the next
+ * frames render, and is mapped once its fence has passed.
+ *
+ * A capture can be smaller than its source. The frame is then filtered down
+ * on the GPU into a capture-sized target, so only the output size is read
+ * back and handed to encoders.
+ *
+ * Capturing and readback_update() run on the GL thread. Requesting, polling
+ * and taking the result can be done from the Lua thread without GL calls.
+ */
+
+#ifndef READBACK_H
+#define READBACK_H
+#include "common.h"
+#include <gl.h>
+
+// Enough for every capture user (GIF, video, APNG, replay, live preview and
+// a screenshot) to have a capture in each frame until the copies complete
+#define READBACK_CAPTURES_PER_FRAME 6
+#define READBACK_FRAMES_IN_FLIGHT 3
+#define READBACK_RING_SIZE (READBACK_CAPTURES_PER_FRAME * READBACK_FRAMES_IN_FLIGHT)
+
+typedef enum {
+    READBACK_LINEAR = 0, // Bilinear blit, fine for small reductions or upscaling
+    READBACK_BOX,        // Averages every source pixel under the output pixel
+    READBACK_LANCZOS,    // Lanczos-2, sharper, done as two separable passes
+} ReadbackFilter;
+
+typedef struct {
+    GLuint framebuffer;
+    GLuint texture;     // Color attachment of framebuffer, 0 for the default framebuffer
+    int width, height;
+} ReadbackSource;
+
+typedef struct {
+    const uint8_t *pixels; // RGBA, top row first, always opaque. NULL if it failed
+    int width, height;
+} ReadbackResult;
+
+bool readback_init(void);
+// GL thread, GL context must be current
+void readback_shutdown(void);
+
+// Reserve a slot for a capture, or -1 if every slot is busy
+int readback_request(void);
+// GL thread: copy the source into the reserved slot, scaled to width x height
+void readback_capture(int handle, ReadbackSource source, int width, int height, ReadbackFilter filter);
+// GL thread: map any captures whose copy has completed (never blocks)
+void readback_update(void);
+// GL thread: wait for all captures in flight
+void readback_finish(void);
+
+// Pixels stay valid until the handle is released
+bool readback_get(int handle, ReadbackResult *result);
+void readback_release(int handle);
+// Release the handle but keep its pixels, the caller must free() them
+uint8_t *readback_detach(int handle);
+
+#endif // READBACK_H
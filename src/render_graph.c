@@ -0,0 +1,379 @@
+/*
+ * Post-processing render graph.
+ *
+ * Every frame:
+ * 1. Passes are culled by walking backwards from "screen". A pass only runs
+ *    if something downstream reads its output.
+ * 2. Intermediate targets are transient. They are taken from a pool when
+ *    first written and given back after their last read, so two targets
+ *    with non-overlapping lifetimes alias the same texture.
+ * 3. Each pass is timed with a GL_TIME_ELAPSED query which is read back a
+ *    few frames later so we never stall waiting on the GPU.
+ */
+
+#include "render_graph.h"
+#include "render_thread.h"
+#include <stdio.h>
+#include <assert.h>
+
+#define POOL_SIZE 16
+// Pooled targets unused for this many frames are freed
+#define POOL_MAX_IDLE_FRAMES 120
+// Frames in flight before reading back a timer query
+#define TIMER_LATENCY 3
+
+typedef struct {
+    GLint location;
+    int components;
+    int count;
+    int offset; // into RenderGraphFrame.uniform_data
+} PassUniform;
+
+typedef struct {
+    char id[RENDER_GRAPH_NAME_SIZE];
+    Shader shader;
+    char inputs[RENDER_GRAPH_MAX_INPUTS][RENDER_GRAPH_NAME_SIZE];
+    int num_inputs;
+    char output[RENDER_GRAPH_NAME_SIZE];
+    float scale;
+    PassUniform uniforms[RENDER_GRAPH_MAX_UNIFORMS];
+    int num_uniforms;
+} Pass;
+
+// Plain data so the whole frame can be copied into the render thread's command buffer
+typedef struct {
+    Pass passes[RENDER_GRAPH_MAX_PASSES];
+    int num_passes;
+    float uniform_data[RENDER_GRAPH_UNIFORM_FLOATS];
+    int num_floats;
+    GLuint scene_texture;
+    int width, height;
+} RenderGraphFrame;
+
+typedef struct {
+    GLuint texture;
+    GLuint framebuffer;
+    int width, height;
+    bool busy;
+    int last_used_frame;
+} PooledTarget;
+
+// Lua thread
+static RenderGraphFrame building = { 0 };
+static int open_pass = -1;
+
+// Rendering thread
+static PooledTarget pool[POOL_SIZE] = { 0 };
+static int frame_count = 0;
+static bool wrote_screen = false;
+static GLuint timer_queries[RENDER_GRAPH_MAX_PASSES][TIMER_LATENCY] = { 0 };
+static char timer_ids[RENDER_GRAPH_MAX_PASSES][TIMER_LATENCY][RENDER_GRAPH_NAME_SIZE];
+static PassTiming timings[RENDER_GRAPH_MAX_PASSES];
+static int num_timings = 0;
+
+static void copy_name(char *dst, const char *src) {
+    snprintf(dst, RENDER_GRAPH_NAME_SIZE, "%s", src ? src : "");
+}
+
+int render_graph_begin_pass(const char *id, Shader *shader, const char **inputs, int num_inputs, const char *output, float scale)
+{
+    assert(open_pass < 0 && "render graph pass already open");
+    if (building.num_passes >= RENDER_GRAPH_MAX_PASSES) {
+        fprintf(stderr, "WARNING: too many render graph passes, dropping %s\n", id);
+        return -1;
+    }
+    open_pass = building.num_passes++;
+    Pass *pass = &building.passes[open_pass];
+    copy_name(pass->id, id);
+    pass->shader = *shader;
+    pass->num_inputs = MIN(num_inputs, RENDER_GRAPH_MAX_INPUTS);
+    for (int i = 0; i < pass->num_inputs; i++) {
+        copy_name(pass->inputs[i], inputs[i]);
+    }
+    copy_name(pass->output, output ? output : RENDER_GRAPH_SCREEN);
+    pass->scale = scale > 0 ? scale : 1.0f;
+    pass->num_uniforms = 0;
+    return open_pass;
+}
+
+void render_graph_end_pass(void)
+{
+    open_pass = -1;
+}
+
+bool render_graph_capturing(void)
+{
+    return open_pass >= 0;
+}
+
+void render_graph_capture_uniform(GLint location, int components, int count, const float *values)
+{
+    Pass *pass = &building.passes[open_pass];
+    const int floats = components * count;
+    if (pass->num_uniforms >= RENDER_GRAPH_MAX_UNIFORMS
+        || building.num_floats + floats > RENDER_GRAPH_UNIFORM_FLOATS) {
+        fprintf(stderr, "WARNING: out of uniform storage for pass %s\n", pass->id);
+        return;
+    }
+    pass->uniforms[pass->num_uniforms++] = (PassUniform){
+        location, components, count, building.num_floats
+    };
+    memcpy(&building.uniform_data[building.num_floats], values, floats * sizeof(float));
+    building.num_floats += floats;
+}
+
+bool render_graph_has_passes(void)
+{
+    return building.num_passes > 0;
+}
+
+bool render_graph_wrote_screen(void)
+{
+    return wrote_screen;
+}
+
+/*
+ * Transient target pool
+ */
+
+static PooledTarget *acquire_target(int width, int height)
+{
+    PooledTarget *empty = NULL;
+    for (int i = 0; i < POOL_SIZE; i++) {
+        PooledTarget *t = &pool[i];
+        if (t->texture == 0) {
+            if (!empty) empty = t;
+        } else if (!t->busy && t->width == width && t->height == height) {
+            t->busy = true;
+            t->last_used_frame = frame_count;
+            return t;
+        }
+    }
+    if (!empty) return NULL;
+
+    empty->width = width;
+    empty->height = height;
+    glGenTextures(1, &empty->texture);
+    glBindTexture(GL_TEXTURE_2D, empty->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &empty->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, empty->framebuffer);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, empty->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Error: unable to build render graph target\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    empty->busy = true;
+    empty->last_used_frame = frame_count;
+    return empty;
+}
+
+static void trim_pool(void)
+{
+    for (int i = 0; i < POOL_SIZE; i++) {
+        PooledTarget *t = &pool[i];
+        if (t->texture && frame_count - t->last_used_frame > POOL_MAX_IDLE_FRAMES) {
+            glDeleteFramebuffers(1, &t->framebuffer);
+            glDeleteTextures(1, &t->texture);
+            *t = (PooledTarget){ 0 };
+        }
+    }
+}
+
+/*
+ * GPU timing
+ */
+
+static void collect_timings(int slot)
+{
+    num_timings = 0;
+    for (int i = 0; i < RENDER_GRAPH_MAX_PASSES; i++) {
+        GLuint query = timer_queries[i][slot];
+        if (query == 0 || timer_ids[i][slot][0] == '\0') continue;
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+        PassTiming *timing = &timings[num_timings++];
+        copy_name(timing->id, timer_ids[i][slot]);
+        timing->gpu_ms = ns * 1e-6;
+        timer_ids[i][slot][0] = '\0';
+    }
+}
+
+int render_graph_timings(PassTiming *out, int max)
+{
+    const int n = MIN(max, num_timings);
+    memcpy(out, timings, n * sizeof(PassTiming));
+    return n;
+}
+
+/*
+ * Execution
+ */
+
+// `names` is an array of `count` RENDER_GRAPH_NAME_SIZE strings
+static int find_name(const char *names, int count, const char *name)
+{
+    for (int i = 0; i < count; i++) {
+        if (strcmp(&names[i * RENDER_GRAPH_NAME_SIZE], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void execute(const RenderGraphFrame *frame)
+{
+    wrote_screen = false;
+    frame_count++;
+    const int slot = frame_count % TIMER_LATENCY;
+    collect_timings(slot);
+    if (frame->num_passes == 0) {
+        trim_pool();
+        return;
+    }
+    for (int i = 0; i < POOL_SIZE; i++) pool[i].busy = false;
+
+    // Culling: walk backwards from the screen collecting needed targets
+    bool live[RENDER_GRAPH_MAX_PASSES] = { 0 };
+    char needed[RENDER_GRAPH_MAX_PASSES * RENDER_GRAPH_MAX_INPUTS + 1][RENDER_GRAPH_NAME_SIZE];
+    int num_needed = 0;
+    copy_name(needed[num_needed++], RENDER_GRAPH_SCREEN);
+    for (int i = frame->num_passes - 1; i >= 0; i--) {
+        const Pass *pass = &frame->passes[i];
+        int n = find_name(needed[0], num_needed, pass->output);
+        if (n < 0) continue;
+        live[i] = true;
+        // This pass produces the target, earlier writers are only needed if we read it
+        memcpy(needed[n], needed[--num_needed], RENDER_GRAPH_NAME_SIZE);
+        for (int j = 0; j < pass->num_inputs; j++) {
+            if (find_name(needed[0], num_needed, pass->inputs[j]) < 0) {
+                copy_name(needed[num_needed++], pass->inputs[j]);
+            }
+        }
+    }
+
+    // Lifetimes: last live pass reading each target
+    int last_read[RENDER_GRAPH_MAX_PASSES] = { 0 };
+    for (int i = 0; i < frame->num_passes; i++) {
+        last_read[i] = -1;
+        if (!live[i]) continue;
+        for (int j = i + 1; j < frame->num_passes; j++) {
+            if (!live[j]) continue;
+            if (strcmp(frame->passes[j].output, frame->passes[i].output) == 0) break;
+            if (find_name(frame->passes[j].inputs[0], frame->passes[j].num_inputs, frame->passes[i].output) >= 0) {
+                last_read[i] = j;
+            }
+        }
+    }
+
+    // Currently bound logical target -> pooled texture
+    PooledTarget *targets[RENDER_GRAPH_MAX_PASSES] = { 0 };
+
+    glDisable(GL_BLEND);
+    for (int i = 0; i < frame->num_passes; i++) {
+        if (!live[i]) continue;
+        const Pass *pass = &frame->passes[i];
+        const bool to_screen = strcmp(pass->output, RENDER_GRAPH_SCREEN) == 0;
+
+        int w = frame->width, h = frame->height;
+        if (to_screen) {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        } else {
+            w = MAX(1, (int)(w * pass->scale + 0.5f));
+            h = MAX(1, (int)(h * pass->scale + 0.5f));
+            targets[i] = acquire_target(w, h);
+            if (!targets[i]) {
+                fprintf(stderr, "WARNING: render graph target pool exhausted, skipping %s\n", pass->id);
+                continue;
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, targets[i]->framebuffer);
+        }
+        glViewport(0, 0, w, h);
+
+        glUseProgram(pass->shader.program);
+        glBindVertexArray(pass->shader.vao);
+        for (int j = 0; j < pass->num_inputs; j++) {
+            GLuint texture = 0;
+            if (strcmp(pass->inputs[j], RENDER_GRAPH_SCENE) == 0) {
+                texture = frame->scene_texture;
+            } else {
+                // Most recent earlier writer of this target
+                for (int k = i - 1; k >= 0; k--) {
+                    if (targets[k] && strcmp(frame->passes[k].output, pass->inputs[j]) == 0) {
+                        texture = targets[k]->texture;
+                        break;
+                    }
+                }
+            }
+            char name[16];
+            snprintf(name, sizeof(name), "input%d", j);
+            glActiveTexture(GL_TEXTURE0 + j);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glUniform1i(glGetUniformLocation(pass->shader.program, name), j);
+        }
+        glUniform2f(glGetUniformLocation(pass->shader.program, "resolution"), w, h);
+        for (int j = 0; j < pass->num_uniforms; j++) {
+            const PassUniform *u = &pass->uniforms[j];
+            shader_upload_uniform(u->location, u->components, u->count, &frame->uniform_data[u->offset]);
+        }
+
+        GLuint *query = &timer_queries[i][slot];
+        if (*query == 0) glGenQueries(1, query);
+        glBeginQuery(GL_TIME_ELAPSED, *query);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glEndQuery(GL_TIME_ELAPSED);
+        copy_name(timer_ids[i][slot], pass->id);
+
+        if (to_screen) wrote_screen = true;
+
+        // Give back targets after their last read so later passes can alias
+        // them. Each is given back once and forgotten, by now the pooled
+        // texture may already be another pass's output.
+        for (int k = 0; k <= i; k++) {
+            if (targets[k] && last_read[k] <= i) {
+                targets[k]->busy = false;
+                targets[k] = NULL;
+            }
+        }
+    }
+
+    for (int j = 0; j < RENDER_GRAPH_MAX_INPUTS; j++) {
+        glActiveTexture(GL_TEXTURE0 + j);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glEnable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, frame->width, frame->height);
+
+    trim_pool();
+}
+
+static void replay_frame(void *payload)
+{
+    execute(payload);
+}
+
+void render_graph_execute_frame(GLuint scene_texture, int width, int height)
+{
+    building.scene_texture = scene_texture;
+    building.width = width;
+    building.height = height;
+    if (render_thread_active()) {
+        render_thread_record_copy(replay_frame, &building, sizeof(building));
+    } else {
+        execute(&building);
+    }
+    building.num_passes = 0;
+    building.num_floats = 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * A small render graph for full screen post-processing passes.
+ *
+ * Like the entity renderers it is immediate mode: passes are declared
+ * every frame and the graph is compiled and executed when the frame is
+ * presented. Each pass reads up to RENDER_GRAPH_MAX_INPUTS named targets
+ * and writes one. "scene" is the frame as drawn, "screen" is the window.
+ */
+
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+#include "common.h"
+#include "shaderutil.h"
+
+#define RENDER_GRAPH_MAX_PASSES 32
+#define RENDER_GRAPH_MAX_INPUTS 4
+#define RENDER_GRAPH_MAX_UNIFORMS 16
+#define RENDER_GRAPH_UNIFORM_FLOATS 2048
+#define RENDER_GRAPH_NAME_SIZE 32
+
+#define RENDER_GRAPH_SCENE "scene"
+#define RENDER_GRAPH_SCREEN "screen"
+
+typedef struct {
+    char id[RENDER_GRAPH_NAME_SIZE];
+    float gpu_ms;
+} PassTiming;
+
+// Returns pass index, or -1 if the graph is full
+int render_graph_begin_pass(const char *id, Shader *shader, const char **inputs, int num_inputs, const char *output, float scale);
+void render_graph_end_pass(void);
+
+// While a pass is open, uniforms are stored with the pass instead of set
+bool render_graph_capturing(void);
+void render_graph_capture_uniform(GLint location, int components, int count, const float *values);
+
+bool render_graph_has_passes(void);
+
+// Compile and run this frame's passes (recorded if using the render thread)
+void render_graph_execute_frame(GLuint scene_texture, int width, int height);
+// Whether the last executed frame already wrote to the screen
+bool render_graph_wrote_screen(void);
+
+int render_graph_timings(PassTiming *timings, int max);
+
+#endif // RENDER_GRAPH_H
@@ -0,0 +1,234 @@
+/*
+ * The render thread replays frames recorded by the Lua thread.
+ *
+ * Frames are recorded into a ring of RENDER_QUEUE_DEPTH command buffers.
+ * While the render thread is submitting frame N to the driver (and possibly
+ * blocking in SDL_GL_SwapWindow) the Lua thread is already recording frame
+ * N+1. Once it runs RENDER_QUEUE_DEPTH frames ahead, submitting blocks
+ * until the render thread catches up, which bounds the added latency.
+ *
+ * A command is a function pointer followed by an inline payload. That way
+ * each subsystem keeps its GL code to itself and just records a call to it.
+ */
+
+#include "render_thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define COMMAND_ALIGN 16
+#define ALIGN_UP(n) (((n) + COMMAND_ALIGN - 1) & ~(size_t)(COMMAND_ALIGN - 1))
+#define COMMAND_BUFFER_INITIAL_SIZE (1 << 20)
+
+typedef struct {
+    RenderCommand fn;
+    size_t size;
+} CommandHeader;
+
+typedef enum {
+    BUFFER_FREE = 0,
+    BUFFER_RECORDING,
+    BUFFER_PENDING,
+} BufferState;
+
+typedef struct {
+    char *data;
+    size_t used;
+    size_t capacity;
+    BufferState state;
+    uint64_t serial;
+} CommandBuffer;
+
+static struct {
+    SDL_Thread *thread;
+    SDL_Window *window;
+    SDL_GLContext context;
+    SDL_mutex *lock;
+    SDL_cond *cond;
+    bool running;
+    bool stopping;
+
+    CommandBuffer buffers[RENDER_QUEUE_DEPTH];
+    int write_index;
+    int read_index;
+    uint64_t next_serial;
+    uint64_t completed_serial;
+} rt = { 0 };
+
+bool render_thread_active(void) {
+    return rt.running;
+}
+
+static void reset_buffer(CommandBuffer *buf) {
+    buf->used = 0;
+    buf->state = BUFFER_RECORDING;
+    buf->serial = ++rt.next_serial;
+}
+
+void *render_thread_record(RenderCommand fn, size_t size)
+{
+    assert(rt.running);
+    CommandBuffer *buf = &rt.buffers[rt.write_index];
+    const size_t needed = ALIGN_UP(sizeof(CommandHeader)) + ALIGN_UP(size);
+    if (buf->used + needed > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : COMMAND_BUFFER_INITIAL_SIZE;
+        while (buf->used + needed > capacity) capacity *= 2;
+        buf->data = realloc(buf->data, capacity);
+        assert(buf->data);
+        buf->capacity = capacity;
+    }
+    CommandHeader *header = (CommandHeader *)&buf->data[buf->used];
+    header->fn = fn;
+    header->size = ALIGN_UP(size);
+    buf->used += needed;
+    return (char *)header + ALIGN_UP(sizeof(CommandHeader));
+}
+
+void render_thread_record_copy(RenderCommand fn, const void *payload, size_t size)
+{
+    void *dst = render_thread_record(fn, size);
+    if (size > 0) memcpy(dst, payload, size);
+}
+
+static void replay(CommandBuffer *buf)
+{
+    size_t offset = 0;
+    while (offset < buf->used) {
+        CommandHeader *header = (CommandHeader *)&buf->data[offset];
+        void *payload = (char *)header + ALIGN_UP(sizeof(CommandHeader));
+        header->fn(payload);
+        offset += ALIGN_UP(sizeof(CommandHeader)) + header->size;
+    }
+}
+
+static int render_thread_main(void *data)
+{
+    (void)data;
+    if (SDL_GL_MakeCurrent(rt.window, rt.context) < 0) {
+        fprintf(stderr, "ERROR: render thread unable to take GL context: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    SDL_LockMutex(rt.lock);
+    for (;;) {
+        CommandBuffer *buf = &rt.buffers[rt.read_index];
+        while (buf->state != BUFFER_PENDING && !rt.stopping) {
+            SDL_CondWait(rt.cond, rt.lock);
+        }
+        if (buf->state != BUFFER_PENDING) break;
+
+        // Replay without holding the lock so the Lua thread
+        // can keep recording into the other buffer(s)
+        SDL_UnlockMutex(rt.lock);
+        replay(buf);
+        SDL_LockMutex(rt.lock);
+
+        buf->state = BUFFER_FREE;
+        rt.completed_serial = buf->serial;
+        rt.read_index = (rt.read_index + 1) % RENDER_QUEUE_DEPTH;
+        SDL_CondBroadcast(rt.cond);
+    }
+    SDL_UnlockMutex(rt.lock);
+
+    SDL_GL_MakeCurrent(rt.window, NULL);
+    return 0;
+}
+
+bool render_thread_start(SDL_Window *window, SDL_GLContext context)
+{
+    assert(!rt.running);
+    rt.window = window;
+    rt.context = context;
+    rt.lock = SDL_CreateMutex();
+    rt.cond = SDL_CreateCond();
+    rt.write_index = 0;
+    rt.read_index = 0;
+    reset_buffer(&rt.buffers[0]);
+
+    // The context can only be current on one thread at a time
+    SDL_GL_MakeCurrent(window, NULL);
+    rt.thread = SDL_CreateThread(render_thread_main, "bubbl render", NULL);
+    if (rt.thread == NULL) {
+        fprintf(stderr, "WARNING: unable to create render thread: %s\n", SDL_GetError());
+        SDL_GL_MakeCurrent(window, context);
+        return false;
+    }
+    rt.running = true;
+    return true;
+}
+
+// Returns serial of the submitted buffer
+static uint64_t submit(void)
+{
+    SDL_LockMutex(rt.lock);
+    CommandBuffer *buf = &rt.buffers[rt.write_index];
+    const uint64_t serial = buf->serial;
+    buf->state = BUFFER_PENDING;
+    SDL_CondBroadcast(rt.cond);
+
+    // Wait for a free buffer to record the next frame into.
+    // This is what bounds the queue depth.
+    rt.write_index = (rt.write_index + 1) % RENDER_QUEUE_DEPTH;
+    CommandBuffer *next = &rt.buffers[rt.write_index];
+    while (next->state == BUFFER_PENDING) {
+        SDL_CondWait(rt.cond, rt.lock);
+    }
+    reset_buffer(next);
+    SDL_UnlockMutex(rt.lock);
+    return serial;
+}
+
+void render_thread_submit_frame(void)
+{
+    submit();
+}
+
+typedef struct {
+    RenderCommand fn;
+    void *arg;
+} Invocation;
+
+static void run_invocation(void *payload)
+{
+    Invocation *inv = payload;
+    inv->fn(inv->arg);
+}
+
+void render_thread_invoke(RenderCommand fn, void *arg)
+{
+    if (!rt.running) {
+        fn(arg);
+        return;
+    }
+    Invocation inv = { fn, arg };
+    render_thread_record_copy(run_invocation, &inv, sizeof(inv));
+    const uint64_t serial = submit();
+
+    SDL_LockMutex(rt.lock);
+    while (rt.completed_serial < serial) {
+        SDL_CondWait(rt.cond, rt.lock);
+    }
+    SDL_UnlockMutex(rt.lock);
+}
+
+void render_thread_stop(void)
+{
+    if (!rt.running) return;
+
+    // Let the render thread finish whatever was already submitted
+    SDL_LockMutex(rt.lock);
+    rt.stopping = true;
+    SDL_CondBroadcast(rt.cond);
+    SDL_UnlockMutex(rt.lock);
+    SDL_WaitThread(rt.thread, NULL);
+
+    rt.running = false;
+    SDL_GL_MakeCurrent(rt.window, rt.context);
+
+    for (int i = 0; i < RENDER_QUEUE_DEPTH; i++) {
+        free(rt.buffers[i].data);
+        rt.buffers[i] = (CommandBuffer){ 0 };
+    }
+    SDL_DestroyCond(rt.cond);
+    SDL_DestroyMutex(rt.lock);
+}
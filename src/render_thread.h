@@ -0,0 +1,41 @@
+/**
+ * Optional dedicated render thread.
+ *
+ * When enabled, the Lua thread no longer calls into OpenGL. Instead every
+ * GL-touching engine function records a command into the current frame's
+ * command buffer, and the render thread (which owns the GL context) replays
+ * whole frames. See render_thread.c
+ */
+
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+#include "common.h"
+#include <SDL.h>
+
+// Maximum number of recorded frames in flight.
+// The Lua thread blocks once it gets this far ahead of the GPU.
+#define RENDER_QUEUE_DEPTH 2
+
+// A recorded command. The payload is stored inline in the command buffer
+// and is only valid for the duration of the call.
+typedef void (*RenderCommand)(void *payload);
+
+bool render_thread_start(SDL_Window *window, SDL_GLContext context);
+void render_thread_stop(void);
+
+// True while commands are being recorded instead of executed
+bool render_thread_active(void);
+
+// Reserve `size` payload bytes for `fn` in the current frame.
+// The returned pointer is valid until the next record call.
+void *render_thread_record(RenderCommand fn, size_t size);
+void render_thread_record_copy(RenderCommand fn, const void *payload, size_t size);
+
+// Hand the recorded frame off to the render thread
+void render_thread_submit_frame(void);
+
+// Run `fn` on the render thread after everything recorded so far,
+// and wait for it to complete. Used for calls that return GL results.
+void render_thread_invoke(RenderCommand fn, void *arg);
+
+#endif // RENDER_THREAD_H
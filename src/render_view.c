@@ -0,0 +1,41 @@
+#include "render_view.h"
+#include "render_thread.h"
+#include <SDL.h>
+
+// GL thread, changed in order with the draws around it
+static struct {
+    bool custom;
+    RenderView view;
+} current = { 0 };
+
+static void apply_view(void *payload) {
+    const RenderView *view = payload;
+    current.custom = view->target_width > 0;
+    current.view = *view;
+}
+
+void render_view_set(RenderView view) {
+    if (render_thread_active()) {
+        render_thread_record_copy(apply_view, &view, sizeof(view));
+        return;
+    }
+    apply_view(&view);
+}
+
+void render_view_reset(void) {
+    render_view_set((RenderView){ 0 });
+}
+
+RenderView render_view_get(void) {
+    if (current.custom) return current.view;
+    int w, h;
+    SDL_GL_GetDrawableSize(SDL_GL_GetCurrentWindow(), &w, &h);
+    return (RenderView){ 0, 0, w, h, w, h, w, h };
+}
+
+RenderView render_view_exchange(RenderView view) {
+    // Zero when no view was set, so switching back resets it
+    const RenderView previous = current.custom ? current.view : (RenderView){ 0 };
+    apply_view(&view);
+    return previous;
+}
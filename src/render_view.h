@@ -0,0 +1,29 @@
+/**
+ * The part of the scene drawn into the current target.
+ *
+ * Normally that's the whole window. Poster rendering draws the scene as
+ * tiles bigger than the window, each showing a scaled up rectangle of it,
+ * so renderers map scene coordinates through the view rather than straight
+ * onto the viewport.
+ */
+
+#ifndef RENDER_VIEW_H
+#define RENDER_VIEW_H
+#include "common.h"
+
+typedef struct {
+    float x, y, width, height;       // Scene rectangle, origin bottom left like GL
+    int scene_width, scene_height;   // The whole scene, for full screen canvases
+    int target_width, target_height; // Pixels the rectangle is drawn into
+} RenderView;
+
+void render_view_set(RenderView view);
+// Back to drawing the whole window
+void render_view_reset(void);
+// GL thread: the view set last, or the whole drawable if none is
+RenderView render_view_get(void);
+// GL thread: switch to `view` straight away, for drawing into another
+// target part way through the frame. Returns the view to switch back to.
+RenderView render_view_exchange(RenderView view);
+
+#endif // RENDER_VIEW_H
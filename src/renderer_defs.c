@@ -71,6 +71,13 @@ void flush_renderers(void)
     }
 }
 
+void renderers_wait_for_programs(bool wait)
+{
+    for (EntityType i = 0; i < COUNT_ENTITY_TYPES; i++) {
+        renderers[i].wait_for_program = wait;
+    }
+}
+
 void init_renderers(void)
 {
     for (EntityType i = 0; i < COUNT_ENTITY_TYPES; i++) {
@@ -35,6 +35,9 @@ void render_bubble(Bubble bubble);
 void render_trans_bubble(TransBubble bubble);
 
 void init_renderers(void);
+// Whether the first draw of an entity type waits for its program to
+// compile, otherwise they aren't drawn until it has
+void renderers_wait_for_programs(bool wait);
 void flush_renderers(void);
 void flush_renderer(EntityType type);
 
@@ -0,0 +1,414 @@
+/*
+ * Encoded frames are a list of runs over 32-bit pixels. Each run starts
+ * with a word holding the op in its top two bits and the pixel count below:
+ *
+ *   RUN_SKIP  count          pixels are the same as the previous frame
+ *   RUN_FILL  count, pixel   one pixel repeated
+ *   RUN_COPY  count, pixels  literal pixels
+ *
+ * A keyframe is encoded without a previous frame so it never skips. Frames
+ * are reference counted, a save holds on to its snapshot while the
+ * recorder may already have evicted them.
+ */
+
+#include "replay_buffer.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define MAX_FRAMES 4096
+#define DEFAULT_MAX_BYTES (64u << 20)
+#define DEFAULT_MAX_SECONDS 20
+#define DEFAULT_KEYFRAME_INTERVAL 60
+// A fill is only worth it for this many pixels
+#define MIN_FILL 3
+
+#define RUN_SKIP 0u
+#define RUN_FILL 1u
+#define RUN_COPY 2u
+#define RUN_OP(word) ((word) >> 30)
+#define RUN_COUNT(word) ((word) & 0x3FFFFFFFu)
+
+typedef struct {
+    uint32_t *runs;
+    size_t words;
+    int width, height;
+    double timestamp;
+    bool keyframe;
+    int refs;
+} ReplayFrame;
+
+typedef struct {
+    ReplayBuffer *replay;
+    uint8_t *pixels;
+    int width, height;
+    double timestamp;
+} EncodeJob;
+
+typedef enum { SAVE_APNG, SAVE_VIDEO, SAVE_GIF } SaveTarget;
+
+typedef struct {
+    ReplayBuffer *replay;
+    SaveTarget target;
+    char *path;
+    ApngSettings apng;
+    VideoSinkSettings video;
+    void *gifski;
+    GifskiAddFrameFn gif_add_frame;
+    GifskiFinishFn gif_finish;
+    ReplayFrame **frames;
+    int num_frames;
+} SaveJob;
+
+struct ReplayBuffer {
+    ReplaySettings settings;
+    WorkerPool *encoder;
+    WorkerPool *saver;
+
+    SDL_mutex *lock;
+    ReplayFrame *frames[MAX_FRAMES]; // Oldest first from `first`
+    int first, count;
+    uint64_t bytes;
+    uint64_t raw_bytes;
+    ReplayStats stats;
+    double total_encode_ms;
+
+    // Encoder thread
+    uint32_t *previous;
+    int previous_width, previous_height;
+    int since_keyframe;
+    uint32_t *scratch;
+    size_t scratch_words;
+};
+
+static size_t encode(const uint32_t *cur, const uint32_t *prev, size_t n, uint32_t *out) {
+    size_t words = 0;
+    size_t i = 0;
+    while (i < n) {
+        size_t j = i;
+        if (prev && cur[i] == prev[i]) {
+            while (j < n && cur[j] == prev[j] && j - i < RUN_COUNT(~0u)) j++;
+            out[words++] = RUN_SKIP << 30 | (uint32_t)(j - i);
+        } else if (i + MIN_FILL <= n && cur[i] == cur[i + 1] && cur[i] == cur[i + 2]) {
+            while (j < n && cur[j] == cur[i] && j - i < RUN_COUNT(~0u)) j++;
+            out[words++] = RUN_FILL << 30 | (uint32_t)(j - i);
+            out[words++] = cur[i];
+        } else {
+            // Literals until something cheaper starts
+            while (j < n && !(prev && cur[j] == prev[j])
+                   && !(j + MIN_FILL <= n && cur[j] == cur[j + 1] && cur[j] == cur[j + 2])
+                   && j - i < RUN_COUNT(~0u)) {
+                j++;
+            }
+            out[words++] = RUN_COPY << 30 | (uint32_t)(j - i);
+            memcpy(&out[words], &cur[i], (j - i) * sizeof(uint32_t));
+            words += j - i;
+        }
+        i = j;
+    }
+    return words;
+}
+
+// Apply a frame's runs on top of the previous frame's pixels
+static void decode(const ReplayFrame *frame, uint32_t *pixels) {
+    size_t i = 0, w = 0;
+    while (w < frame->words) {
+        const uint32_t run = frame->runs[w++];
+        const size_t count = RUN_COUNT(run);
+        switch (RUN_OP(run)) {
+        case RUN_SKIP:
+            break;
+        case RUN_FILL:
+            for (size_t k = 0; k < count; k++) pixels[i + k] = frame->runs[w];
+            w++;
+            break;
+        default:
+            memcpy(&pixels[i], &frame->runs[w], count * sizeof(uint32_t));
+            w += count;
+            break;
+        }
+        i += count;
+    }
+}
+
+// With the lock held
+static void unref_frame(ReplayFrame *frame) {
+    if (--frame->refs > 0) return;
+    free(frame->runs);
+    free(frame);
+}
+
+// With the lock held: drop the oldest keyframe and the deltas that need it
+static void evict_oldest(ReplayBuffer *replay) {
+    do {
+        ReplayFrame *frame = replay->frames[replay->first];
+        replay->bytes -= frame->words * sizeof(uint32_t);
+        replay->raw_bytes -= (uint64_t)frame->width * frame->height * 4;
+        unref_frame(frame);
+        replay->first = (replay->first + 1) % MAX_FRAMES;
+        replay->count--;
+        replay->stats.evicted++;
+    } while (replay->count > 0 && !replay->frames[replay->first]->keyframe);
+}
+
+static ReplayFrame *newest(ReplayBuffer *replay) {
+    return replay->frames[(replay->first + replay->count - 1) % MAX_FRAMES];
+}
+
+static bool run_encode(void *arg) {
+    EncodeJob *job = arg;
+    ReplayBuffer *replay = job->replay;
+    const Uint64 started = SDL_GetPerformanceCounter();
+
+    const size_t n = (size_t)job->width * job->height;
+    const bool resized = job->width != replay->previous_width || job->height != replay->previous_height;
+    const bool keyframe = resized || replay->since_keyframe >= replay->settings.keyframe_interval;
+    if (resized) {
+        free(replay->previous);
+        replay->previous = NULL;
+        replay->previous_width = job->width;
+        replay->previous_height = job->height;
+    }
+    // Worst case alternates one skipped and one literal pixel
+    if (replay->scratch_words < n * 3) {
+        free(replay->scratch);
+        replay->scratch_words = n * 3;
+        replay->scratch = malloc(replay->scratch_words * sizeof(uint32_t));
+    }
+    const uint32_t *pixels = (const uint32_t *)job->pixels;
+    const size_t words = encode(pixels, keyframe ? NULL : replay->previous, n, replay->scratch);
+    replay->since_keyframe = keyframe ? 1 : replay->since_keyframe + 1;
+
+    ReplayFrame *frame = malloc(sizeof(ReplayFrame));
+    *frame = (ReplayFrame){
+        .runs = malloc(words * sizeof(uint32_t)),
+        .words = words,
+        .width = job->width, .height = job->height,
+        .timestamp = job->timestamp,
+        .keyframe = keyframe,
+        .refs = 1,
+    };
+    memcpy(frame->runs, replay->scratch, words * sizeof(uint32_t));
+
+    // This frame is the next one's reference
+    free(replay->previous);
+    replay->previous = (uint32_t *)job->pixels;
+    free(job);
+
+    const float ms = (float)((double)(SDL_GetPerformanceCounter() - started) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+    const size_t bytes = words * sizeof(uint32_t);
+
+    SDL_LockMutex(replay->lock);
+    if (!keyframe && replay->count == 0) {
+        // Its keyframe was evicted, it can't be decoded
+        unref_frame(frame);
+        replay->since_keyframe = replay->settings.keyframe_interval;
+    } else {
+        while (replay->count > 0
+               && (replay->count == MAX_FRAMES
+                   || replay->bytes + bytes > replay->settings.max_bytes
+                   || frame->timestamp - replay->frames[replay->first]->timestamp > replay->settings.max_seconds)) {
+            evict_oldest(replay);
+        }
+        // Either it's bigger than the whole buffer, or it was a delta whose
+        // keyframe had to go. Start again from the next keyframe.
+        if (bytes > replay->settings.max_bytes || (!keyframe && replay->count == 0)) {
+            unref_frame(frame);
+            replay->since_keyframe = replay->settings.keyframe_interval;
+        } else {
+            replay->frames[(replay->first + replay->count) % MAX_FRAMES] = frame;
+            replay->count++;
+            replay->bytes += bytes;
+            replay->raw_bytes += n * 4;
+        }
+    }
+    replay->total_encode_ms += ms;
+    replay->stats.captured++;
+    replay->stats.mean_encode_ms = replay->total_encode_ms / replay->stats.captured;
+    replay->stats.max_encode_ms = MAX(replay->stats.max_encode_ms, ms);
+    SDL_UnlockMutex(replay->lock);
+    return true;
+}
+
+ReplayBuffer *replay_new(ReplaySettings settings) {
+    if (settings.max_bytes == 0) settings.max_bytes = DEFAULT_MAX_BYTES;
+    if (settings.max_seconds <= 0) settings.max_seconds = DEFAULT_MAX_SECONDS;
+    if (settings.keyframe_interval <= 0) settings.keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+
+    ReplayBuffer *replay = calloc(1, sizeof(ReplayBuffer));
+    replay->settings = settings;
+    replay->lock = SDL_CreateMutex();
+    // Recording mustn't hold up the frame, drop frames rather than wait
+    replay->encoder = worker_pool_new("bubbl replay", 1, 2, BACKPRESSURE_DROP);
+    replay->saver = worker_pool_new("bubbl replay save", 1, 1, BACKPRESSURE_DROP);
+    if (!replay->lock || !replay->encoder || !replay->saver) {
+        fprintf(stderr, "ERROR: unable to start replay buffer\n");
+        replay_free(replay);
+        return NULL;
+    }
+    return replay;
+}
+
+void replay_free(ReplayBuffer *replay) {
+    if (replay->saver) worker_pool_free(replay->saver);
+    if (replay->encoder) worker_pool_free(replay->encoder);
+    while (replay->count > 0) evict_oldest(replay);
+    free(replay->previous);
+    free(replay->scratch);
+    if (replay->lock) SDL_DestroyMutex(replay->lock);
+    free(replay);
+}
+
+bool replay_add_frame(ReplayBuffer *replay, uint8_t *pixels, int width, int height, double timestamp) {
+    EncodeJob *job = malloc(sizeof(EncodeJob));
+    *job = (EncodeJob){ replay, pixels, width, height, timestamp };
+    if (worker_pool_submit(replay->encoder, run_encode, job) >= 0) return true;
+    free(pixels);
+    free(job);
+    SDL_LockMutex(replay->lock);
+    replay->stats.dropped++;
+    SDL_UnlockMutex(replay->lock);
+    return false;
+}
+
+static void release_snapshot(SaveJob *job) {
+    SDL_LockMutex(job->replay->lock);
+    for (int i = 0; i < job->num_frames; i++) unref_frame(job->frames[i]);
+    job->replay->stats.saving--;
+    SDL_UnlockMutex(job->replay->lock);
+    free(job->frames);
+    free(job->path);
+    free(job);
+}
+
+static bool run_save(void *arg) {
+    SaveJob *job = arg;
+    ApngWriter *apng = NULL;
+    VideoSink *video = NULL;
+    bool ok = true;
+    if (job->target == SAVE_APNG) {
+        apng = apng_open(job->path, job->apng);
+        ok = apng != NULL;
+    } else if (job->target == SAVE_VIDEO) {
+        video = video_sink_open(job->path, job->video);
+        ok = video != NULL;
+    }
+
+    uint32_t *pixels = NULL;
+    int width = 0, height = 0;
+    for (int i = 0; ok && i < job->num_frames; i++) {
+        const ReplayFrame *frame = job->frames[i];
+        if (frame->width != width || frame->height != height) {
+            // Always a keyframe, which writes every pixel
+            free(pixels);
+            width = frame->width;
+            height = frame->height;
+            pixels = malloc((size_t)width * height * sizeof(uint32_t));
+        }
+        decode(frame, pixels);
+        const size_t bytes = (size_t)width * height * sizeof(uint32_t);
+        switch (job->target) {
+        case SAVE_APNG: {
+            uint8_t *copy = malloc(bytes);
+            memcpy(copy, pixels, bytes);
+            apng_add_frame(apng, copy, width, height, frame->timestamp);
+            break;
+        }
+        case SAVE_VIDEO:
+            video_sink_add_frame(video, (const uint8_t *)pixels, width, height, frame->timestamp);
+            break;
+        case SAVE_GIF:
+            if (job->gif_add_frame(job->gifski, (uint32_t)i, width, height, (const uint8_t *)pixels, frame->timestamp) != 0) {
+                ok = false;
+            }
+            break;
+        }
+    }
+    free(pixels);
+
+    if (apng) {
+        const ApngStats stats = apng_close(apng);
+        ok = ok && stats.frames > 0;
+    }
+    if (video) {
+        const VideoSinkStats stats = video_sink_close(video);
+        ok = ok && !stats.failed;
+    }
+    if (job->target == SAVE_GIF && job->gif_finish(job->gifski) != 0) ok = false;
+    if (!ok) fprintf(stderr, "WARNING: unable to save replay to %s\n", job->path ? job->path : "GIF");
+    release_snapshot(job);
+    return ok;
+}
+
+static int start_save(ReplayBuffer *replay, SaveJob *job) {
+    job->replay = replay;
+    SDL_LockMutex(replay->lock);
+    job->frames = malloc(MAX(replay->count, 1) * sizeof(ReplayFrame *));
+    for (int i = 0; i < replay->count; i++) {
+        ReplayFrame *frame = replay->frames[(replay->first + i) % MAX_FRAMES];
+        frame->refs++;
+        job->frames[job->num_frames++] = frame;
+    }
+    replay->stats.saving++;
+    SDL_UnlockMutex(replay->lock);
+
+    const int id = worker_pool_submit(replay->saver, run_save, job);
+    if (id < 0) {
+        fprintf(stderr, "WARNING: already saving a replay\n");
+        release_snapshot(job);
+    }
+    return id;
+}
+
+static char *copy_path(const char *path) {
+    const size_t len = strlen(path) + 1;
+    char *copy = malloc(len);
+    memcpy(copy, path, len);
+    return copy;
+}
+
+int replay_save_apng(ReplayBuffer *replay, const char *path, ApngSettings settings) {
+    SaveJob *job = calloc(1, sizeof(SaveJob));
+    job->target = SAVE_APNG;
+    job->path = copy_path(path);
+    // Nothing's waiting on the saving thread, never drop frames there
+    settings.backpressure = BACKPRESSURE_BLOCK;
+    job->apng = settings;
+    return start_save(replay, job);
+}
+
+int replay_save_video(ReplayBuffer *replay, const char *path, VideoSinkSettings settings) {
+    SaveJob *job = calloc(1, sizeof(SaveJob));
+    job->target = SAVE_VIDEO;
+    job->path = copy_path(path);
+    settings.block_when_full = true;
+    job->video = settings;
+    return start_save(replay, job);
+}
+
+int replay_save_gif(ReplayBuffer *replay, void *gifski, GifskiAddFrameFn add_frame, GifskiFinishFn finish) {
+    SaveJob *job = calloc(1, sizeof(SaveJob));
+    job->target = SAVE_GIF;
+    job->gifski = gifski;
+    job->gif_add_frame = add_frame;
+    job->gif_finish = finish;
+    return start_save(replay, job);
+}
+
+int replay_poll_saves(ReplayBuffer *replay, WorkResult *results, int max) {
+    return worker_pool_poll(replay->saver, results, max);
+}
+
+ReplayStats replay_stats(ReplayBuffer *replay) {
+    SDL_LockMutex(replay->lock);
+    ReplayStats stats = replay->stats;
+    stats.frames = replay->count;
+    stats.bytes = replay->bytes;
+    stats.raw_bytes = replay->raw_bytes;
+    if (replay->count > 1) {
+        stats.seconds = (float)(newest(replay)->timestamp - replay->frames[replay->first]->timestamp);
+    }
+    SDL_UnlockMutex(replay->lock);
+    return stats;
+}
@@ -0,0 +1,60 @@
+/**
+ * Instant replay: the last few seconds of frames, kept compressed in
+ * memory and saved on demand.
+ *
+ * Frames (usually captured small through an async readback) are encoded
+ * on a worker thread as runs against the previous frame: unchanged pixels,
+ * repeated pixels and literal pixels, with a keyframe every so often. The
+ * oldest keyframe and its deltas are evicted together once the buffer goes
+ * over its memory or time limit. Saving decodes a snapshot of the buffer
+ * into an APNG, video or GIF on a separate thread, while recording goes on.
+ */
+
+#ifndef REPLAY_BUFFER_H
+#define REPLAY_BUFFER_H
+#include "common.h"
+#include "apng_writer.h"
+#include "gif_recorder.h"
+#include "video_sink.h"
+#include "worker_pool.h"
+
+typedef struct {
+    size_t max_bytes;       // Compressed frames never take more than this
+    float max_seconds;
+    int keyframe_interval;  // Frames between keyframes
+} ReplaySettings;
+
+typedef struct {
+    int frames;             // In the buffer now
+    float seconds;
+    uint64_t bytes;
+    uint64_t raw_bytes;     // What the same frames take uncompressed
+    int captured;
+    int dropped;            // Encoder was busy
+    int evicted;
+    int saving;
+    float mean_encode_ms;
+    float max_encode_ms;
+} ReplayStats;
+
+typedef struct ReplayBuffer ReplayBuffer;
+
+ReplayBuffer *replay_new(ReplaySettings settings);
+// Waits for saves in progress
+void replay_free(ReplayBuffer *replay);
+
+// Takes ownership of `pixels` (malloc'd RGBA, top row first).
+// Returns false if dropped because the encoder is behind.
+bool replay_add_frame(ReplayBuffer *replay, uint8_t *pixels, int width, int height, double timestamp);
+
+// Save what's in the buffer now. Returns a job id for replay_poll_saves,
+// or -1 if a save is already queued.
+int replay_save_apng(ReplayBuffer *replay, const char *path, ApngSettings settings);
+int replay_save_video(ReplayBuffer *replay, const char *path, VideoSinkSettings settings);
+// gifski is finished (and freed) by the save
+int replay_save_gif(ReplayBuffer *replay, void *gifski, GifskiAddFrameFn add_frame, GifskiFinishFn finish);
+int replay_poll_saves(ReplayBuffer *replay, WorkResult *results, int max);
+
+ReplayStats replay_stats(ReplayBuffer *replay);
+
+#endif // REPLAY_BUFFER_H
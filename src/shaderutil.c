@@ -5,9 +5,22 @@
 #include "shaderutil.h"
 #include <stdlib.h>
 #include "common.h"
+#include "render_thread.h"
+#include "render_graph.h"
+#include "disk_cache.h"
+#include <SDL.h>
 #include <stdio.h>
 #include <assert.h>
 
+// Entry points the loader doesn't have. ISO C has no cast from the
+// `void *` SDL returns to a function pointer, so the bits are copied into
+// `fn`, which must point to a function pointer variable.
+static void load_gl_proc(void *fn, const char *name)
+{
+    void *proc = SDL_GL_GetProcAddress(name);
+    memcpy(fn, &proc, sizeof(proc));
+}
+
 static char* malloc_file_source(const char* fpath) {
     FILE* f;
     if ((f = fopen(fpath, "r")) == NULL) {
@@ -42,34 +55,25 @@ static const char* shaderTypeCStr(GLenum shaderType) {
 }
 
 
-static GLuint load_shader(GLenum shaderType, const char* source, const char *from) {
-    fflush(stdout);
+// Compiling is only started here, the status is checked once the program
+// is linked so the driver can work on every shader at once
+static GLuint compile_shader(GLenum shaderType, const char* source) {
     GLuint shader = glCreateShader(shaderType);
     glShaderSource(shader, 1, &source, NULL);
     glCompileShader(shader);
+    return shader;
+}
 
+static bool shader_compiled(GLuint shader, GLenum shaderType, const char *from) {
     GLint compiled = 0;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
     if (!compiled) {
         GLchar error_msg[GL_INFO_LOG_LENGTH];
         glGetShaderInfoLog(shader, GL_INFO_LOG_LENGTH, NULL, error_msg);
         fprintf(stderr, "Error compiling shader (%s Shader) (in %s) %s\n", shaderTypeCStr(shaderType), from, error_msg);
-        glDeleteShader(shader);
-        return 0;
+        return false;
     }
-    return shader;
-}
-
-static void build_shader(GLuint program, const char *source, GLenum type, const char *id) {
-    GLuint shader = load_shader(type, source, id);
-    if (!shader) exit(1);
-    glAttachShader(program, shader);
-}
-
-static void build_shader_from_file(GLuint program, const char *file_name, GLenum type) {
-    char *source = malloc_file_source(file_name);
-    build_shader(program, source, type, file_name);
-    free(source);
+    return true;
 }
 
 static const char* get_gl_error_message(GLenum err) {
@@ -85,8 +89,10 @@ static const char* get_gl_error_message(GLenum err) {
 
 #define VERT_POS_ATTRIB_INDEX 0
 
-void shader_init(Shader *sh) {
-    GLuint vbo; /* Don't need to hold on to this VBO name, it's in the VAO */
+// Vertex array objects aren't shared between contexts,
+// so this is done separately from building the program
+void shader_init_quad(Shader *sh) {
+    GLuint vbo; /* Don't need to hold on to this VBO name, the VAO keeps it alive */
     // Gen
     glGenBuffers(1, &vbo);
     glGenVertexArrays(1, &sh->vao);
@@ -102,22 +108,304 @@ void shader_init(Shader *sh) {
     // Cleanup
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
+    // Only frees the name, the buffer goes with the VAO
+    glDeleteBuffers(1, &vbo);
+}
+
+// KHR_parallel_shader_compile, also not in the loader
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (GLAD_API_PTR *MaxShaderCompilerThreadsFn)(GLuint count);
+
+static bool parallel_compile = false;
 
-    sh->program = glCreateProgram();
+void shader_parallel_compile_init(void)
+{
+    MaxShaderCompilerThreadsFn max_threads = NULL;
+    if (SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile")) {
+        load_gl_proc(&max_threads, "glMaxShaderCompilerThreadsKHR");
+    } else if (SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile")) {
+        load_gl_proc(&max_threads, "glMaxShaderCompilerThreadsARB");
+    }
+    if (!max_threads) return;
+    // As many as the driver likes
+    max_threads(0xFFFFFFFF);
+    parallel_compile = true;
+    fprintf(stderr, "INFO: Compiling shaders in parallel\n");
 }
 
-static void link_shader_program(Shader *sh) {
-    glLinkProgram(sh->program);
+bool shader_parallel_compile(void)
+{
+    return parallel_compile;
+}
 
+/*
+ * Linked programs are cached on disk with ARB_get_program_binary (core in
+ * GL 4.1, which the loader doesn't cover, so the entry points are looked
+ * up here). A binary is keyed by a hash of the driver and both sources, so
+ * any change to a shader, including its #defines, or to the driver misses.
+ * The driver may still reject a binary, e.g. after an update that kept its
+ * version string; it's deleted and the program compiled again.
+ */
+
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_PROGRAM_BINARY_FORMATS 0x87FF
+typedef void (GLAD_API_PTR *GetProgramBinaryFn)(GLuint program, GLsizei size, GLsizei *length, GLenum *format, void *binary);
+typedef void (GLAD_API_PTR *ProgramBinaryFn)(GLuint program, GLenum format, const void *binary, GLsizei length);
+typedef void (GLAD_API_PTR *ProgramParameteriFn)(GLuint program, GLenum name, GLint value);
+
+#define PROGRAM_CACHE_VERSION 1
+#define MAX_BINARY_FORMATS 8
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t format;
+    uint32_t length;
+    uint64_t key;
+} ProgramCacheHeader;
+
+static struct {
+    bool enabled;
+    char dir[480];
+    uint64_t driver;
+    GLint formats[MAX_BINARY_FORMATS];
+    int num_formats;
+    GetProgramBinaryFn get_program_binary;
+    ProgramBinaryFn program_binary;
+    ProgramParameteriFn program_parameteri;
+    SDL_atomic_t hits, misses, rejected;
+} cache = { 0 };
+
+void shader_cache_init(const char *dir)
+{
+    if (!dir || !dir[0]) return;
+    GLint num_formats = 0;
+    if (SDL_GL_ExtensionSupported("GL_ARB_get_program_binary")) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    }
+    if (num_formats <= 0) {
+        fprintf(stderr, "INFO: Program binaries not supported, shaders aren't cached\n");
+        return;
+    }
+    GLint formats[64] = { 0 };
+    glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats);
+    cache.num_formats = MIN(MIN(num_formats, 64), MAX_BINARY_FORMATS);
+    memcpy(cache.formats, formats, cache.num_formats * sizeof(GLint));
+    load_gl_proc(&cache.get_program_binary, "glGetProgramBinary");
+    load_gl_proc(&cache.program_binary, "glProgramBinary");
+    load_gl_proc(&cache.program_parameteri, "glProgramParameteri");
+    if (!cache.get_program_binary || !cache.program_binary || !cache.program_parameteri) return;
+
+    const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+    for (size_t i = 0; i < STATIC_LEN(strings); i++) {
+        const char *s = (const char *)glGetString(strings[i]);
+        if (s) cache.driver = cache_hash(s, strlen(s), cache.driver);
+    }
+    snprintf(cache.dir, sizeof(cache.dir), "%s", dir);
+    cache_make_dirs(cache.dir);
+    cache.enabled = true;
+}
+
+ShaderCacheStats shader_cache_stats(void)
+{
+    return (ShaderCacheStats){
+        .hits = SDL_AtomicGet(&cache.hits),
+        .misses = SDL_AtomicGet(&cache.misses),
+        .rejected = SDL_AtomicGet(&cache.rejected),
+    };
+}
+
+static bool known_format(GLenum format)
+{
+    for (int i = 0; i < cache.num_formats; i++) {
+        if ((GLenum)cache.formats[i] == format) return true;
+    }
+    return false;
+}
+
+// The cached program, or 0 if there's none the driver takes
+static GLuint load_cached_program(const char *path, uint64_t key)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    ProgramCacheHeader header;
+    void *binary = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "BUBP", 4) == 0
+        && header.version == PROGRAM_CACHE_VERSION && header.key == key && known_format(header.format)) {
+        binary = malloc(header.length);
+        if (binary && fread(binary, 1, header.length, file) != header.length) {
+            free(binary);
+            binary = NULL;
+        }
+    }
+    fclose(file);
+    if (!binary) return 0;
+
+    GLuint program = glCreateProgram();
+    cache.program_binary(program, header.format, binary, header.length);
+    free(binary);
     GLint linked = 0;
-    glGetProgramiv(sh->program, GL_LINK_STATUS, &linked);
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
     if (!linked) {
-        GLchar error_msg[GL_INFO_LOG_LENGTH];
-        glGetProgramInfoLog(sh->program, GL_INFO_LOG_LENGTH, NULL, error_msg);
-        fprintf(stderr, "Error linking program: %s\n", error_msg);
-        glDeleteProgram(sh->program);
-        exit(1);
+        glDeleteProgram(program);
+        SDL_AtomicAdd(&cache.rejected, 1);
+        remove(path);
+        return 0;
+    }
+    return program;
+}
+
+static void store_program(const char *path, uint64_t key, GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    void *binary = malloc(length);
+    GLenum format = 0;
+    cache.get_program_binary(program, length, &length, &format, binary);
+    const ProgramCacheHeader header = { { 'B', 'U', 'B', 'P' }, PROGRAM_CACHE_VERSION, format, length, key };
+    cache_write(path, &header, sizeof(header), binary, length);
+    free(binary);
+}
+
+static void cache_path(char *path, size_t size, uint64_t key)
+{
+    snprintf(path, size, "%s/%016llx.bin", cache.dir, (unsigned long long)key);
+}
+
+struct PendingProgram {
+    GLuint program;
+    GLuint vertex, fragment; // 0 when it came from the cache
+    uint64_t key;
+    char vertex_from[128], fragment_from[128];
+};
+
+PendingProgram *shader_submit_program(const char *vertex_from, const char *vertex_source,
+                                      const char *fragment_from, const char *fragment_source)
+{
+    PendingProgram *pending = calloc(1, sizeof(PendingProgram));
+    snprintf(pending->vertex_from, sizeof(pending->vertex_from), "%s", vertex_from);
+    snprintf(pending->fragment_from, sizeof(pending->fragment_from), "%s", fragment_from);
+    if (cache.enabled) {
+        pending->key = cache_hash(vertex_source, strlen(vertex_source), cache.driver);
+        pending->key = cache_hash(fragment_source, strlen(fragment_source), pending->key);
+        char path[512];
+        cache_path(path, sizeof(path), pending->key);
+        pending->program = load_cached_program(path, pending->key);
+        if (pending->program) {
+            SDL_AtomicAdd(&cache.hits, 1);
+            return pending;
+        }
+        SDL_AtomicAdd(&cache.misses, 1);
     }
+
+    pending->fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    pending->vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    pending->program = glCreateProgram();
+    glAttachShader(pending->program, pending->fragment);
+    glAttachShader(pending->program, pending->vertex);
+    if (cache.enabled) cache.program_parameteri(pending->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(pending->program);
+    return pending;
+}
+
+PendingProgram *shader_submit_files(const char *vertex_filename, const char *fragment_filename)
+{
+    char *vertex_source = malloc_file_source(vertex_filename);
+    char *fragment_source = malloc_file_source(fragment_filename);
+    PendingProgram *pending = shader_submit_program(vertex_filename, vertex_source, fragment_filename, fragment_source);
+    free(vertex_source);
+    free(fragment_source);
+    return pending;
+}
+
+bool shader_program_ready(PendingProgram *pending)
+{
+    if (!parallel_compile || !pending->fragment) return true;
+    GLint done = 0;
+    glGetProgramiv(pending->program, GL_COMPLETION_STATUS_KHR, &done);
+    return done;
+}
+
+GLuint shader_finish_program(PendingProgram *pending)
+{
+    GLuint program = pending->program;
+    if (pending->fragment) {
+        const bool compiled = shader_compiled(pending->fragment, GL_FRAGMENT_SHADER, pending->fragment_from)
+                            & shader_compiled(pending->vertex, GL_VERTEX_SHADER, pending->vertex_from);
+        glDeleteShader(pending->fragment);
+        glDeleteShader(pending->vertex);
+
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            // Compile errors were printed already and make for a useless link log
+            if (compiled) {
+                GLchar error_msg[GL_INFO_LOG_LENGTH];
+                glGetProgramInfoLog(program, GL_INFO_LOG_LENGTH, NULL, error_msg);
+                fprintf(stderr, "Error linking program (in %s): %s\n", pending->fragment_from, error_msg);
+            }
+            glDeleteProgram(program);
+            program = 0;
+        } else if (cache.enabled) {
+            char path[512];
+            cache_path(path, sizeof(path), pending->key);
+            store_program(path, pending->key, program);
+        }
+    }
+    free(pending);
+    return program;
+}
+
+// Like shader_program_from_source, but reports failure by returning 0
+// instead of exiting. Used when building programs in the background.
+GLuint shader_try_link_from_source(const char *id, const char *vertex_source, const char *fragment_source)
+{
+    return shader_finish_program(shader_submit_program(id, vertex_source, id, fragment_source));
+}
+
+typedef struct {
+    const char *id;
+    const char *vertex_source;
+    const char *fragment_source;
+    PendingProgram *pending;
+} SourceSubmission;
+
+static void submit_source(void *arg)
+{
+    SourceSubmission *s = arg;
+    s->pending = shader_submit_program(s->id, s->vertex_source, s->id, s->fragment_source);
+}
+
+PendingProgram *shader_submit_source(const char *id, const char *vertex_source, const char *fragment_source)
+{
+    SourceSubmission s = { id, vertex_source, fragment_source, NULL };
+    render_thread_invoke(submit_source, &s);
+    return s.pending;
+}
+
+typedef struct {
+    PendingProgram *pending;
+    Shader *shader;
+    bool done;
+} ProgramPoll;
+
+static void poll_program(void *arg)
+{
+    ProgramPoll *poll = arg;
+    if (!shader_program_ready(poll->pending)) return;
+    poll->done = true;
+    poll->shader->program = shader_finish_program(poll->pending);
+    if (poll->shader->program) shader_init_quad(poll->shader);
+}
+
+bool shader_poll_program(PendingProgram *pending, Shader *shader)
+{
+    ProgramPoll poll = { pending, shader, false };
+    render_thread_invoke(poll_program, &poll);
+    return poll.done;
 }
 
 void check_gl_error(const char *file, const int line) {
@@ -129,32 +417,155 @@ void check_gl_error(const char *file, const int line) {
 }
 
 void shader_program_from_files(Shader *sh, const char *vert_filename, const char *frag_filename) {
-    shader_init(sh);
-    build_shader_from_file(sh->program, vert_filename, GL_VERTEX_SHADER); 
-    build_shader_from_file(sh->program, frag_filename, GL_FRAGMENT_SHADER); 
-    link_shader_program(sh);
+    shader_init_quad(sh);
+    sh->program = shader_finish_program(shader_submit_files(vert_filename, frag_filename));
+    if (!sh->program) exit(1);
+}
+
+typedef struct {
+    Shader *shader;
+    const char *id;
+    const char *vertex_source;
+    const char *fragment_source;
+} ProgramSources;
+
+static void build_program_from_source(void *arg)
+{
+    ProgramSources *src = arg;
+    shader_init_quad(src->shader);
+    src->shader->program = shader_try_link_from_source(src->id, src->vertex_source, src->fragment_source);
+    if (!src->shader->program) exit(1);
 }
 
 void shader_program_from_source(Shader *shader, const char *id, const char *vertex_source, const char *fragment_source)
 {
-    shader_init(shader);
-    build_shader(shader->program, fragment_source, GL_FRAGMENT_SHADER, id);
-    build_shader(shader->program, vertex_source, GL_VERTEX_SHADER, id);
-    link_shader_program(shader);
+    ProgramSources src = { shader, id, vertex_source, fragment_source };
+    render_thread_invoke(build_program_from_source, &src);
 }
 
-void use_shader_program(Shader *shader)
+static void bind_program(const Shader *shader)
 {
     glUseProgram(shader->program);
     glBindVertexArray(shader->vao);
 }
 
-void run_shader_program(Shader *shader)
+static void draw_program(const Shader *shader)
 {
-    use_shader_program(shader);
+    bind_program(shader);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
     glBindVertexArray(0);
     glUseProgram(0);
 }
 
+static void replay_use(void *payload) { bind_program(payload); }
+static void replay_run(void *payload) { draw_program(payload); }
+
+void use_shader_program(Shader *shader)
+{
+    if (render_thread_active()) {
+        render_thread_record_copy(replay_use, shader, sizeof(Shader));
+        return;
+    }
+    bind_program(shader);
+}
+
+void run_shader_program(Shader *shader)
+{
+    if (render_thread_active()) {
+        render_thread_record_copy(replay_run, shader, sizeof(Shader));
+        return;
+    }
+    draw_program(shader);
+}
+
+/*
+ * Uniforms of the currently used program.
+ * Lua goes through these rather than calling glUniform* directly
+ * so that they can be recorded for the render thread.
+ */
+
+typedef struct {
+    GLuint program;
+    const char *name;
+    GLint location;
+} UniformQuery;
+
+static void query_uniform_location(void *arg)
+{
+    UniformQuery *q = arg;
+    q->location = glGetUniformLocation(q->program, q->name);
+}
+
+int shader_uniform_location(unsigned int program, const char *name)
+{
+    UniformQuery q = { program, name, -1 };
+    render_thread_invoke(query_uniform_location, &q);
+    return q.location;
+}
+
+// Recorded uniform upload, `count` vectors of `components` floats follow
+typedef struct {
+    GLint location;
+    int components;
+    int count;
+} UniformValues;
+
+void shader_upload_uniform(GLint location, int components, int count, const float *values)
+{
+    switch (components) {
+        case 1: glUniform1fv(location, count, values); break;
+        case 2: glUniform2fv(location, count, values); break;
+        case 4: glUniform4fv(location, count, values); break;
+        default: assert(false && "unsupported uniform size");
+    }
+}
+
+static void replay_uniform(void *payload)
+{
+    UniformValues *u = payload;
+    shader_upload_uniform(u->location, u->components, u->count, (const float *)(u + 1));
+}
+
+static void set_uniform(GLint location, int components, int count, const float *values)
+{
+    if (render_graph_capturing()) {
+        render_graph_capture_uniform(location, components, count, values);
+        return;
+    }
+    if (render_thread_active()) {
+        const size_t bytes = sizeof(float) * components * count;
+        UniformValues *u = render_thread_record(replay_uniform, sizeof(UniformValues) + bytes);
+        *u = (UniformValues){ location, components, count };
+        memcpy(u + 1, values, bytes);
+        return;
+    }
+    shader_upload_uniform(location, components, count, values);
+}
+
+void shader_uniform1f(int uni, float f)
+{
+    set_uniform(uni, 1, 1, &f);
+}
+
+void shader_uniform2f(int uni, float x, float y)
+{
+    const float v[2] = { x, y };
+    set_uniform(uni, 2, 1, v);
+}
+
+void shader_uniform4f(int uni, float r, float g, float b, float a)
+{
+    const float v[4] = { r, g, b, a };
+    set_uniform(uni, 4, 1, v);
+}
+
+void shader_uniform2fv(int uni, int count, const float *values)
+{
+    set_uniform(uni, 2, count, values);
+}
+
+void shader_uniform4fv(int uni, int count, const float *values)
+{
+    set_uniform(uni, 4, count, values);
+}
@@ -6,6 +6,7 @@
 #ifndef SHADER_UTIL_H
 #define SHADER_UTIL_H
 #include <gl.h>
+#include <stdbool.h>
 
 #define UNI_DECL(N) GLint N;
 #define UNI_GETS(NAME) (sh)->uniforms.NAME = glGetUniformLocation((sh)->shader.program, #NAME);
@@ -14,9 +15,54 @@
 
 typedef struct { GLuint program; GLuint vao; } Shader;
 
+typedef struct {
+    int hits;
+    int misses;
+    int rejected; // Binaries the driver wouldn't load, also counted as misses
+} ShaderCacheStats;
+
+// Cache linked programs as binaries in `dir`, NULL or "" doesn't. Call
+// with the context current before building any programs.
+void shader_cache_init(const char *dir);
+ShaderCacheStats shader_cache_stats(void);
+
+/*
+ * Building a program in two steps: submitting starts compiling and
+ * linking, finishing checks the result, printing any errors. Submit
+ * every program that's needed before finishing any so the driver can
+ * compile them side by side. With parallel compiling, ready says
+ * whether finishing would still wait. All on the GL thread.
+ */
+typedef struct PendingProgram PendingProgram;
+// Use KHR_parallel_shader_compile if there is, before building programs
+void shader_parallel_compile_init(void);
+bool shader_parallel_compile(void);
+PendingProgram *shader_submit_program(const char *vertex_from, const char *vertex_source,
+                                      const char *fragment_from, const char *fragment_source);
+PendingProgram *shader_submit_files(const char *vertex_filename, const char *fragment_filename);
+bool shader_program_ready(PendingProgram *pending);
+// Frees `pending`, returns the program or 0 if it failed
+GLuint shader_finish_program(PendingProgram *pending);
+
+// The same from any thread, for Lua. Polling returns false until the
+// program is finished, `shader` then has a program and quad or 0 if it
+// failed and `pending` is freed.
+PendingProgram *shader_submit_source(const char *id, const char *vertex_source, const char *fragment_source);
+bool shader_poll_program(PendingProgram *pending, Shader *shader);
+
 void shader_program_from_files(Shader *sh, const char *vertex_filename, const char *fragment_filename);
 void shader_program_from_source(Shader *shader, const char *id, const char *vertex_source, const char *fragment_source);
 void run_shader_program(Shader *shader);
+void shader_init_quad(Shader *sh);
+GLuint shader_try_link_from_source(const char *id, const char *vertex_source, const char *fragment_source);
 void use_shader_program(Shader *shader);
 
+void shader_upload_uniform(GLint location, int components, int count, const float *values);
+int shader_uniform_location(unsigned int program, const char *name);
+void shader_uniform1f(int uni, float f);
+void shader_uniform2f(int uni, float x, float y);
+void shader_uniform4f(int uni, float r, float g, float b, float a);
+void shader_uniform2fv(int uni, int count, const float *values);
+void shader_uniform4fv(int uni, int count, const float *values);
+
 #endif
@@ -0,0 +1,50 @@
+#include "startup_timeline.h"
+#include <SDL.h>
+#include <stdio.h>
+
+static struct {
+    SDL_SpinLock lock;
+    bool done;
+    uint64_t start;
+    int count;
+    struct {
+        char what[40];
+        uint64_t time;
+    } marks[STARTUP_MAX_MARKS];
+} timeline = { 0 };
+
+static double ms_since_start(uint64_t time)
+{
+    return (time - timeline.start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+void startup_mark(const char *what)
+{
+    const uint64_t now = SDL_GetPerformanceCounter();
+    SDL_AtomicLock(&timeline.lock);
+    if (!timeline.done && timeline.count < STARTUP_MAX_MARKS) {
+        if (timeline.count == 0) timeline.start = now;
+        snprintf(timeline.marks[timeline.count].what, sizeof(timeline.marks[0].what), "%s", what);
+        timeline.marks[timeline.count].time = now;
+        timeline.count++;
+    }
+    SDL_AtomicUnlock(&timeline.lock);
+}
+
+void startup_presented(void)
+{
+    if (timeline.done) return;
+    startup_mark("first frame presented");
+    SDL_AtomicLock(&timeline.lock);
+    timeline.done = true;
+    SDL_AtomicUnlock(&timeline.lock);
+
+    fprintf(stderr, "INFO: Startup timeline, ms since main()\n");
+    uint64_t previous = timeline.start;
+    for (int i = 0; i < timeline.count; i++) {
+        const uint64_t time = timeline.marks[i].time;
+        fprintf(stderr, "INFO: %9.1f %+9.1f  %s\n", ms_since_start(time),
+                (time - previous) * 1000.0 / SDL_GetPerformanceFrequency(), timeline.marks[i].what);
+        previous = time;
+    }
+}
@@ -0,0 +1,20 @@
+/**
+ * Where the time goes between main() and the first presented frame.
+ *
+ * Marks are stamped with the time since the first one, which main() makes
+ * as it starts. The timeline is printed once the first frame has been
+ * swapped, marks after that are ignored. Any thread.
+ */
+
+#ifndef STARTUP_TIMELINE_H
+#define STARTUP_TIMELINE_H
+#include "common.h"
+
+#define STARTUP_MAX_MARKS 32
+
+// `what` just happened
+void startup_mark(const char *what);
+// Marks the first present and prints the timeline, later calls do nothing
+void startup_presented(void);
+
+#endif // STARTUP_TIMELINE_H
@@ -0,0 +1,179 @@
+/*
+ * Buffer i is written by Lua between being mapped and being drawn. The
+ * mapped pointers are published by the GL thread under a lock, and the
+ * Lua thread clears its slot when it records the draw, so a pointer that
+ * has already been handed to the driver is never returned again.
+ */
+
+#include "stream_canvas.h"
+#include "background_renderer.h"
+#include "gpu_resources.h"
+#include "render_thread.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct StreamCanvas {
+    int width, height;
+    size_t bytes;
+    int buffer_count;
+    GLuint texture;
+    GLuint buffers[STREAM_CANVAS_MAX_BUFFERS];
+    // The GL objects are deleted through these, with the canvas or its owner
+    GpuHandle texture_handle;
+    GpuHandle buffer_handles[STREAM_CANVAS_MAX_BUFFERS];
+    Pixel *fallback; // Written instead when a buffer can't be mapped
+
+    SDL_mutex *lock;
+    Pixel *mapped[STREAM_CANVAS_MAX_BUFFERS];
+
+    // GL thread only
+    bool is_mapped[STREAM_CANVAS_MAX_BUFFERS];
+
+    // Lua thread only
+    int next; // The buffer the next draw uploads
+    StreamCanvasStats stats;
+};
+
+typedef struct {
+    StreamCanvas *canvas;
+    int index;
+} StreamDraw;
+
+static void map_buffer(StreamCanvas *canvas, int i)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, canvas->buffers[i]);
+    // Invalidating lets the driver hand out fresh memory rather than wait
+    // for the upload still reading the old contents
+    Pixel *p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, canvas->bytes,
+                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!p) fprintf(stderr, "WARNING: unable to map canvas buffer, uploading from client memory\n");
+    canvas->is_mapped[i] = p != NULL;
+
+    SDL_LockMutex(canvas->lock);
+    canvas->mapped[i] = p ? p : canvas->fallback;
+    SDL_UnlockMutex(canvas->lock);
+}
+
+static void create_buffers(void *arg)
+{
+    StreamCanvas *canvas = arg;
+    canvas->texture = bg_new_texture(NULL, canvas->width, canvas->height);
+    glGenBuffers(canvas->buffer_count, canvas->buffers);
+    for (int i = 0; i < canvas->buffer_count; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, canvas->buffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, canvas->bytes, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    // The last one is mapped by the first draw
+    for (int i = 0; i < canvas->buffer_count - 1; i++) {
+        map_buffer(canvas, i);
+    }
+}
+
+StreamCanvas *stream_canvas_new(int width, int height, int buffers)
+{
+    StreamCanvas *canvas = calloc(1, sizeof(StreamCanvas));
+    canvas->width = width;
+    canvas->height = height;
+    canvas->bytes = (size_t)width * height * sizeof(Pixel);
+    canvas->buffer_count = MAX(2, MIN(buffers, STREAM_CANVAS_MAX_BUFFERS));
+    canvas->fallback = malloc(canvas->bytes);
+    canvas->lock = SDL_CreateMutex();
+    render_thread_invoke(create_buffers, canvas);
+    canvas->texture_handle = gpu_register(GPU_TEXTURE, canvas->texture, canvas->bytes, NULL, "stream canvas", false);
+    for (int i = 0; i < canvas->buffer_count; i++) {
+        canvas->buffer_handles[i] = gpu_register(GPU_BUFFER, canvas->buffers[i], canvas->bytes,
+                                                 NULL, "stream canvas", false);
+    }
+    return canvas;
+}
+
+static void replay_draw(void *payload)
+{
+    StreamDraw *draw = payload;
+    StreamCanvas *canvas = draw->canvas;
+    const int i = draw->index;
+    if (canvas->is_mapped[i]) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, canvas->buffers[i]);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        canvas->is_mapped[i] = false;
+        // With the buffer bound the pixel pointer is an offset into it
+        bg_draw_texture(canvas->texture, NULL, canvas->width, 0, 0, canvas->width, canvas->height);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    } else {
+        bg_draw_texture(canvas->texture, canvas->fallback, canvas->width, 0, 0, canvas->width, canvas->height);
+    }
+    map_buffer(canvas, (i + canvas->buffer_count - 1) % canvas->buffer_count);
+}
+
+static void wait_for_render_thread(void *arg)
+{
+    (void)arg;
+}
+
+Pixel *stream_canvas_data(StreamCanvas *canvas)
+{
+    // Its owner was released, there's nothing left to draw
+    if (!gpu_alive(canvas->texture_handle)) return canvas->fallback;
+    const int i = canvas->next;
+    SDL_LockMutex(canvas->lock);
+    Pixel *p = canvas->mapped[i];
+    SDL_UnlockMutex(canvas->lock);
+    if (p) return p;
+
+    // The draw that maps it hasn't been replayed yet
+    canvas->stats.waits++;
+    render_thread_invoke(wait_for_render_thread, NULL);
+    SDL_LockMutex(canvas->lock);
+    p = canvas->mapped[i];
+    SDL_UnlockMutex(canvas->lock);
+    return p ? p : canvas->fallback;
+}
+
+void stream_canvas_draw(StreamCanvas *canvas)
+{
+    if (!gpu_touch(canvas->texture_handle)) return;
+    const StreamDraw draw = { canvas, canvas->next };
+    SDL_LockMutex(canvas->lock);
+    canvas->mapped[draw.index] = NULL;
+    SDL_UnlockMutex(canvas->lock);
+    canvas->next = (canvas->next + 1) % canvas->buffer_count;
+    canvas->stats.draws++;
+    canvas->stats.bytes += canvas->bytes;
+
+    if (render_thread_active()) {
+        render_thread_record_copy(replay_draw, &draw, sizeof(draw));
+        return;
+    }
+    replay_draw((void *)&draw);
+}
+
+static void free_canvas(void *payload)
+{
+    StreamCanvas *canvas = *(StreamCanvas **)payload;
+    SDL_DestroyMutex(canvas->lock);
+    free(canvas->fallback);
+    free(canvas);
+}
+
+void stream_canvas_free(StreamCanvas *canvas)
+{
+    // Deleting a mapped buffer unmaps it
+    gpu_release(canvas->texture_handle);
+    for (int i = 0; i < canvas->buffer_count; i++) {
+        gpu_release(canvas->buffer_handles[i]);
+    }
+    // Draws already recorded still use the canvas
+    if (render_thread_active()) {
+        render_thread_record_copy(free_canvas, &canvas, sizeof(canvas));
+        return;
+    }
+    free_canvas(&canvas);
+}
+
+StreamCanvasStats stream_canvas_stats(StreamCanvas *canvas)
+{
+    return canvas->stats;
+}
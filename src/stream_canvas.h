@@ -0,0 +1,37 @@
+/**
+ * Canvases that change every frame, uploaded through a ring of pixel
+ * unpack buffers.
+ *
+ * Lua writes straight into a mapped buffer. Drawing unmaps it and starts
+ * the texture upload from it, which the driver does asynchronously instead
+ * of copying client memory before glTexSubImage2D returns. The buffer used
+ * `buffers - 1` draws later is mapped at the same time, so with the render
+ * thread the pointer is normally ready well before Lua asks for it.
+ *
+ * Mapping invalidates the buffer: every pixel has to be written again
+ * before each draw.
+ */
+
+#ifndef STREAM_CANVAS_H
+#define STREAM_CANVAS_H
+#include "common.h"
+
+#define STREAM_CANVAS_MAX_BUFFERS 4
+
+typedef struct {
+    int draws;
+    int waits;      // Times the Lua thread waited for a buffer to be mapped
+    uint64_t bytes;
+} StreamCanvasStats;
+
+typedef struct StreamCanvas StreamCanvas;
+
+// `buffers` is clamped to 2-STREAM_CANVAS_MAX_BUFFERS
+StreamCanvas *stream_canvas_new(int width, int height, int buffers);
+void stream_canvas_free(StreamCanvas *canvas);
+// Where to write the pixels for the next draw. Valid until that draw.
+Pixel *stream_canvas_data(StreamCanvas *canvas);
+void stream_canvas_draw(StreamCanvas *canvas);
+StreamCanvasStats stream_canvas_stats(StreamCanvas *canvas);
+
+#endif // STREAM_CANVAS_H
@@ -0,0 +1,403 @@
+/*
+ * Tiles are found through a hash table of chunks, CHUNK_TILES tiles on a
+ * side, allocated along with the first tile written in them, so nothing
+ * is kept for the parts of the canvas that are never touched. The texture
+ * array's layers are slots: a resident tile knows its slot and the slot
+ * points back at the tile.
+ *
+ * A draw copies the tiles it uploads, so Lua can keep writing to them
+ * while the render thread replays it.
+ */
+
+#include "tiled_canvas.h"
+#include "canvas_kernels.h"
+#include "gpu_resources.h"
+#include "render_thread.h"
+#include "render_view.h"
+#include "shaderutil.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_TILE_SIZE 256
+#define DEFAULT_RESIDENT 64
+#define CHUNK_TILES 64
+
+typedef struct {
+    Pixel *pixels;       // NULL until written to
+    int slot;            // Texture array layer, -1 if not resident
+    bool dirty;
+    uint64_t last_drawn; // Draw number
+} Tile;
+
+typedef struct {
+    int cx, cy;
+    Tile tiles[CHUNK_TILES * CHUNK_TILES];
+} Chunk;
+
+// Per instance, where a tile goes in the scene and which layer it's in
+typedef struct {
+    float x, y;
+    float layer;
+} TileInstance;
+
+struct TiledCanvas {
+    int width, height;
+    int tile_size;
+    int tiles_x, tiles_y;
+    Chunk **chunks; // Open addressing, a power of two long
+    int table_size, num_chunks;
+
+    int capacity;
+    Tile **slots;    // The tile in each layer
+    Tile **visible;  // Scratch for drawing, `capacity` long
+    int *visible_at; // And their tile x, y
+    uint64_t draws;
+    bool warned; // About running out of room
+
+    GLuint texture, buffer, vao;
+    GpuHandle texture_handle, buffer_handle, vao_handle;
+    TiledCanvasStats stats;
+};
+
+// Recorded draw: the instances, the slots to upload and their pixels follow
+typedef struct {
+    TiledCanvas *canvas;
+    int instances, uploads;
+    float extent; // Scene pixels per tile
+} TiledDraw;
+
+// Shared by every tiled canvas, made with the first one
+static struct {
+    Shader shader;
+    GLint view, extent;
+    bool ready;
+} program = { 0 };
+
+static void create_gl(void *arg)
+{
+    TiledCanvas *canvas = arg;
+    if (!program.ready) {
+        shader_program_from_files(&program.shader, "shaders/tiled_canvas.vert", "shaders/tiled_canvas.frag");
+        program.view = glGetUniformLocation(program.shader.program, "view");
+        program.extent = glGetUniformLocation(program.shader.program, "extent");
+        program.ready = true;
+    }
+    GLint max_size = 0, max_layers = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    canvas->tile_size = MIN(canvas->tile_size, max_size);
+    canvas->capacity = MIN(canvas->capacity, max_layers);
+
+    glGenTextures(1, &canvas->texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, canvas->texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, canvas->tile_size, canvas->tile_size, canvas->capacity,
+                 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // The quad, plus one instance per tile
+    Shader quad;
+    shader_init_quad(&quad);
+    canvas->vao = quad.vao;
+    glBindVertexArray(canvas->vao);
+    glGenBuffers(1, &canvas->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, canvas->buffer);
+    glBufferData(GL_ARRAY_BUFFER, canvas->capacity * sizeof(TileInstance), NULL, GL_STREAM_DRAW);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void *)offsetof(TileInstance, x));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void *)offsetof(TileInstance, layer));
+    glVertexAttribDivisor(2, 1);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+TiledCanvas *tiled_canvas_new(int width, int height, int tile_size, int resident)
+{
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "WARNING: invalid tiled canvas size %dx%d\n", width, height);
+        return NULL;
+    }
+    TiledCanvas *canvas = calloc(1, sizeof(TiledCanvas));
+    canvas->width = width;
+    canvas->height = height;
+    canvas->tile_size = tile_size > 0 ? tile_size : DEFAULT_TILE_SIZE;
+    canvas->capacity = resident > 0 ? resident : DEFAULT_RESIDENT;
+    render_thread_invoke(create_gl, canvas);
+
+    const int ts = canvas->tile_size;
+    canvas->tiles_x = (width + ts - 1) / ts;
+    canvas->tiles_y = (height + ts - 1) / ts;
+    canvas->table_size = 16;
+    canvas->chunks = calloc(canvas->table_size, sizeof(Chunk *));
+    canvas->slots = calloc(canvas->capacity, sizeof(Tile *));
+    canvas->visible = calloc(canvas->capacity, sizeof(Tile *));
+    canvas->visible_at = calloc(canvas->capacity * 2, sizeof(int));
+    canvas->stats.capacity = canvas->capacity;
+
+    const uint64_t layer_bytes = (uint64_t)ts * ts * sizeof(Pixel);
+    canvas->texture_handle = gpu_register(GPU_TEXTURE, canvas->texture, layer_bytes * canvas->capacity,
+                                          NULL, "tiled canvas", false);
+    canvas->buffer_handle = gpu_register(GPU_BUFFER, canvas->buffer, canvas->capacity * sizeof(TileInstance),
+                                         NULL, "tiled canvas", false);
+    canvas->vao_handle = gpu_register(GPU_VERTEX_ARRAY, canvas->vao, 0, NULL, "tiled canvas", false);
+    return canvas;
+}
+
+static void free_canvas(void *payload)
+{
+    free(*(TiledCanvas **)payload);
+}
+
+void tiled_canvas_free(TiledCanvas *canvas)
+{
+    if (!canvas) return;
+    gpu_release(canvas->texture_handle);
+    gpu_release(canvas->buffer_handle);
+    gpu_release(canvas->vao_handle);
+    for (int i = 0; i < canvas->table_size; i++) {
+        if (!canvas->chunks[i]) continue;
+        for (int t = 0; t < CHUNK_TILES * CHUNK_TILES; t++) {
+            free(canvas->chunks[i]->tiles[t].pixels);
+        }
+        free(canvas->chunks[i]);
+    }
+    free(canvas->chunks);
+    free(canvas->slots);
+    free(canvas->visible);
+    free(canvas->visible_at);
+    // Draws already recorded still use the canvas
+    if (render_thread_active()) {
+        render_thread_record_copy(free_canvas, &canvas, sizeof(canvas));
+        return;
+    }
+    free_canvas(&canvas);
+}
+
+int tiled_canvas_tile_size(TiledCanvas *canvas)
+{
+    return canvas->tile_size;
+}
+
+static Chunk **chunk_entry(Chunk **table, int size, int cx, int cy)
+{
+    uint32_t i = ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & (size - 1);
+    while (table[i] && (table[i]->cx != cx || table[i]->cy != cy)) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+static Chunk *add_chunk(TiledCanvas *canvas, int cx, int cy)
+{
+    // Kept under half full
+    if ((canvas->num_chunks + 1) * 2 > canvas->table_size) {
+        const int size = canvas->table_size * 2;
+        Chunk **table = calloc(size, sizeof(Chunk *));
+        for (int i = 0; i < canvas->table_size; i++) {
+            Chunk *chunk = canvas->chunks[i];
+            if (chunk) *chunk_entry(table, size, chunk->cx, chunk->cy) = chunk;
+        }
+        free(canvas->chunks);
+        canvas->chunks = table;
+        canvas->table_size = size;
+    }
+    Chunk *chunk = calloc(1, sizeof(Chunk));
+    chunk->cx = cx;
+    chunk->cy = cy;
+    for (int i = 0; i < CHUNK_TILES * CHUNK_TILES; i++) {
+        chunk->tiles[i].slot = -1;
+    }
+    *chunk_entry(canvas->chunks, canvas->table_size, cx, cy) = chunk;
+    canvas->num_chunks++;
+    return chunk;
+}
+
+// NULL if the tile is outside the canvas, or hasn't been written to
+// and `write` is false. Writing marks it changed.
+static Tile *find_tile(TiledCanvas *canvas, int tx, int ty, bool write)
+{
+    if (tx < 0 || ty < 0 || tx >= canvas->tiles_x || ty >= canvas->tiles_y) return NULL;
+    const int cx = tx / CHUNK_TILES, cy = ty / CHUNK_TILES;
+    Chunk *chunk = *chunk_entry(canvas->chunks, canvas->table_size, cx, cy);
+    if (!chunk) {
+        if (!write) return NULL;
+        chunk = add_chunk(canvas, cx, cy);
+    }
+    Tile *tile = &chunk->tiles[(ty % CHUNK_TILES) * CHUNK_TILES + tx % CHUNK_TILES];
+    if (!tile->pixels) {
+        if (!write) return NULL;
+        const size_t pixels = (size_t)canvas->tile_size * canvas->tile_size;
+        tile->pixels = calloc(pixels, sizeof(Pixel));
+        canvas->stats.tiles++;
+        canvas->stats.bytes += pixels * sizeof(Pixel);
+    }
+    if (write) tile->dirty = true;
+    return tile;
+}
+
+Pixel *tiled_canvas_tile(TiledCanvas *canvas, int tx, int ty)
+{
+    Tile *tile = find_tile(canvas, tx, ty, true);
+    return tile ? tile->pixels : NULL;
+}
+
+void tiled_canvas_set(TiledCanvas *canvas, int x, int y, Pixel color)
+{
+    if (x < 0 || y < 0 || x >= canvas->width || y >= canvas->height) return;
+    const int ts = canvas->tile_size;
+    Tile *tile = find_tile(canvas, x / ts, y / ts, true);
+    tile->pixels[(y % ts) * ts + x % ts] = color;
+}
+
+Pixel tiled_canvas_get(TiledCanvas *canvas, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= canvas->width || y >= canvas->height) return (Pixel){ 0 };
+    const int ts = canvas->tile_size;
+    const Tile *tile = find_tile(canvas, x / ts, y / ts, false);
+    return tile ? tile->pixels[(y % ts) * ts + x % ts] : (Pixel){ 0 };
+}
+
+void tiled_canvas_fill(TiledCanvas *canvas, int x, int y, int w, int h, Pixel color)
+{
+    const int x0 = MAX(x, 0), y0 = MAX(y, 0);
+    const int x1 = MIN(x + w, canvas->width), y1 = MIN(y + h, canvas->height);
+    if (x1 <= x0 || y1 <= y0) return;
+    const int ts = canvas->tile_size;
+    for (int ty = y0 / ts; ty <= (y1 - 1) / ts; ty++) {
+        for (int tx = x0 / ts; tx <= (x1 - 1) / ts; tx++) {
+            Tile *tile = find_tile(canvas, tx, ty, true);
+            canvas_fill_rect(tile->pixels, ts, ts, x0 - tx * ts, y0 - ty * ts, x1 - x0, y1 - y0, color);
+        }
+    }
+}
+
+// A free layer, or the least recently drawn one not in this draw
+static int take_slot(TiledCanvas *canvas, uint64_t draw)
+{
+    int oldest = -1;
+    for (int i = 0; i < canvas->capacity; i++) {
+        Tile *tile = canvas->slots[i];
+        if (!tile) return i;
+        if (tile->last_drawn == draw) continue;
+        if (oldest < 0 || tile->last_drawn < canvas->slots[oldest]->last_drawn) oldest = i;
+    }
+    canvas->slots[oldest]->slot = -1;
+    canvas->stats.evictions++;
+    canvas->stats.resident--;
+    return oldest;
+}
+
+static void replay_draw(void *payload)
+{
+    const TiledDraw *draw = payload;
+    const TiledCanvas *canvas = draw->canvas;
+    const TileInstance *instances = (const TileInstance *)(draw + 1);
+    const int *upload_slots = (const int *)(instances + draw->instances);
+    const Pixel *pixels = (const Pixel *)(upload_slots + draw->uploads);
+    const int ts = canvas->tile_size;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, canvas->texture);
+    for (int i = 0; i < draw->uploads; i++) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, upload_slots[i], ts, ts, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                        &pixels[(size_t)i * ts * ts]);
+    }
+    if (draw->instances > 0) {
+        glUseProgram(program.shader.program);
+        const RenderView view = render_view_get();
+        glUniform4f(program.view, view.x, view.y, view.width, view.height);
+        glUniform1f(program.extent, draw->extent);
+        glBindVertexArray(canvas->vao);
+        glBindBuffer(GL_ARRAY_BUFFER, canvas->buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, draw->instances * sizeof(TileInstance), instances);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, draw->instances);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+        glUseProgram(0);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void tiled_canvas_draw(TiledCanvas *canvas, float x, float y, float scale, int scene_width, int scene_height)
+{
+    // Released with its owner, there's nothing left to draw with
+    if (!gpu_touch(canvas->texture_handle) || scale <= 0) return;
+    const uint64_t draw_number = ++canvas->draws;
+    const int ts = canvas->tile_size;
+
+    // The tiles covering the scene
+    const int tx0 = MAX(0, (int)floorf(x / ts));
+    const int ty0 = MAX(0, (int)floorf(y / ts));
+    const int tx1 = MIN(canvas->tiles_x - 1, (int)floorf((x + scene_width / scale) / ts));
+    const int ty1 = MIN(canvas->tiles_y - 1, (int)floorf((y + scene_height / scale) / ts));
+    int count = 0;
+    canvas->stats.visible = 0;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            Tile *tile = find_tile(canvas, tx, ty, false);
+            if (!tile) continue;
+            canvas->stats.visible++;
+            if (count == canvas->capacity) continue;
+            tile->last_drawn = draw_number;
+            canvas->visible[count] = tile;
+            canvas->visible_at[count * 2] = tx;
+            canvas->visible_at[count * 2 + 1] = ty;
+            count++;
+        }
+    }
+    if (canvas->stats.visible > count && !canvas->warned) {
+        canvas->warned = true;
+        fprintf(stderr, "WARNING: %d tiles in view but room for %d, leaving some out\n",
+                canvas->stats.visible, canvas->capacity);
+    }
+    canvas->stats.drawn = count;
+
+    // Make them resident, the ones that changed are uploaded
+    int uploads = 0;
+    for (int i = 0; i < count; i++) {
+        Tile *tile = canvas->visible[i];
+        if (tile->slot < 0) {
+            tile->slot = take_slot(canvas, draw_number);
+            canvas->slots[tile->slot] = tile;
+            canvas->stats.resident++;
+            tile->dirty = true;
+        }
+        if (tile->dirty) uploads++;
+    }
+    canvas->stats.uploads += uploads;
+
+    const size_t tile_bytes = (size_t)ts * ts * sizeof(Pixel);
+    const size_t size = sizeof(TiledDraw) + count * sizeof(TileInstance) + uploads * (sizeof(int) + tile_bytes);
+    TiledDraw *draw = render_thread_active() ? render_thread_record(replay_draw, size) : malloc(size);
+    *draw = (TiledDraw){ canvas, count, uploads, ts * scale };
+    TileInstance *instances = (TileInstance *)(draw + 1);
+    int *upload_slots = (int *)(instances + count);
+    uint8_t *pixels = (uint8_t *)(upload_slots + uploads);
+    for (int i = 0, u = 0; i < count; i++) {
+        Tile *tile = canvas->visible[i];
+        instances[i] = (TileInstance){
+            (canvas->visible_at[i * 2] * ts - x) * scale,
+            (canvas->visible_at[i * 2 + 1] * ts - y) * scale,
+            tile->slot,
+        };
+        if (!tile->dirty) continue;
+        upload_slots[u] = tile->slot;
+        memcpy(pixels + u * tile_bytes, tile->pixels, tile_bytes);
+        tile->dirty = false;
+        u++;
+    }
+    if (!render_thread_active()) {
+        replay_draw(draw);
+        free(draw);
+    }
+}
+
+TiledCanvasStats tiled_canvas_stats(TiledCanvas *canvas)
+{
+    return canvas->stats;
+}
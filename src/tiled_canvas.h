@@ -0,0 +1,54 @@
+/**
+ * Sparse canvases made of fixed size tiles, for scenes panning over
+ * something far bigger than the window or the GPU's texture size limit.
+ *
+ * A tile's pixels are allocated the first time it's written to; tiles that
+ * never are stay transparent and cost nothing. On the GPU, tiles live in
+ * the layers of one texture array with room for `resident` tiles. Drawing
+ * makes the visible tiles resident, evicting the least recently drawn
+ * ones, uploads those that changed and draws them all with a single
+ * instanced draw. Memory follows the area written to (CPU) and drawn (GPU)
+ * rather than the canvas size.
+ *
+ * Pixel rows go up from the bottom of the canvas, as scene coordinates do.
+ * Tiles are sampled with nearest filtering so there are no seams between
+ * them when scaled.
+ */
+
+#ifndef TILED_CANVAS_H
+#define TILED_CANVAS_H
+#include "common.h"
+
+typedef struct {
+    int tiles;          // Allocated
+    int resident;       // In the texture array
+    int capacity;       // Resident tiles there's room for
+    int visible;        // Allocated tiles in view at the last draw
+    int drawn;          // Of those, how many fitted
+    int evictions;
+    uint64_t uploads;   // Tiles
+    uint64_t bytes;     // Pixels allocated
+} TiledCanvasStats;
+
+typedef struct TiledCanvas TiledCanvas;
+
+// `tile_size` is clamped to the GPU's limits and `resident` to its array
+// texture layers
+TiledCanvas *tiled_canvas_new(int width, int height, int tile_size, int resident);
+void tiled_canvas_free(TiledCanvas *canvas);
+int tiled_canvas_tile_size(TiledCanvas *canvas);
+// The pixels of tile tx, ty, tile_size rows of tile_size, allocating it if
+// needed. It's marked changed, write to it before the next draw.
+Pixel *tiled_canvas_tile(TiledCanvas *canvas, int tx, int ty);
+void tiled_canvas_set(TiledCanvas *canvas, int x, int y, Pixel color);
+// Transparent where nothing was written
+Pixel tiled_canvas_get(TiledCanvas *canvas, int x, int y);
+// Clipped to the canvas
+void tiled_canvas_fill(TiledCanvas *canvas, int x, int y, int w, int h, Pixel color);
+// Draws the canvas with its pixel x, y at the scene's origin, `scale` scene
+// pixels per canvas pixel. Only tiles inside the scene_width x scene_height
+// scene are drawn.
+void tiled_canvas_draw(TiledCanvas *canvas, float x, float y, float scale, int scene_width, int scene_height);
+TiledCanvasStats tiled_canvas_stats(TiledCanvas *canvas);
+
+#endif // TILED_CANVAS_H
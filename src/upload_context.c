@@ -0,0 +1,267 @@
+/*
+ * The upload worker.
+ *
+ * Everything a job needs (pixels, shader sources) is copied when it's
+ * submitted so Lua can throw away its copy right away. After running a job
+ * the worker puts down a fence and waits on it on its own context, which
+ * means the main side only ever has to look at the job's state to know
+ * the object is complete. No GL calls are needed to poll, which matters
+ * when the main context lives on the render thread.
+ */
+
+#include "upload_context.h"
+#include "background_renderer.h"
+#include "render_thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define FENCE_TIMEOUT_NS 100000000 // 100ms, waited on repeatedly
+
+typedef enum {
+    JOB_FREE = 0,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+} JobState;
+
+typedef enum {
+    JOB_TEXTURE,
+    JOB_PROGRAM,
+} JobType;
+
+typedef struct {
+    JobType type;
+    JobState state;
+    uint64_t order;
+    // Inputs
+    void *pixels;
+    int width, height;
+    CanvasFormat format;
+    char *id, *vertex_source, *fragment_source;
+    // Output
+    GLuint object;
+} UploadJob;
+
+static struct {
+    SDL_Window *window;     // Hidden, contexts need a drawable
+    SDL_GLContext context;
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *cond;
+    bool running;
+    bool stopping;
+    uint64_t next_order;
+    UploadJob jobs[UPLOAD_MAX_JOBS];
+} up = { 0 };
+
+static char *copy_string(const char *s) {
+    const size_t len = strlen(s) + 1;
+    char *copy = malloc(len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+static void free_inputs(UploadJob *job) {
+    free(job->pixels);
+    free(job->id);
+    free(job->vertex_source);
+    free(job->fragment_source);
+    job->pixels = NULL;
+    job->id = job->vertex_source = job->fragment_source = NULL;
+}
+
+static void run_job(UploadJob *job) {
+    switch (job->type) {
+    case JOB_TEXTURE:
+        job->object = bg_new_canvas_texture(job->pixels, job->width, job->height, job->format);
+        break;
+    case JOB_PROGRAM:
+        job->object = shader_try_link_from_source(job->id, job->vertex_source, job->fragment_source);
+        break;
+    }
+
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NS) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync(fence);
+}
+
+// Oldest queued job, lock must be held
+static UploadJob *next_job(void) {
+    UploadJob *next = NULL;
+    for (int i = 0; i < UPLOAD_MAX_JOBS; i++) {
+        UploadJob *job = &up.jobs[i];
+        if (job->state == JOB_QUEUED && (!next || job->order < next->order)) {
+            next = job;
+        }
+    }
+    return next;
+}
+
+static int upload_thread_main(void *data) {
+    (void)data;
+    if (SDL_GL_MakeCurrent(up.window, up.context) < 0) {
+        fprintf(stderr, "WARNING: upload thread unable to take GL context: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SDL_LockMutex(up.lock);
+    for (;;) {
+        UploadJob *job;
+        while ((job = next_job()) == NULL && !up.stopping) {
+            SDL_CondWait(up.cond, up.lock);
+        }
+        if (up.stopping) break;
+
+        job->state = JOB_RUNNING;
+        SDL_UnlockMutex(up.lock);
+        run_job(job);
+        SDL_LockMutex(up.lock);
+
+        free_inputs(job);
+        job->state = job->object ? JOB_DONE : JOB_FAILED;
+    }
+    SDL_UnlockMutex(up.lock);
+
+    SDL_GL_MakeCurrent(up.window, NULL);
+    return 0;
+}
+
+bool upload_context_init(SDL_Window *window) {
+    SDL_GLContext main_context = SDL_GL_GetCurrentContext();
+
+    up.window = SDL_CreateWindow("bubbl upload", 0, 0, 1, 1, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    if (up.window == NULL) {
+        fprintf(stderr, "WARNING: unable to create upload window: %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+    up.context = SDL_GL_CreateContext(up.window);
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+    // Creating a context makes it current
+    SDL_GL_MakeCurrent(window, main_context);
+    if (up.context == NULL) {
+        fprintf(stderr, "WARNING: unable to create upload context: %s\n", SDL_GetError());
+        SDL_DestroyWindow(up.window);
+        return false;
+    }
+
+    up.lock = SDL_CreateMutex();
+    up.cond = SDL_CreateCond();
+    up.thread = SDL_CreateThread(upload_thread_main, "bubbl upload", NULL);
+    if (up.thread == NULL) {
+        fprintf(stderr, "WARNING: unable to create upload thread: %s\n", SDL_GetError());
+        SDL_GL_DeleteContext(up.context);
+        SDL_DestroyWindow(up.window);
+        return false;
+    }
+    up.running = true;
+    return true;
+}
+
+void upload_context_shutdown(void) {
+    if (!up.running) return;
+    SDL_LockMutex(up.lock);
+    up.stopping = true;
+    SDL_CondBroadcast(up.cond);
+    SDL_UnlockMutex(up.lock);
+    SDL_WaitThread(up.thread, NULL);
+    up.running = false;
+
+    for (int i = 0; i < UPLOAD_MAX_JOBS; i++) free_inputs(&up.jobs[i]);
+    SDL_GL_DeleteContext(up.context);
+    SDL_DestroyWindow(up.window);
+    SDL_DestroyCond(up.cond);
+    SDL_DestroyMutex(up.lock);
+}
+
+bool upload_context_available(void) {
+    return up.running;
+}
+
+// Queue a prepared job, returning its handle
+static int submit(UploadJob job) {
+    if (!up.running) return -1;
+    SDL_LockMutex(up.lock);
+    int handle = -1;
+    for (int i = 0; i < UPLOAD_MAX_JOBS; i++) {
+        if (up.jobs[i].state == JOB_FREE) {
+            handle = i;
+            break;
+        }
+    }
+    if (handle >= 0) {
+        job.state = JOB_QUEUED;
+        job.order = up.next_order++;
+        up.jobs[handle] = job;
+        SDL_CondSignal(up.cond);
+    }
+    SDL_UnlockMutex(up.lock);
+    if (handle < 0) free_inputs(&job);
+    return handle;
+}
+
+int upload_texture_async(const void *data, int width, int height, CanvasFormat format) {
+    const size_t bytes = (size_t)width * height * bg_format_bytes(format);
+    UploadJob job = {
+        .type = JOB_TEXTURE,
+        .pixels = malloc(bytes),
+        .width = width,
+        .height = height,
+        .format = format,
+    };
+    memcpy(job.pixels, data, bytes);
+    return submit(job);
+}
+
+int upload_program_async(const char *id, const char *vertex_source, const char *fragment_source) {
+    return submit((UploadJob){
+        .type = JOB_PROGRAM,
+        .id = copy_string(id),
+        .vertex_source = copy_string(vertex_source),
+        .fragment_source = copy_string(fragment_source),
+    });
+}
+
+UploadStatus upload_status(int handle) {
+    assert(handle >= 0 && handle < UPLOAD_MAX_JOBS);
+    SDL_LockMutex(up.lock);
+    const JobState state = up.jobs[handle].state;
+    SDL_UnlockMutex(up.lock);
+    switch (state) {
+        case JOB_DONE: return UPLOAD_READY;
+        case JOB_FAILED: return UPLOAD_FAILED;
+        default: return UPLOAD_PENDING;
+    }
+}
+
+static GLuint take(int handle) {
+    assert(handle >= 0 && handle < UPLOAD_MAX_JOBS);
+    SDL_LockMutex(up.lock);
+    UploadJob *job = &up.jobs[handle];
+    GLuint object = job->state == JOB_DONE ? job->object : 0;
+    if (job->state == JOB_DONE || job->state == JOB_FAILED) {
+        *job = (UploadJob){ 0 };
+    }
+    SDL_UnlockMutex(up.lock);
+    return object;
+}
+
+unsigned int upload_take_texture(int handle) {
+    return take(handle);
+}
+
+static void init_quad(void *arg) {
+    shader_init_quad(arg);
+}
+
+bool upload_take_program(int handle, Shader *shader) {
+    GLuint program = take(handle);
+    if (!program) return false;
+    // The quad VAO has to be made by the context that draws with it
+    render_thread_invoke(init_quad, shader);
+    shader->program = program;
+    return true;
+}
@@ -0,0 +1,39 @@
+/**
+ * Background GL context for texture uploads and shader compilation.
+ *
+ * A worker thread owns a second GL context sharing objects with the main
+ * one. Jobs are submitted from Lua, run on the worker, and fenced. Lua polls
+ * the job each frame and picks up the texture or program once it's ready,
+ * so the render thread never waits on the driver's compiler or a big upload.
+ */
+
+#ifndef UPLOAD_CONTEXT_H
+#define UPLOAD_CONTEXT_H
+#include "common.h"
+#include "background_renderer.h"
+#include "shaderutil.h"
+#include <SDL.h>
+
+#define UPLOAD_MAX_JOBS 64
+
+typedef enum {
+    UPLOAD_PENDING = 0,
+    UPLOAD_READY,
+    UPLOAD_FAILED,
+} UploadStatus;
+
+// Must be called with the main context current
+bool upload_context_init(SDL_Window *window);
+void upload_context_shutdown(void);
+bool upload_context_available(void);
+
+// Return a job handle, or -1 if the job can't be queued
+int upload_texture_async(const void *data, int width, int height, CanvasFormat format);
+int upload_program_async(const char *id, const char *vertex_source, const char *fragment_source);
+
+UploadStatus upload_status(int job);
+// Take the result of a ready job, freeing the handle
+unsigned int upload_take_texture(int job);
+bool upload_take_program(int job, Shader *shader);
+
+#endif // UPLOAD_CONTEXT_H
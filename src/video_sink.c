@@ -0,0 +1,337 @@
+/*
+ * Y4M is a text header followed by "FRAME\n" and the planar Y, U and V
+ * planes of each frame. Conversion uses the BT.601 full range ("JPEG")
+ * coefficients in 8 bit fixed point. The SSE2 path converts 8 pixels at a
+ * time and has to give exactly the scalar results, so the intermediate
+ * values are arranged to always fit in 16 bits.
+ */
+
+#include "video_sink.h"
+#include "frame_queue.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct VideoSink {
+    FILE *file;
+    bool is_stdout;
+    VideoSinkSettings settings;
+
+    FrameQueue *frames;  // Consumed by the writer thread
+    SDL_mutex *lock;     // For the stats and size
+
+    // Set by the first frame
+    int width, height;
+
+    // Writer thread only
+    uint8_t *out;        // Last frame as written, repeated to fill gaps
+    size_t out_size;
+    double start_time;
+    int64_t next_index;  // Output frame the next write will be
+    double total_write_ms;
+
+    VideoSinkStats stats;
+};
+
+//
+// RGB to YUV
+//
+
+static inline uint8_t y_of(int r, int g, int b) {
+    return (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+}
+
+// The + 32896 (128.5 * 256) keeps the shifted value positive
+static inline uint8_t u_of(int r, int g, int b) {
+    return (uint8_t)MIN((-43 * r - 85 * g + 128 * b + 32896) >> 8, 255);
+}
+
+static inline uint8_t v_of(int r, int g, int b) {
+    return (uint8_t)MIN((128 * r - 107 * g - 21 * b + 32896) >> 8, 255);
+}
+
+static void luma_scalar(const uint8_t *rgba, int from, int to, uint8_t *y) {
+    for (int x = from; x < to; x++) {
+        const uint8_t *p = &rgba[x * 4];
+        y[x] = y_of(p[0], p[1], p[2]);
+    }
+}
+
+// Chroma for columns [from, to) of a pair of rows (which may be the same row)
+static void chroma_scalar(const uint8_t *row_a, const uint8_t *row_b, int width, int from, int to, uint8_t *u, uint8_t *v) {
+    for (int cx = from; cx < to; cx++) {
+        const int x0 = cx * 2 * 4;
+        const int x1 = MIN(cx * 2 + 1, width - 1) * 4;
+        int avg[3];
+        for (int c = 0; c < 3; c++) {
+            avg[c] = (row_a[x0 + c] + row_a[x1 + c] + row_b[x0 + c] + row_b[x1 + c] + 2) >> 2;
+        }
+        u[cx] = u_of(avg[0], avg[1], avg[2]);
+        v[cx] = v_of(avg[0], avg[1], avg[2]);
+    }
+}
+
+#ifdef __SSE2__
+// Split 8 RGBA pixels into 16 bit R, G and B
+static inline void load8(const uint8_t *p, __m128i *r, __m128i *g, __m128i *b) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i lo = _mm_loadu_si128((const __m128i *)p);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+    *r = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+    *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask), _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+    *b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask), _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+}
+
+// Average 2x2 blocks of 16 pixels from two rows down to 8
+static inline __m128i average2x2(__m128i a0, __m128i a1, __m128i b0, __m128i b1) {
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i sum0 = _mm_madd_epi16(_mm_add_epi16(a0, b0), ones);
+    const __m128i sum1 = _mm_madd_epi16(_mm_add_epi16(a1, b1), ones);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(sum0, sum1), _mm_set1_epi16(2)), 2);
+}
+
+// (cr*r + cg*g + cb*b + 128) >> 8, + 128. The weighted sum always fits in
+// 16 bits, only the single largest value saturates, which clamps anyway.
+static inline __m128i chroma8(__m128i r, __m128i g, __m128i b, short cr, short cg, short cb) {
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)),
+                                              _mm_mullo_epi16(g, _mm_set1_epi16(cg))),
+                                _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    sum = _mm_srai_epi16(_mm_adds_epi16(sum, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(sum, _mm_set1_epi16(128));
+}
+
+static void rgba_to_yuv420(const uint8_t *rgba, int width, int height, uint8_t *y, uint8_t *u, uint8_t *v) {
+    const int chroma_width = (width + 1) / 2;
+    const size_t stride = (size_t)width * 4;
+    const __m128i c77 = _mm_set1_epi16(77), c150 = _mm_set1_epi16(150);
+    const __m128i c29 = _mm_set1_epi16(29), c128 = _mm_set1_epi16(128);
+
+    for (int row = 0; row < height; row++) {
+        const uint8_t *src = &rgba[row * stride];
+        uint8_t *dst = &y[(size_t)row * width];
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i r, g, b;
+            load8(&src[x * 4], &r, &g, &b);
+            // At most 65408, so unsigned 16 bit wrapping arithmetic is exact
+            __m128i luma = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, c77), _mm_mullo_epi16(g, c150)),
+                                         _mm_add_epi16(_mm_mullo_epi16(b, c29), c128));
+            luma = _mm_srli_epi16(luma, 8);
+            _mm_storel_epi64((__m128i *)&dst[x], _mm_packus_epi16(luma, luma));
+        }
+        luma_scalar(src, x, width, dst);
+    }
+
+    for (int cy = 0; cy < (height + 1) / 2; cy++) {
+        const uint8_t *row_a = &rgba[cy * 2 * stride];
+        const uint8_t *row_b = &rgba[MIN(cy * 2 + 1, height - 1) * stride];
+        uint8_t *du = &u[(size_t)cy * chroma_width];
+        uint8_t *dv = &v[(size_t)cy * chroma_width];
+        int cx = 0;
+        for (; cx * 2 + 16 <= width; cx += 8) {
+            __m128i ra0, ga0, ba0, ra1, ga1, ba1, rb0, gb0, bb0, rb1, gb1, bb1;
+            load8(&row_a[cx * 2 * 4], &ra0, &ga0, &ba0);
+            load8(&row_a[cx * 2 * 4 + 32], &ra1, &ga1, &ba1);
+            load8(&row_b[cx * 2 * 4], &rb0, &gb0, &bb0);
+            load8(&row_b[cx * 2 * 4 + 32], &rb1, &gb1, &bb1);
+            const __m128i r = average2x2(ra0, ra1, rb0, rb1);
+            const __m128i g = average2x2(ga0, ga1, gb0, gb1);
+            const __m128i b = average2x2(ba0, ba1, bb0, bb1);
+            const __m128i cu = chroma8(r, g, b, -43, -85, 128);
+            const __m128i cv = chroma8(r, g, b, 128, -107, -21);
+            _mm_storel_epi64((__m128i *)&du[cx], _mm_packus_epi16(cu, cu));
+            _mm_storel_epi64((__m128i *)&dv[cx], _mm_packus_epi16(cv, cv));
+        }
+        chroma_scalar(row_a, row_b, width, cx, chroma_width, du, dv);
+    }
+}
+#else
+static void rgba_to_yuv420(const uint8_t *rgba, int width, int height, uint8_t *y, uint8_t *u, uint8_t *v) {
+    const int chroma_width = (width + 1) / 2;
+    const size_t stride = (size_t)width * 4;
+    for (int row = 0; row < height; row++) {
+        luma_scalar(&rgba[row * stride], 0, width, &y[(size_t)row * width]);
+    }
+    for (int cy = 0; cy < (height + 1) / 2; cy++) {
+        const uint8_t *row_a = &rgba[cy * 2 * stride];
+        const uint8_t *row_b = &rgba[MIN(cy * 2 + 1, height - 1) * stride];
+        chroma_scalar(row_a, row_b, width, 0, chroma_width,
+                      &u[(size_t)cy * chroma_width], &v[(size_t)cy * chroma_width]);
+    }
+}
+#endif
+
+//
+// Writer
+//
+
+static size_t frame_size(VideoSink *sink) {
+    if (sink->settings.format == VIDEO_RGBA) {
+        return (size_t)sink->width * sink->height * 4;
+    }
+    const size_t chroma = (size_t)((sink->width + 1) / 2) * ((sink->height + 1) / 2);
+    return (size_t)sink->width * sink->height + 2 * chroma;
+}
+
+static bool write_bytes(VideoSink *sink, const void *data, size_t size) {
+    if (fwrite(data, 1, size, sink->file) != size) {
+        fprintf(stderr, "WARNING: video output failed, stopping: %s\n", ERROR());
+        return false;
+    }
+    sink->stats.bytes += size;
+    return true;
+}
+
+static bool write_out(VideoSink *sink) {
+    if (sink->settings.format == VIDEO_Y4M && !write_bytes(sink, "FRAME\n", 6)) return false;
+    return write_bytes(sink, sink->out, sink->out_size);
+}
+
+static void convert(VideoSink *sink, QueuedFrame *frame) {
+    if (sink->settings.format == VIDEO_RGBA) {
+        memcpy(sink->out, frame->pixels, sink->out_size);
+        return;
+    }
+    uint8_t *y = sink->out;
+    uint8_t *u = y + (size_t)sink->width * sink->height;
+    uint8_t *v = u + (size_t)((sink->width + 1) / 2) * ((sink->height + 1) / 2);
+    rgba_to_yuv420(frame->pixels, sink->width, sink->height, y, u, v);
+}
+
+// On the writer thread, lock is not held
+static void write_frame(void *user, QueuedFrame *frame) {
+    VideoSink *sink = user;
+    if (sink->stats.failed) return;
+    if (sink->out == NULL) {
+        sink->out_size = frame_size(sink);
+        sink->out = malloc(sink->out_size);
+        if (sink->out == NULL) {
+            fprintf(stderr, "WARNING: out of memory for a %dx%d video frame, stopping\n", sink->width, sink->height);
+            SDL_LockMutex(sink->lock);
+            sink->stats.failed = true;
+            SDL_UnlockMutex(sink->lock);
+            return;
+        }
+        sink->start_time = frame->timestamp;
+    }
+
+    const Uint64 started = SDL_GetPerformanceCounter();
+    const int64_t index = (int64_t)((frame->timestamp - sink->start_time) * sink->settings.fps + 0.5);
+    int repeated = 0, written = 0;
+    bool ok = true, skipped = false;
+    if (index < sink->next_index) {
+        skipped = true;
+    } else {
+        // Hold the previous frame until this one is due
+        if (sink->next_index > 0) {
+            for (; ok && sink->next_index < index; sink->next_index++) {
+                ok = write_out(sink);
+                repeated++;
+            }
+        }
+        sink->next_index = index;
+        if (ok) {
+            convert(sink, frame);
+            ok = write_out(sink);
+            written++;
+            sink->next_index++;
+        }
+    }
+    const float ms = (float)((double)(SDL_GetPerformanceCounter() - started) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+
+    SDL_LockMutex(sink->lock);
+    VideoSinkStats *stats = &sink->stats;
+    stats->written += written + repeated;
+    stats->repeated += repeated;
+    if (skipped) stats->skipped++;
+    if (!ok) stats->failed = true;
+    if (written) {
+        sink->total_write_ms += ms;
+        stats->mean_write_ms = sink->total_write_ms / (stats->written - stats->repeated);
+        stats->max_write_ms = MAX(stats->max_write_ms, ms);
+    }
+    SDL_UnlockMutex(sink->lock);
+}
+
+VideoSink *video_sink_open(const char *path, VideoSinkSettings settings) {
+    if (settings.fps <= 0) settings.fps = 60;
+
+    VideoSink *sink = calloc(1, sizeof(VideoSink));
+    sink->settings = settings;
+    sink->is_stdout = strcmp(path, "-") == 0;
+    // Opening a FIFO blocks until there's a reader, which is what we want
+    sink->file = sink->is_stdout ? stdout : fopen(path, "wb");
+    if (sink->file == NULL) {
+        fprintf(stderr, "ERROR: unable to open video output %s: %s\n", path, ERROR());
+        free(sink);
+        return NULL;
+    }
+    sink->lock = SDL_CreateMutex();
+    sink->frames = frame_queue_new("bubbl video", settings.pool_frames, settings.block_when_full, write_frame, sink);
+    if (sink->frames == NULL) {
+        if (!sink->is_stdout) fclose(sink->file);
+        SDL_DestroyMutex(sink->lock);
+        free(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+bool video_sink_add_frame(VideoSink *sink, const uint8_t *pixels, int width, int height, double timestamp) {
+    SDL_LockMutex(sink->lock);
+    sink->stats.captured++;
+    if (sink->stats.failed) {
+        SDL_UnlockMutex(sink->lock);
+        return false;
+    }
+    if (sink->width == 0) {
+        // The first frame fixes the video size, the header goes out with it
+        sink->width = width;
+        sink->height = height;
+        if (sink->settings.format == VIDEO_Y4M) {
+            fprintf(sink->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, sink->settings.fps);
+        }
+    }
+    if (width != sink->width || height != sink->height) {
+        sink->stats.mismatched++;
+        SDL_UnlockMutex(sink->lock);
+        return false;
+    }
+    SDL_UnlockMutex(sink->lock);
+
+    if (!frame_queue_push(sink->frames, pixels, width, height, timestamp)) {
+        SDL_LockMutex(sink->lock);
+        sink->stats.dropped++;
+        SDL_UnlockMutex(sink->lock);
+        return false;
+    }
+    return true;
+}
+
+VideoSinkStats video_sink_close(VideoSink *sink) {
+    // Writes what's queued before returning
+    frame_queue_free(sink->frames);
+
+    VideoSinkStats stats = sink->stats;
+    if (sink->is_stdout) {
+        fflush(stdout);
+    } else {
+        fclose(sink->file);
+    }
+    free(sink->out);
+    SDL_DestroyMutex(sink->lock);
+    free(sink);
+    return stats;
+}
+
+VideoSinkStats video_sink_stats(VideoSink *sink) {
+    SDL_LockMutex(sink->lock);
+    VideoSinkStats stats = sink->stats;
+    SDL_UnlockMutex(sink->lock);
+    stats.queued = frame_queue_pending(sink->frames);
+    return stats;
+}
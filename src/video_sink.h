@@ -0,0 +1,52 @@
+/**
+ * Streams captured frames to a file, FIFO or stdout as YUV4MPEG2 or raw
+ * RGBA, for piping into an external encoder such as ffmpeg.
+ *
+ * Like the GIF recorder, frames are copied into a FrameQueue and a writer
+ * thread converts and writes them. Output is constant frame rate: frames
+ * are placed by timestamp, gaps (including dropped frames) repeat the
+ * previous frame and frames arriving early are skipped.
+ */
+
+#ifndef VIDEO_SINK_H
+#define VIDEO_SINK_H
+#include "common.h"
+
+typedef enum {
+    VIDEO_Y4M = 0, // 4:2:0 full range, ffmpeg reads it as yuvj420p
+    VIDEO_RGBA,    // Headerless, needs -f rawvideo -pixel_format rgba -video_size WxH
+} VideoFormat;
+
+typedef struct {
+    VideoFormat format;
+    int fps;
+    int pool_frames;
+    bool block_when_full;
+} VideoSinkSettings;
+
+typedef struct {
+    int captured;
+    int written;     // Frames in the output, including repeats
+    int repeated;    // Written again to fill a gap
+    int skipped;     // Came in faster than the frame rate
+    int dropped;     // Pool was full
+    int mismatched;  // Different size from the first frame
+    int queued;
+    uint64_t bytes;
+    float mean_write_ms;
+    float max_write_ms;
+    bool failed;     // Output closed or errored, nothing more is written
+} VideoSinkStats;
+
+typedef struct VideoSink VideoSink;
+
+// "-" writes to stdout
+VideoSink *video_sink_open(const char *path, VideoSinkSettings settings);
+// Copies the RGBA pixels (top row first), returns false if dropped
+bool video_sink_add_frame(VideoSink *sink, const uint8_t *pixels, int width, int height, double timestamp);
+// Writes what's queued, closes the output and frees the sink.
+// Returns the final stats.
+VideoSinkStats video_sink_close(VideoSink *sink);
+VideoSinkStats video_sink_stats(VideoSink *sink);
+
+#endif // VIDEO_SINK_H
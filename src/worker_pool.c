@@ -0,0 +1,207 @@
+/*
+ * Jobs sit in a ring buffer guarded by one mutex. Workers wait on
+ * `has_work`, blocked submitters on `has_room`. Finished results go in a
+ * growable array until they are polled.
+ */
+
+#include "worker_pool.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define MAX_THREADS 16
+
+typedef struct {
+    int id;
+    WorkFn fn;
+    void *arg;
+    Uint64 queued_at;
+} Job;
+
+struct WorkerPool {
+    SDL_mutex *lock;
+    SDL_cond *has_work;
+    SDL_cond *has_room;
+    SDL_Thread *threads[MAX_THREADS];
+    int num_threads;
+    bool stopping;
+    Backpressure backpressure;
+
+    Job *queue;
+    int capacity;
+    int head; // Next job to run
+    int count;
+    int next_id;
+
+    WorkResult *results;
+    int num_results;
+    int results_capacity;
+
+    WorkerPoolStats stats;
+    double total_wait_ms;
+    double total_run_ms;
+};
+
+static float elapsed_ms(Uint64 from, Uint64 to) {
+    return (float)((double)(to - from) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+}
+
+// Lock must be held
+static void add_result(WorkerPool *pool, WorkResult result) {
+    if (pool->num_results == pool->results_capacity) {
+        pool->results_capacity = pool->results_capacity ? pool->results_capacity * 2 : 16;
+        pool->results = realloc(pool->results, pool->results_capacity * sizeof(WorkResult));
+        assert(pool->results);
+    }
+    pool->results[pool->num_results++] = result;
+
+    WorkerPoolStats *stats = &pool->stats;
+    stats->completed++;
+    pool->total_wait_ms += result.wait_ms;
+    pool->total_run_ms += result.run_ms;
+    stats->mean_wait_ms = pool->total_wait_ms / stats->completed;
+    stats->mean_run_ms = pool->total_run_ms / stats->completed;
+    stats->max_wait_ms = MAX(stats->max_wait_ms, result.wait_ms);
+    stats->max_run_ms = MAX(stats->max_run_ms, result.run_ms);
+}
+
+static int worker_main(void *data) {
+    WorkerPool *pool = data;
+    SDL_LockMutex(pool->lock);
+    for (;;) {
+        while (pool->count == 0 && !pool->stopping) {
+            SDL_CondWait(pool->has_work, pool->lock);
+        }
+        // Drain the queue before stopping
+        if (pool->count == 0) break;
+
+        Job job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->stats.running++;
+        SDL_CondSignal(pool->has_room);
+        SDL_UnlockMutex(pool->lock);
+
+        const Uint64 started = SDL_GetPerformanceCounter();
+        const bool ok = job.fn(job.arg);
+        const Uint64 finished = SDL_GetPerformanceCounter();
+
+        SDL_LockMutex(pool->lock);
+        pool->stats.running--;
+        add_result(pool, (WorkResult){
+            .id = job.id,
+            .ok = ok,
+            .wait_ms = elapsed_ms(job.queued_at, started),
+            .run_ms = elapsed_ms(started, finished),
+        });
+    }
+    SDL_UnlockMutex(pool->lock);
+    return 0;
+}
+
+WorkerPool *worker_pool_new(const char *name, int threads, int capacity, Backpressure backpressure) {
+    assert(capacity > 0);
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    pool->lock = SDL_CreateMutex();
+    pool->has_work = SDL_CreateCond();
+    pool->has_room = SDL_CreateCond();
+    pool->backpressure = backpressure;
+    pool->capacity = capacity;
+    pool->queue = malloc(capacity * sizeof(Job));
+
+    threads = MIN(MAX(threads, 1), MAX_THREADS);
+    for (int i = 0; i < threads; i++) {
+        SDL_Thread *thread = SDL_CreateThread(worker_main, name, pool);
+        if (thread == NULL) {
+            fprintf(stderr, "WARNING: unable to create %s worker: %s\n", name, SDL_GetError());
+            break;
+        }
+        pool->threads[pool->num_threads++] = thread;
+    }
+    if (pool->num_threads == 0) {
+        worker_pool_free(pool);
+        return NULL;
+    }
+    pool->stats.threads = pool->num_threads;
+    return pool;
+}
+
+void worker_pool_free(WorkerPool *pool) {
+    SDL_LockMutex(pool->lock);
+    pool->stopping = true;
+    SDL_CondBroadcast(pool->has_work);
+    SDL_UnlockMutex(pool->lock);
+    for (int i = 0; i < pool->num_threads; i++) {
+        SDL_WaitThread(pool->threads[i], NULL);
+    }
+    SDL_DestroyCond(pool->has_room);
+    SDL_DestroyCond(pool->has_work);
+    SDL_DestroyMutex(pool->lock);
+    free(pool->queue);
+    free(pool->results);
+    free(pool);
+}
+
+// Lock must be held. Unwraps the ring into a bigger buffer.
+static void grow_queue(WorkerPool *pool) {
+    const int capacity = pool->capacity * 2;
+    Job *queue = malloc(capacity * sizeof(Job));
+    for (int i = 0; i < pool->count; i++) {
+        queue[i] = pool->queue[(pool->head + i) % pool->capacity];
+    }
+    free(pool->queue);
+    pool->queue = queue;
+    pool->capacity = capacity;
+    pool->head = 0;
+}
+
+int worker_pool_submit(WorkerPool *pool, WorkFn fn, void *arg) {
+    SDL_LockMutex(pool->lock);
+    if (pool->count == pool->capacity) {
+        switch (pool->backpressure) {
+        case BACKPRESSURE_BLOCK:
+            while (pool->count == pool->capacity) {
+                SDL_CondWait(pool->has_room, pool->lock);
+            }
+            break;
+        case BACKPRESSURE_DROP:
+            pool->stats.dropped++;
+            SDL_UnlockMutex(pool->lock);
+            return -1;
+        case BACKPRESSURE_GROW:
+            grow_queue(pool);
+            break;
+        }
+    }
+    const int id = pool->next_id++;
+    pool->queue[(pool->head + pool->count) % pool->capacity] = (Job){
+        .id = id,
+        .fn = fn,
+        .arg = arg,
+        .queued_at = SDL_GetPerformanceCounter(),
+    };
+    pool->count++;
+    pool->stats.peak_queued = MAX(pool->stats.peak_queued, pool->count);
+    SDL_CondSignal(pool->has_work);
+    SDL_UnlockMutex(pool->lock);
+    return id;
+}
+
+int worker_pool_poll(WorkerPool *pool, WorkResult *results, int max) {
+    SDL_LockMutex(pool->lock);
+    const int n = MIN(max, pool->num_results);
+    memcpy(results, pool->results, n * sizeof(WorkResult));
+    memmove(pool->results, pool->results + n, (pool->num_results - n) * sizeof(WorkResult));
+    pool->num_results -= n;
+    SDL_UnlockMutex(pool->lock);
+    return n;
+}
+
+WorkerPoolStats worker_pool_stats(WorkerPool *pool) {
+    SDL_LockMutex(pool->lock);
+    WorkerPoolStats stats = pool->stats;
+    stats.queued = pool->count;
+    SDL_UnlockMutex(pool->lock);
+    return stats;
+}
@@ -0,0 +1,55 @@
+/**
+ * A fixed set of worker threads pulling jobs from a bounded queue.
+ *
+ * A job is a function and an argument it owns. Results (and how long each
+ * job waited and ran) are collected so the submitting thread can poll them,
+ * typically once a frame.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+#include "common.h"
+
+// What submitting does when the queue is full
+typedef enum {
+    BACKPRESSURE_BLOCK = 0, // Wait for a free spot
+    BACKPRESSURE_DROP,      // Refuse the job
+    BACKPRESSURE_GROW,      // Make the queue bigger
+} Backpressure;
+
+// Runs on a worker. Must free `arg`, returns whether the job succeeded.
+typedef bool (*WorkFn)(void *arg);
+
+typedef struct {
+    int id;
+    bool ok;
+    float wait_ms; // Queued before a worker picked it up
+    float run_ms;
+} WorkResult;
+
+typedef struct {
+    int threads;
+    int queued;
+    int running;
+    int peak_queued;
+    int completed;
+    int dropped;
+    float mean_wait_ms;
+    float max_wait_ms;
+    float mean_run_ms;
+    float max_run_ms;
+} WorkerPoolStats;
+
+typedef struct WorkerPool WorkerPool;
+
+WorkerPool *worker_pool_new(const char *name, int threads, int capacity, Backpressure backpressure);
+// Finishes every queued job first
+void worker_pool_free(WorkerPool *pool);
+
+// Returns a job id, or -1 if it was dropped (`arg` is then still the caller's)
+int worker_pool_submit(WorkerPool *pool, WorkFn fn, void *arg);
+// Take up to `max` completed results, returns how many
+int worker_pool_poll(WorkerPool *pool, WorkResult *results, int max);
+WorkerPoolStats worker_pool_stats(WorkerPool *pool);
+
+#endif // WORKER_POOL_H
@@ -25,6 +25,28 @@ if (reload) {
     }
 }
 
+const replay = document.getElementById("replay")
+if (replay) {
+    replay.onclick = async () => {
+        await fetch("/action/replay", { method: "POST" });
+    }
+}
+
+// The preview only streams while it's shown
+const previewToggle = document.getElementById("preview-toggle")
+const preview = document.getElementById("preview")
+if (previewToggle && preview) {
+    previewToggle.onclick = () => {
+        if (preview.getAttribute("src")) {
+            // Clearing the source drops the connection
+            preview.src = "";
+            preview.removeAttribute("src");
+        } else {
+            preview.src = "/api/stream";
+        }
+    }
+}
+
 function attachListeners() {
     const configs = document.querySelectorAll(".config")
     for (const config of configs) {